@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+/*
+ * The asynchronous facade for the blksnap library.
+ * The blocking calls are performed by a small pool of threads, and the result
+ * is returned to the completion callback or to the std::future. The events
+ * of all snapshots are waited for by a single dispatcher thread. When the
+ * library is built with C++20 coroutines support, the operations can also be
+ * awaited with co_await.
+ * It is built as the separate library blksnap-async.
+ */
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Cbt.h"
+#include "Snapshot.h"
+#include "Tracker.h"
+
+#if (__cplusplus >= 202002L) && defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define BLKSNAP_ASYNC_COROUTINE
+#endif
+
+namespace blksnap
+{
+    class CExecutor
+    {
+    public:
+        /*
+         * If the threadCount is zero, then the number of threads is equal
+         * to the number of processors.
+         */
+        CExecutor(unsigned int threadCount = 0);
+        ~CExecutor();
+
+        /*
+         * The task should not throw exceptions. The exceptions are ignored.
+         */
+        void Post(std::function<void()> task);
+
+    private:
+        void Worker();
+
+    private:
+        std::mutex m_lock;
+        std::condition_variable m_cond;
+        std::deque<std::function<void()>> m_tasks;
+        bool m_stop;
+        std::vector<std::thread> m_threads;
+    };
+
+    using AsyncCallback = std::function<void(std::exception_ptr ex)>;
+    template<class T>
+    using AsyncResultCallback = std::function<void(std::exception_ptr ex, T result)>;
+
+    /*
+     * The only thread that waits for the events of all snapshots. The
+     * snapshots are polled without blocking, so the number of snapshots that
+     * are waited for at the same time is not limited by the number of threads.
+     * The completions are posted to the executor.
+     */
+    class CEventDispatcher
+    {
+    public:
+        CEventDispatcher(CExecutor& executor);
+        ~CEventDispatcher();
+
+        /*
+         * The result is nullptr if the event was not received before the
+         * timeout expired or the dispatcher was stopped.
+         */
+        void Wait(const std::shared_ptr<CSnapshot>& ptrSnapshot, const unsigned int timeoutMs,
+                  const AsyncResultCallback<std::shared_ptr<SBlksnapEvent>>& callback);
+
+    private:
+        struct SWait
+        {
+            std::shared_ptr<CSnapshot> ptrSnapshot;
+            std::chrono::steady_clock::time_point deadline;
+            AsyncResultCallback<std::shared_ptr<SBlksnapEvent>> callback;
+        };
+
+        void Worker();
+        void Complete(const SWait& wait, std::exception_ptr ex, std::shared_ptr<SBlksnapEvent> ptrEvent);
+
+    private:
+        CExecutor& m_executor;
+        std::mutex m_lock;
+        std::condition_variable m_cond;
+        std::list<SWait> m_waits;
+        bool m_stop;
+        std::thread m_thread;
+    };
+
+#ifdef BLKSNAP_ASYNC_COROUTINE
+    template<class T>
+    class CAwaitable
+    {
+    public:
+        CAwaitable(CExecutor& executor, std::function<T()> fn)
+            : m_executor(executor)
+            , m_fn(std::move(fn))
+        {};
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        };
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            m_executor.Post([this, handle]() {
+                try
+                {
+                    m_result = m_fn();
+                }
+                catch (...)
+                {
+                    m_ex = std::current_exception();
+                }
+                handle.resume();
+            });
+        };
+
+        T await_resume()
+        {
+            if (m_ex)
+                std::rethrow_exception(m_ex);
+            return std::move(m_result);
+        };
+
+    private:
+        CExecutor& m_executor;
+        std::function<T()> m_fn;
+        T m_result;
+        std::exception_ptr m_ex;
+    };
+
+    template<>
+    class CAwaitable<void>
+    {
+    public:
+        CAwaitable(CExecutor& executor, std::function<void()> fn)
+            : m_executor(executor)
+            , m_fn(std::move(fn))
+        {};
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        };
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            m_executor.Post([this, handle]() {
+                try
+                {
+                    m_fn();
+                }
+                catch (...)
+                {
+                    m_ex = std::current_exception();
+                }
+                handle.resume();
+            });
+        };
+
+        void await_resume()
+        {
+            if (m_ex)
+                std::rethrow_exception(m_ex);
+        };
+
+    private:
+        CExecutor& m_executor;
+        std::function<void()> m_fn;
+        std::exception_ptr m_ex;
+    };
+#endif
+
+    class CAsync
+    {
+    public:
+        CAsync(unsigned int threadCount = 0)
+            : m_executor(threadCount)
+            , m_dispatcher(m_executor)
+        {};
+        ~CAsync() {};
+
+        /*
+         * The completion callbacks are called from the thread of the pool.
+         * They should not block, since the same threads serve all the
+         * operations.
+         */
+        void CreateSnapshot(const std::string& filePath, const unsigned long long limit,
+                            const AsyncResultCallback<std::shared_ptr<CSnapshot>>& callback);
+        void Take(const std::shared_ptr<CSnapshot>& ptrSnapshot, const AsyncCallback& callback);
+        void Destroy(const std::shared_ptr<CSnapshot>& ptrSnapshot, const AsyncCallback& callback);
+        /*
+         * The result is nullptr if the event was not received before the
+         * timeout expired. The event is waited for by the dispatcher thread,
+         * so the threads of the pool are not occupied while waiting.
+         */
+        void WaitEvent(const std::shared_ptr<CSnapshot>& ptrSnapshot, const unsigned int timeoutMs,
+                       const AsyncResultCallback<std::shared_ptr<SBlksnapEvent>>& callback);
+
+        void Attach(const std::string& devicePath, const AsyncCallback& callback);
+        void Detach(const std::string& devicePath, const AsyncCallback& callback);
+        void SnapshotAdd(const std::string& devicePath, const CSnapshotId& id, const AsyncCallback& callback);
+        void GetCbtInfo(const std::shared_ptr<ICbt>& ptrCbt,
+                        const AsyncResultCallback<std::shared_ptr<SCbtInfo>>& callback);
+        void GetCbtData(const std::shared_ptr<ICbt>& ptrCbt,
+                        const AsyncResultCallback<std::shared_ptr<SCbtData>>& callback);
+
+        /*
+         * The same operations that return the std::future.
+         */
+        std::future<std::shared_ptr<CSnapshot>> CreateSnapshot(const std::string& filePath,
+                                                               const unsigned long long limit);
+        std::future<void> Take(const std::shared_ptr<CSnapshot>& ptrSnapshot);
+        std::future<void> Destroy(const std::shared_ptr<CSnapshot>& ptrSnapshot);
+        std::future<std::shared_ptr<SBlksnapEvent>> WaitEvent(const std::shared_ptr<CSnapshot>& ptrSnapshot,
+                                                              const unsigned int timeoutMs);
+        std::future<void> Attach(const std::string& devicePath);
+        std::future<void> Detach(const std::string& devicePath);
+        std::future<void> SnapshotAdd(const std::string& devicePath, const CSnapshotId& id);
+        std::future<std::shared_ptr<SCbtInfo>> GetCbtInfo(const std::shared_ptr<ICbt>& ptrCbt);
+        std::future<std::shared_ptr<SCbtData>> GetCbtData(const std::shared_ptr<ICbt>& ptrCbt);
+
+        /*
+         * Allows to perform any other blocking operation in the pool.
+         */
+        template<class F>
+        auto Run(F fn) -> std::future<decltype(fn())>
+        {
+            using R = decltype(fn());
+            auto ptrTask = std::make_shared<std::packaged_task<R()>>(std::move(fn));
+            std::future<R> result = ptrTask->get_future();
+
+            m_executor.Post([ptrTask]() { (*ptrTask)(); });
+            return result;
+        };
+
+#ifdef BLKSNAP_ASYNC_COROUTINE
+        /*
+         * The coroutine is resumed in the thread of the pool.
+         * For example:
+         *     co_await async.Await([ptrSnapshot] { ptrSnapshot->Take(); });
+         */
+        template<class F>
+        auto Await(F fn) -> CAwaitable<decltype(fn())>
+        {
+            return CAwaitable<decltype(fn())>(m_executor, std::move(fn));
+        };
+#endif
+
+    private:
+        void Complete(std::function<void()> fn, const AsyncCallback& callback);
+        template<class T>
+        void Complete(std::function<T()> fn, const AsyncResultCallback<T>& callback)
+        {
+            m_executor.Post([fn, callback]() {
+                T result;
+
+                try
+                {
+                    result = fn();
+                }
+                catch (...)
+                {
+                    callback(std::current_exception(), T());
+                    return;
+                }
+                callback(nullptr, std::move(result));
+            });
+        };
+
+    private:
+        CExecutor m_executor;
+        CEventDispatcher m_dispatcher;
+    };
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+/*
+ * Allows to extract the changed regions from the change tracking map.
+ * The map can be processed in parts as it is read from the kernel module,
+ * so there is no need to keep the whole map in memory.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "Sector.h"
+
+namespace blksnap
+{
+    /*
+     * Returns the number of blocks that were changed after the snapshot
+     * with the snapNumber was taken.
+     */
+    size_t CbtChangedCount(const uint8_t* map, const size_t length, const uint8_t snapNumber);
+
+    /*
+     * Combine the changes from several maps into the flags, where one means
+     * the changed block and zero means the unchanged one. CbtMergeChanged()
+     * sets the flags of the blocks changed in the map, CbtExcludeChanged()
+     * clears them. The flags can be passed to CCbtRangeExtractor with the
+     * snapshot number zero.
+     */
+    void CbtMergeChanged(const uint8_t* map, const size_t length, const uint8_t snapNumber, uint8_t* flags);
+    void CbtExcludeChanged(const uint8_t* map, const size_t length, const uint8_t snapNumber, uint8_t* flags);
+
+    class CCbtRangeExtractor
+    {
+    public:
+        /*
+         * The deviceCapacity is in bytes, as it is provided by the
+         * BLKFILTER_CTL_BLKSNAP_CBTINFO command.
+         */
+        CCbtRangeExtractor(const unsigned int blockSize, const unsigned long long deviceCapacity,
+                           const uint8_t snapNumber);
+        ~CCbtRangeExtractor() {};
+
+        /*
+         * The parts of the map should be passed in order. The completed ranges
+         * are appended to the vector. The range that reaches the end of the part
+         * may be continued by the next part, so it is appended later.
+         */
+        void Process(const uint8_t* map, const size_t length, std::vector<SRange>& ranges);
+        /*
+         * Appends the last range after the whole map has been processed.
+         */
+        void Finish(std::vector<SRange>& ranges);
+
+    private:
+        void Append(const size_t lastBlock, std::vector<SRange>& ranges);
+
+    private:
+        sector_t m_blockSect;
+        sector_t m_capacitySect;
+        uint8_t m_snapNumber;
+        size_t m_blockOffset;
+        bool m_isRangeOpen;
+        size_t m_rangeFirst;
+    };
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+/*
+ * Prepares the difference storage file before creating the snapshot.
+ * The file is allocated in advance, so the kernel module does not have to
+ * expand it while the snapshot is being held.
+ */
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace blksnap
+{
+    class CDiffStorage
+    {
+    public:
+        /*
+         * Opens or creates the regular file and allocates the size bytes.
+         * The existing file that is larger is truncated to the size.
+         * If the filePath is a block device, only its placement and size
+         * are checked.
+         */
+        static std::shared_ptr<CDiffStorage> Create(const std::string& filePath, const unsigned long long size,
+                                                    const std::vector<std::string>& devices);
+        /*
+         * Creates the unnamed file with the O_TMPFILE flag in the directory.
+         * The file is released automatically when the snapshot is destroyed.
+         */
+        static std::shared_ptr<CDiffStorage> CreateTemporary(const std::string& directory,
+                                                             const unsigned long long size,
+                                                             const std::vector<std::string>& devices);
+
+    public:
+        ~CDiffStorage();
+
+        /*
+         * The path that should be passed to CSnapshot::Create(). The object
+         * should be kept until the snapshot is created.
+         */
+        const std::string& Path() const
+        {
+            return m_path;
+        };
+        unsigned long long Size() const
+        {
+            return m_size;
+        };
+        /*
+         * The number of bytes in the extents that were allocated, but were
+         * not written yet. It's zero if the file system does not support
+         * FIEMAP.
+         */
+        unsigned long long UnwrittenBytes() const
+        {
+            return m_unwrittenBytes;
+        };
+
+    private:
+        CDiffStorage(const int fd, const std::string& path);
+        void CheckPlacement(const std::vector<std::string>& devices);
+        void Allocate(const unsigned long long size);
+        void CheckExtents();
+
+    private:
+        int m_fd;
+        std::string m_path;
+        bool m_isBlockDevice;
+        unsigned long long m_size;
+        unsigned long long m_unwrittenBytes;
+    };
+}
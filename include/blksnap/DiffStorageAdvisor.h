@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+/*
+ * The advisor of the difference storage size.
+ * Collects the rate of changes of block devices from the CBT maps received
+ * after each snapshot and recommends the difference storage limit for the
+ * expected holding time of the snapshot.
+ */
+#include <deque>
+#include <map>
+#include <string>
+#include <uuid/uuid.h>
+#include <vector>
+
+namespace blksnap
+{
+    struct SDiffStorageAdvice
+    {
+        SDiffStorageAdvice()
+            : diffStorageLimitSect(0)
+            , expectedBytes(0)
+            , marginBytes(0)
+            , samplesCount(0)
+        {};
+
+        /*
+         * The recommended value for blksnap_snapshot_create.diff_storage_limit_sect.
+         */
+        unsigned long long diffStorageLimitSect;
+        /*
+         * The amount of data that is expected to be copied to the difference
+         * storage while holding the snapshot, and the reserve added for the
+         * requested confidence.
+         */
+        unsigned long long expectedBytes;
+        unsigned long long marginBytes;
+        /*
+         * The number of measurements on which the recommendation is based.
+         * If it is zero, then the recommendation is equal to the minimum.
+         */
+        unsigned int samplesCount;
+    };
+
+    class CDiffStorageAdvisor
+    {
+    public:
+        /*
+         * If the history file name is empty, the history is stored only in
+         * memory.
+         */
+        CDiffStorageAdvisor(const std::string& historyFile = std::string());
+        ~CDiffStorageAdvisor() {};
+
+        /*
+         * Reads the CBT of the block device and stores the amount of data
+         * changed since the previous record. It should be called once after
+         * each snapshot is taken, for example, before creating the next one.
+         * Returns false if the change tracker was reset or the snapshot was
+         * not taken since the previous record and the rate cannot be measured.
+         */
+        bool Record(const std::string& device);
+        bool Record(const std::string& device, const long long timeLabel, const uuid_t& generationId,
+                    const unsigned char snapNumber, const unsigned int blockSize,
+                    const unsigned long long deviceCapacity, const std::vector<unsigned char>& cbtMap);
+
+        /*
+         * Calculates the limit of the difference storage for the devices that
+         * are expected to be held in the snapshot for holdTimeSec seconds.
+         * The confidence is the probability that the write rate does not
+         * exceed the estimation. The value should be in the range (0.5, 1).
+         */
+        SDiffStorageAdvice Recommend(const std::vector<std::string>& devices, const unsigned int holdTimeSec,
+                                     const double confidence = 0.95) const;
+
+        /*
+         * The copy-on-write algorithm stores whole chunks. By default, the
+         * chunk size is equal to the default value of the chunk_minimum_shift
+         * module parameter.
+         */
+        void SetChunkShift(const unsigned int chunkShift)
+        {
+            m_chunkShift = chunkShift;
+        };
+        void SetMinimum(const unsigned long long minimumBytes)
+        {
+            m_minimumBytes = minimumBytes;
+        };
+
+        void Load();
+        void Save() const;
+
+    private:
+        struct SRateSample
+        {
+            long long timeLabel;
+            double bytesPerSecond;
+        };
+        struct SDeviceHistory
+        {
+            SDeviceHistory()
+                : snapNumber(0)
+                , timeLabel(0)
+                , deviceCapacity(0)
+            {
+                uuid_clear(generationId);
+            };
+
+            uuid_t generationId;
+            unsigned char snapNumber;
+            long long timeLabel;
+            unsigned long long deviceCapacity;
+            std::deque<SRateSample> rates;
+        };
+
+        std::string m_historyFile;
+        unsigned int m_chunkShift;
+        unsigned long long m_minimumBytes;
+        std::map<std::string, SDeviceHistory> m_history;
+    };
+}
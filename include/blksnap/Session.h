@@ -21,23 +21,69 @@
  * The hi-level abstraction for the blksnap kernel module.
  * Allows to create snapshot session.
  */
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 #include "Sector.h"
+#include "Snapshot.h"
 
 namespace blksnap
 {
+    using SessionEventCallback = std::function<void(const SBlksnapEvent& ev)>;
+
     struct ISession
     {
         virtual ~ISession() = default;
 
+        /*
+         * Returns the description of the next event or of the session failure.
+         * The events are taken from the same queue as PollEvent() does. The
+         * events that were dropped because the queue was full are returned
+         * as failures.
+         */
         virtual bool GetError(std::string& errorMessage) = 0;
 
+        /*
+         * The callback is called from the session thread for each event
+         * received from the snapshot. The callback should not block.
+         * Returns the identifier of the subscription.
+         */
+        virtual int Subscribe(const SessionEventCallback& callback) = 0;
+        virtual void Unsubscribe(const int subscriptionId) = 0;
+
+        /*
+         * Allows to poll the events without locks. The events are stored
+         * in a lock-free queue by the session thread, so only one consumer
+         * thread can poll it.
+         */
+        virtual bool PollEvent(SBlksnapEvent& ev) = 0;
+        /*
+         * Returns the number of the events that were not put to the queue
+         * because it was full. They are not returned by PollEvent().
+         */
+        virtual unsigned long long GetDroppedEventCount() = 0;
+
+        /*
+         * Returns the time during which the file systems were frozen when
+         * the snapshot was taken, or zero if the freeze was not requested.
+         */
+        virtual unsigned long long GetFreezeTimeNs() = 0;
+
         static std::shared_ptr<ISession> Create(
             const std::vector<std::string>& devices,
             const std::string& diffStorageFilePath,
             const unsigned long long limit);
+        /*
+         * If isFreeze is true, the mounted file systems on the devices are
+         * frozen in parallel just for the time of taking the snapshot.
+         * The devices are attached and added to the snapshot before.
+         */
+        static std::shared_ptr<ISession> Create(
+            const std::vector<std::string>& devices,
+            const std::string& diffStorageFilePath,
+            const unsigned long long limit,
+            const bool isFreeze);
     };
 
 }
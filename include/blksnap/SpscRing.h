@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+/*
+ * Lock-free ring buffer for a single producer and a single consumer.
+ * Push() may be called only from one thread, and Pop() only from one other
+ * thread. If the ring is full, the new element is dropped and counted.
+ */
+#include <atomic>
+#include <stddef.h>
+
+namespace blksnap
+{
+    template<class T, size_t Capacity>
+    class CSpscRing
+    {
+        static_assert((Capacity & (Capacity - 1)) == 0, "The capacity should be a power of two.");
+
+    public:
+        CSpscRing()
+            : m_head(0)
+            , m_tail(0)
+            , m_dropped(0)
+        {};
+
+        bool Push(const T& item)
+        {
+            size_t tail = m_tail.load(std::memory_order_relaxed);
+
+            if ((tail - m_head.load(std::memory_order_acquire)) == Capacity)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            m_items[tail & (Capacity - 1)] = item;
+            m_tail.store(tail + 1, std::memory_order_release);
+            return true;
+        };
+
+        bool Pop(T& item)
+        {
+            size_t head = m_head.load(std::memory_order_relaxed);
+
+            if (head == m_tail.load(std::memory_order_acquire))
+                return false;
+
+            item = m_items[head & (Capacity - 1)];
+            m_head.store(head + 1, std::memory_order_release);
+            return true;
+        };
+
+        bool Empty() const
+        {
+            return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+        };
+
+        size_t Dropped() const
+        {
+            return m_dropped.load(std::memory_order_relaxed);
+        };
+
+    private:
+        alignas(64) std::atomic<size_t> m_head;
+        alignas(64) std::atomic<size_t> m_tail;
+        std::atomic<size_t> m_dropped;
+        T m_items[Capacity];
+    };
+}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <blksnap/Async.h>
+#include <algorithm>
+
+using namespace blksnap;
+
+CExecutor::CExecutor(unsigned int threadCount)
+    : m_stop(false)
+{
+    if (!threadCount)
+        threadCount = std::max(std::thread::hardware_concurrency(), 2U);
+
+    for (unsigned int inx = 0; inx < threadCount; inx++)
+        m_threads.emplace_back(&CExecutor::Worker, this);
+}
+
+CExecutor::~CExecutor()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+
+    for (std::thread& thread : m_threads)
+        thread.join();
+}
+
+void CExecutor::Post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_tasks.push_back(std::move(task));
+    }
+    m_cond.notify_one();
+}
+
+void CExecutor::Worker()
+{
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+
+            m_cond.wait(guard, [this] { return m_stop || !m_tasks.empty(); });
+            /*
+             * The tasks posted before stopping are completed anyway.
+             */
+            if (m_tasks.empty())
+                break;
+
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+        }
+    }
+}
+
+void CAsync::Complete(std::function<void()> fn, const AsyncCallback& callback)
+{
+    m_executor.Post([fn, callback]() {
+        try
+        {
+            fn();
+        }
+        catch (...)
+        {
+            callback(std::current_exception());
+            return;
+        }
+        callback(nullptr);
+    });
+}
+
+static const std::chrono::milliseconds pollInterval(100);
+
+CEventDispatcher::CEventDispatcher(CExecutor& executor)
+    : m_executor(executor)
+    , m_stop(false)
+{
+    m_thread = std::thread(&CEventDispatcher::Worker, this);
+}
+
+CEventDispatcher::~CEventDispatcher()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+void CEventDispatcher::Wait(const std::shared_ptr<CSnapshot>& ptrSnapshot, const unsigned int timeoutMs,
+                            const AsyncResultCallback<std::shared_ptr<SBlksnapEvent>>& callback)
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_waits.push_back({ptrSnapshot, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs),
+                           callback});
+    }
+    m_cond.notify_one();
+}
+
+void CEventDispatcher::Complete(const SWait& wait, std::exception_ptr ex, std::shared_ptr<SBlksnapEvent> ptrEvent)
+{
+    auto callback = wait.callback;
+
+    m_executor.Post([callback, ex, ptrEvent]() { callback(ex, ptrEvent); });
+}
+
+/*
+ * Each snapshot is polled with the zero timeout, as the watcher of the
+ * blksnapd does. The waits are taken from the list while they are polled,
+ * so the new waits can be added at the same time.
+ */
+void CEventDispatcher::Worker()
+{
+    std::list<SWait> waits;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+
+            if (m_stop)
+            {
+                waits.splice(waits.end(), m_waits);
+                break;
+            }
+            if (m_waits.empty())
+            {
+                m_cond.wait(guard, [this] { return m_stop || !m_waits.empty(); });
+                continue;
+            }
+            waits.splice(waits.end(), m_waits);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        auto nextDeadline = now + pollInterval;
+        bool isCompleted = false;
+        for (auto it = waits.begin(); it != waits.end();)
+        {
+            auto ptrEvent = std::make_shared<SBlksnapEvent>();
+
+            try
+            {
+                if (!it->ptrSnapshot->WaitEvent(0, *ptrEvent))
+                {
+                    if (now < it->deadline)
+                    {
+                        nextDeadline = std::min(nextDeadline, it->deadline);
+                        ++it;
+                        continue;
+                    }
+                    ptrEvent.reset();
+                }
+                Complete(*it, nullptr, ptrEvent);
+            }
+            catch (...)
+            {
+                Complete(*it, std::current_exception(), nullptr);
+            }
+            it = waits.erase(it);
+            isCompleted = true;
+        }
+
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_waits.splice(m_waits.begin(), waits);
+        /*
+         * After an event, the snapshots are polled again at once, since
+         * there may be more events in the queue.
+         */
+        if (!isCompleted && !m_stop)
+            m_cond.wait_until(guard, nextDeadline);
+    }
+
+    for (const SWait& wait : waits)
+        Complete(wait, nullptr, nullptr);
+}
+
+void CAsync::CreateSnapshot(const std::string& filePath, const unsigned long long limit,
+                            const AsyncResultCallback<std::shared_ptr<CSnapshot>>& callback)
+{
+    Complete<std::shared_ptr<CSnapshot>>([filePath, limit]() { return CSnapshot::Create(filePath, limit); },
+                                         callback);
+}
+
+void CAsync::Take(const std::shared_ptr<CSnapshot>& ptrSnapshot, const AsyncCallback& callback)
+{
+    Complete([ptrSnapshot]() { ptrSnapshot->Take(); }, callback);
+}
+
+void CAsync::Destroy(const std::shared_ptr<CSnapshot>& ptrSnapshot, const AsyncCallback& callback)
+{
+    Complete([ptrSnapshot]() { ptrSnapshot->Destroy(); }, callback);
+}
+
+void CAsync::WaitEvent(const std::shared_ptr<CSnapshot>& ptrSnapshot, const unsigned int timeoutMs,
+                       const AsyncResultCallback<std::shared_ptr<SBlksnapEvent>>& callback)
+{
+    m_dispatcher.Wait(ptrSnapshot, timeoutMs, callback);
+}
+
+void CAsync::Attach(const std::string& devicePath, const AsyncCallback& callback)
+{
+    Complete([devicePath]() { CTracker(devicePath).Attach(); }, callback);
+}
+
+void CAsync::Detach(const std::string& devicePath, const AsyncCallback& callback)
+{
+    Complete([devicePath]() { CTracker(devicePath).Detach(); }, callback);
+}
+
+void CAsync::SnapshotAdd(const std::string& devicePath, const CSnapshotId& id, const AsyncCallback& callback)
+{
+    Complete([devicePath, id]() { CTracker(devicePath).SnapshotAdd(id.Get()); }, callback);
+}
+
+void CAsync::GetCbtInfo(const std::shared_ptr<ICbt>& ptrCbt,
+                        const AsyncResultCallback<std::shared_ptr<SCbtInfo>>& callback)
+{
+    Complete<std::shared_ptr<SCbtInfo>>([ptrCbt]() { return ptrCbt->GetCbtInfo(); }, callback);
+}
+
+void CAsync::GetCbtData(const std::shared_ptr<ICbt>& ptrCbt,
+                        const AsyncResultCallback<std::shared_ptr<SCbtData>>& callback)
+{
+    Complete<std::shared_ptr<SCbtData>>([ptrCbt]() { return ptrCbt->GetCbtData(); }, callback);
+}
+
+std::future<std::shared_ptr<CSnapshot>> CAsync::CreateSnapshot(const std::string& filePath,
+                                                               const unsigned long long limit)
+{
+    return Run([filePath, limit]() { return CSnapshot::Create(filePath, limit); });
+}
+
+std::future<void> CAsync::Take(const std::shared_ptr<CSnapshot>& ptrSnapshot)
+{
+    return Run([ptrSnapshot]() { ptrSnapshot->Take(); });
+}
+
+std::future<void> CAsync::Destroy(const std::shared_ptr<CSnapshot>& ptrSnapshot)
+{
+    return Run([ptrSnapshot]() { ptrSnapshot->Destroy(); });
+}
+
+std::future<std::shared_ptr<SBlksnapEvent>> CAsync::WaitEvent(const std::shared_ptr<CSnapshot>& ptrSnapshot,
+                                                              const unsigned int timeoutMs)
+{
+    auto ptrPromise = std::make_shared<std::promise<std::shared_ptr<SBlksnapEvent>>>();
+    std::future<std::shared_ptr<SBlksnapEvent>> result = ptrPromise->get_future();
+
+    m_dispatcher.Wait(ptrSnapshot, timeoutMs, [ptrPromise](std::exception_ptr ex, std::shared_ptr<SBlksnapEvent> ptrEvent) {
+        if (ex)
+            ptrPromise->set_exception(ex);
+        else
+            ptrPromise->set_value(ptrEvent);
+    });
+    return result;
+}
+
+std::future<void> CAsync::Attach(const std::string& devicePath)
+{
+    return Run([devicePath]() { CTracker(devicePath).Attach(); });
+}
+
+std::future<void> CAsync::Detach(const std::string& devicePath)
+{
+    return Run([devicePath]() { CTracker(devicePath).Detach(); });
+}
+
+std::future<void> CAsync::SnapshotAdd(const std::string& devicePath, const CSnapshotId& id)
+{
+    return Run([devicePath, id]() { CTracker(devicePath).SnapshotAdd(id.Get()); });
+}
+
+std::future<std::shared_ptr<SCbtInfo>> CAsync::GetCbtInfo(const std::shared_ptr<ICbt>& ptrCbt)
+{
+    return Run([ptrCbt]() { return ptrCbt->GetCbtInfo(); });
+}
+
+std::future<std::shared_ptr<SCbtData>> CAsync::GetCbtData(const std::shared_ptr<ICbt>& ptrCbt)
+{
+    return Run([ptrCbt]() { return ptrCbt->GetCbtData(); });
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <blksnap/CbtMap.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace blksnap;
+
+/*
+ * The block was changed after the snapshot if its number in the map is greater
+ * than the number of the snapshot. The map is mostly unchanged, so the search
+ * checks 16 blocks at once.
+ */
+static inline bool isChanged(const uint8_t value, const uint8_t snapNumber)
+{
+    return value > snapNumber;
+}
+
+#ifdef __SSE2__
+static inline unsigned int changedMask(const uint8_t* map, const __m128i threshold)
+{
+    __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(map));
+
+    /*
+     * There is no unsigned comparison in SSE2, but value >= threshold if
+     * max(value, threshold) == value.
+     */
+    return static_cast<unsigned int>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(value, threshold), value)));
+}
+#endif
+
+/*
+ * Returns the index of the first block that is changed or not changed
+ * depending on the isChangedRequired, or the length if there is no such block.
+ */
+static size_t findBlock(const uint8_t* map, size_t inx, const size_t length, const uint8_t snapNumber,
+                        const bool isChangedRequired)
+{
+#ifdef __SSE2__
+    const __m128i threshold = _mm_set1_epi8(static_cast<char>(snapNumber + 1));
+    const unsigned int inverse = isChangedRequired ? 0 : 0xFFFF;
+
+    for (; (inx + 16) <= length; inx += 16)
+    {
+        unsigned int mask = changedMask(map + inx, threshold) ^ inverse;
+
+        if (mask)
+            return inx + __builtin_ctz(mask);
+    }
+#endif
+    for (; inx < length; inx++)
+        if (isChanged(map[inx], snapNumber) == isChangedRequired)
+            return inx;
+
+    return length;
+}
+
+size_t blksnap::CbtChangedCount(const uint8_t* map, const size_t length, const uint8_t snapNumber)
+{
+    size_t count = 0;
+    size_t inx = 0;
+
+    if (snapNumber == UINT8_MAX)
+        return 0;
+
+#ifdef __SSE2__
+    const __m128i threshold = _mm_set1_epi8(static_cast<char>(snapNumber + 1));
+
+    for (; (inx + 16) <= length; inx += 16)
+        count += __builtin_popcount(changedMask(map + inx, threshold));
+#endif
+    for (; inx < length; inx++)
+        if (isChanged(map[inx], snapNumber))
+            count++;
+
+    return count;
+}
+
+/*
+ * The comparison gives 0xFF for the changed block, so the flag is the lowest
+ * bit of the result.
+ */
+void blksnap::CbtMergeChanged(const uint8_t* map, const size_t length, const uint8_t snapNumber, uint8_t* flags)
+{
+    size_t inx = 0;
+
+    if (snapNumber == UINT8_MAX)
+        return;
+
+#ifdef __SSE2__
+    const __m128i threshold = _mm_set1_epi8(static_cast<char>(snapNumber + 1));
+    const __m128i one = _mm_set1_epi8(1);
+
+    for (; (inx + 16) <= length; inx += 16)
+    {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(map + inx));
+        __m128i changed = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(value, threshold), value), one);
+        __m128i* dst = reinterpret_cast<__m128i*>(flags + inx);
+
+        _mm_storeu_si128(dst, _mm_or_si128(_mm_loadu_si128(dst), changed));
+    }
+#endif
+    for (; inx < length; inx++)
+        if (isChanged(map[inx], snapNumber))
+            flags[inx] = 1;
+}
+
+void blksnap::CbtExcludeChanged(const uint8_t* map, const size_t length, const uint8_t snapNumber, uint8_t* flags)
+{
+    size_t inx = 0;
+
+    if (snapNumber == UINT8_MAX)
+        return;
+
+#ifdef __SSE2__
+    const __m128i threshold = _mm_set1_epi8(static_cast<char>(snapNumber + 1));
+    const __m128i one = _mm_set1_epi8(1);
+
+    for (; (inx + 16) <= length; inx += 16)
+    {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(map + inx));
+        __m128i changed = _mm_and_si128(_mm_cmpeq_epi8(_mm_max_epu8(value, threshold), value), one);
+        __m128i* dst = reinterpret_cast<__m128i*>(flags + inx);
+
+        _mm_storeu_si128(dst, _mm_andnot_si128(changed, _mm_loadu_si128(dst)));
+    }
+#endif
+    for (; inx < length; inx++)
+        if (isChanged(map[inx], snapNumber))
+            flags[inx] = 0;
+}
+
+CCbtRangeExtractor::CCbtRangeExtractor(const unsigned int blockSize, const unsigned long long deviceCapacity,
+                                       const uint8_t snapNumber)
+    : m_blockSect(blockSize >> SECTOR_SHIFT)
+    , m_capacitySect(deviceCapacity >> SECTOR_SHIFT)
+    , m_snapNumber(snapNumber)
+    , m_blockOffset(0)
+    , m_isRangeOpen(false)
+    , m_rangeFirst(0)
+{ }
+
+void CCbtRangeExtractor::Process(const uint8_t* map, const size_t length, std::vector<SRange>& ranges)
+{
+    size_t inx = 0;
+
+    if (m_snapNumber == UINT8_MAX)
+        inx = length;
+
+    while (inx < length)
+    {
+        if (!m_isRangeOpen)
+        {
+            inx = findBlock(map, inx, length, m_snapNumber, true);
+            if (inx == length)
+                break;
+
+            m_rangeFirst = m_blockOffset + inx;
+            m_isRangeOpen = true;
+        }
+
+        inx = findBlock(map, inx, length, m_snapNumber, false);
+        if (inx == length)
+            break;
+
+        Append(m_blockOffset + inx, ranges);
+    }
+    m_blockOffset += length;
+}
+
+void CCbtRangeExtractor::Finish(std::vector<SRange>& ranges)
+{
+    if (m_isRangeOpen)
+        Append(m_blockOffset, ranges);
+}
+
+void CCbtRangeExtractor::Append(const size_t lastBlock, std::vector<SRange>& ranges)
+{
+    sector_t sector = m_rangeFirst * m_blockSect;
+    sector_t end = std::min(lastBlock * m_blockSect, m_capacitySect);
+
+    m_isRangeOpen = false;
+    if (end > sector)
+        ranges.emplace_back(sector, end - sector);
+}
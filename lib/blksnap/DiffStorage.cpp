@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <blksnap/DiffStorage.h>
+#include <blksnap/Sector.h>
+#include <boost/filesystem.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <system_error>
+#include <unistd.h>
+
+using namespace blksnap;
+namespace fs = boost::filesystem;
+
+/*
+ * Returns the whole disk for the partition, or the device itself if it's not
+ * a partition.
+ */
+static dev_t wholeDiskId(const dev_t devId)
+{
+    const fs::path sysPath("/sys/dev/block/" + std::to_string(major(devId)) + ":" + std::to_string(minor(devId)));
+    boost::system::error_code ec;
+
+    if (!fs::exists(sysPath / "partition", ec))
+        return devId;
+
+    const fs::path diskPath = fs::canonical(sysPath, ec).parent_path();
+    if (ec)
+        return devId;
+
+    std::ifstream devFile((diskPath / "dev").string());
+    unsigned int mj;
+    unsigned int mn;
+    char separator;
+    if (!(devFile >> mj >> separator >> mn) || (separator != ':'))
+        return devId;
+
+    return makedev(mj, mn);
+}
+
+CDiffStorage::CDiffStorage(const int fd, const std::string& path)
+    : m_fd(fd)
+    , m_path(path)
+    , m_isBlockDevice(false)
+    , m_size(0)
+    , m_unwrittenBytes(0)
+{ }
+
+CDiffStorage::~CDiffStorage()
+{
+    ::close(m_fd);
+}
+
+std::shared_ptr<CDiffStorage> CDiffStorage::Create(const std::string& filePath, const unsigned long long size,
+                                                   const std::vector<std::string>& devices)
+{
+    int fd = ::open(filePath.c_str(), O_RDWR | O_CREAT | O_LARGEFILE | O_NOATIME, 0600);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(), "Cannot open file [" + filePath + "]");
+
+    std::shared_ptr<CDiffStorage> ptr(new CDiffStorage(fd, filePath));
+    ptr->CheckPlacement(devices);
+    ptr->Allocate(size);
+    ptr->CheckExtents();
+    return ptr;
+}
+
+std::shared_ptr<CDiffStorage> CDiffStorage::CreateTemporary(const std::string& directory,
+                                                            const unsigned long long size,
+                                                            const std::vector<std::string>& devices)
+{
+    int fd = ::open(directory.c_str(), O_RDWR | O_TMPFILE | O_LARGEFILE | O_NOATIME, 0600);
+    if (fd < 0)
+        throw std::system_error(errno, std::generic_category(),
+                                "Failed to create temporary file in directory [" + directory + "]");
+
+    /*
+     * The kernel module opens the same unnamed file via the magic link.
+     */
+    std::shared_ptr<CDiffStorage> ptr(new CDiffStorage(fd, "/proc/self/fd/" + std::to_string(fd)));
+    ptr->CheckPlacement(devices);
+    ptr->Allocate(size);
+    ptr->CheckExtents();
+    return ptr;
+}
+
+void CDiffStorage::CheckPlacement(const std::vector<std::string>& devices)
+{
+    struct stat st;
+
+    if (::fstat(m_fd, &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get status for '" + m_path + "'.");
+
+    m_isBlockDevice = S_ISBLK(st.st_mode);
+    const dev_t storageDevId = m_isBlockDevice ? st.st_rdev : st.st_dev;
+    const dev_t storageDiskId = wholeDiskId(storageDevId);
+
+    /*
+     * The device cannot be added to the snapshot where the difference storage
+     * is located, either on the device itself or on its partition. The file
+     * systems that show a virtual device number, like btrfs, cannot be
+     * checked in this way.
+     */
+    for (const auto& device : devices)
+    {
+        if (::stat(device.c_str(), &st))
+            throw std::system_error(errno, std::generic_category(), "Failed to get status for '" + device + "'.");
+
+        if ((st.st_rdev == storageDevId) || (st.st_rdev == storageDiskId)
+            || (wholeDiskId(st.st_rdev) == storageDevId))
+            throw std::runtime_error("The difference storage [" + m_path + "] is located on the device ["
+                                     + device + "] that is added to the snapshot.");
+    }
+}
+
+void CDiffStorage::Allocate(const unsigned long long size)
+{
+    if (m_isBlockDevice)
+    {
+        if (::ioctl(m_fd, BLKGETSIZE64, &m_size))
+            throw std::system_error(errno, std::generic_category(), "Failed to get size of device [" + m_path + "].");
+        return;
+    }
+
+    /*
+     * The kernel module uses the whole file size as the difference storage
+     * capacity, so the size is aligned to the sector.
+     */
+    const unsigned long long alignedSize =
+        (size + SECTOR_SIZE - 1) & ~static_cast<unsigned long long>(SECTOR_SIZE - 1);
+    if (::fallocate(m_fd, 0, 0, alignedSize))
+        throw std::system_error(errno, std::generic_category(), "Failed to allocate file [" + m_path + "].");
+
+    /*
+     * The existing file may be larger than requested. The kernel module
+     * refuses the storage that exceeds the limit, so the file is truncated.
+     */
+    struct stat st;
+    if (::fstat(m_fd, &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get status for '" + m_path + "'.");
+    if (static_cast<unsigned long long>(st.st_size) > alignedSize)
+    {
+        if (::ftruncate(m_fd, alignedSize))
+            throw std::system_error(errno, std::generic_category(),
+                                    "Failed to truncate file [" + m_path + "] to the limit.");
+        st.st_size = alignedSize;
+    }
+    m_size = st.st_size;
+}
+
+void CDiffStorage::CheckExtents()
+{
+    if (m_isBlockDevice)
+        return;
+
+    std::vector<char> buffer(sizeof(struct fiemap));
+    struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer.data());
+
+    /*
+     * At first, only the number of extents is requested.
+     */
+    map->fm_start = 0;
+    map->fm_length = m_size;
+    map->fm_flags = FIEMAP_FLAG_SYNC;
+    map->fm_extent_count = 0;
+    if (::ioctl(m_fd, FS_IOC_FIEMAP, map))
+    {
+        if ((errno == EOPNOTSUPP) || (errno == ENOTTY))
+            return;
+        throw std::system_error(errno, std::generic_category(), "Failed to call FS_IOC_FIEMAP.");
+    }
+
+    const unsigned int extentCount = map->fm_mapped_extents;
+    buffer.resize(sizeof(struct fiemap) + sizeof(struct fiemap_extent) * extentCount);
+    map = reinterpret_cast<struct fiemap*>(buffer.data());
+    map->fm_start = 0;
+    map->fm_length = m_size;
+    map->fm_flags = 0;
+    map->fm_extent_count = extentCount;
+    map->fm_mapped_extents = 0;
+    if (::ioctl(m_fd, FS_IOC_FIEMAP, map))
+        throw std::system_error(errno, std::generic_category(), "Failed to call FS_IOC_FIEMAP.");
+
+    m_unwrittenBytes = 0;
+    for (unsigned int inx = 0; inx < map->fm_mapped_extents; inx++)
+    {
+        const struct fiemap_extent* extent = map->fm_extents + inx;
+
+        /*
+         * Writing to a shared extent causes copy-on-write in the file system
+         * itself, so the difference storage would be allocated again.
+         */
+        if (extent->fe_flags & FIEMAP_EXTENT_SHARED)
+            throw std::runtime_error("The difference storage [" + m_path + "] contains shared extents.");
+
+        if (extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC))
+            throw std::runtime_error("The difference storage [" + m_path + "] is not allocated.");
+
+        if (extent->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+            m_unwrittenBytes += extent->fe_length;
+    }
+}
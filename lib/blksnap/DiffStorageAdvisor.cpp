@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2022 Veeam Software Group GmbH <https://www.veeam.com/contacts.html>
+ *
+ * This file is part of libblksnap
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option) any
+ * later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Lesser Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <blksnap/DiffStorageAdvisor.h>
+#include <blksnap/Tracker.h>
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <system_error>
+
+namespace fs = boost::filesystem;
+
+using namespace blksnap;
+
+/*
+ * The default values of the chunk_minimum_shift and diff_storage_minimum
+ * module parameters.
+ */
+static const unsigned int defaultChunkShift = 18;
+static const unsigned long long defaultMinimumBytes = 2097152ULL << SECTOR_SHIFT;
+/*
+ * It is enough to keep the history of the last couple of months of daily
+ * backups.
+ */
+static const size_t rateSamplesMax = 64;
+
+static std::string deviceKey(const std::string& device)
+{
+    struct stat st;
+
+    if (::stat(device.c_str(), &st))
+        throw std::system_error(errno, std::generic_category(), "Failed to get status for '" + device + "'.");
+
+    return std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev));
+}
+
+/*
+ * Returns the number of bytes in chunks that contain the blocks changed after
+ * the snapshot with the snapNumber.
+ */
+static unsigned long long changedBytes(const std::vector<unsigned char>& cbtMap, const unsigned char snapNumber,
+                                       const unsigned long long blockSize, const unsigned long long unitSize,
+                                       const unsigned long long deviceCapacity)
+{
+    const size_t blocksPerUnit = static_cast<size_t>(unitSize / blockSize);
+    unsigned long long bytes = 0;
+
+    for (size_t first = 0; first < cbtMap.size(); first += blocksPerUnit)
+    {
+        size_t last = std::min(first + blocksPerUnit, cbtMap.size());
+
+        for (size_t inx = first; inx < last; inx++)
+        {
+            if (cbtMap[inx] > snapNumber)
+            {
+                unsigned long long offset = first * blockSize;
+
+                if (offset < deviceCapacity)
+                    bytes += std::min(unitSize, deviceCapacity - offset);
+                break;
+            }
+        }
+    }
+    return bytes;
+}
+
+/*
+ * The quantile of the standard normal distribution for the probability p.
+ * Abramowitz and Stegun formula 26.2.23, the error is less than 4.5e-4.
+ */
+static double normalQuantile(const double p)
+{
+    const double t = std::sqrt(-2.0 * std::log(1.0 - p));
+
+    return t - (2.515517 + 0.802853 * t + 0.010328 * t * t)
+                 / (1.0 + 1.432788 * t + 0.189269 * t * t + 0.001308 * t * t * t);
+}
+
+CDiffStorageAdvisor::CDiffStorageAdvisor(const std::string& historyFile)
+    : m_historyFile(historyFile)
+    , m_chunkShift(defaultChunkShift)
+    , m_minimumBytes(defaultMinimumBytes)
+{
+    Load();
+}
+
+bool CDiffStorageAdvisor::Record(const std::string& device)
+{
+    struct blksnap_cbtinfo cbtInfo;
+    CTracker tracker(device);
+
+    tracker.CbtInfo(cbtInfo);
+
+    std::vector<unsigned char> cbtMap(cbtInfo.block_count);
+    tracker.ReadCbtMap(0, cbtMap.size(), cbtMap.data());
+
+    return Record(device, std::time(nullptr), cbtInfo.generation_id.b, cbtInfo.changes_number,
+                  cbtInfo.block_size, cbtInfo.device_capacity, cbtMap);
+}
+
+bool CDiffStorageAdvisor::Record(const std::string& device, const long long timeLabel, const uuid_t& generationId,
+                                 const unsigned char snapNumber, const unsigned int blockSize,
+                                 const unsigned long long deviceCapacity, const std::vector<unsigned char>& cbtMap)
+{
+    SDeviceHistory& history = m_history[deviceKey(device)];
+    bool isMeasured = false;
+
+    if (history.timeLabel && !uuid_compare(history.generationId, generationId))
+    {
+        if (history.snapNumber == snapNumber)
+            return false;
+
+        if (timeLabel > history.timeLabel)
+        {
+            unsigned long long unitSize = std::max(static_cast<unsigned long long>(blockSize), 1ULL << m_chunkShift);
+            unsigned long long bytes = changedBytes(cbtMap, history.snapNumber, blockSize, unitSize, deviceCapacity);
+
+            history.rates.push_back({timeLabel, static_cast<double>(bytes) / (timeLabel - history.timeLabel)});
+            if (history.rates.size() > rateSamplesMax)
+                history.rates.pop_front();
+            isMeasured = true;
+        }
+    }
+
+    /*
+     * If the change tracker was reset, the measurement begins anew.
+     */
+    uuid_copy(history.generationId, generationId);
+    history.snapNumber = snapNumber;
+    history.timeLabel = timeLabel;
+    history.deviceCapacity = deviceCapacity;
+    return isMeasured;
+}
+
+SDiffStorageAdvice CDiffStorageAdvisor::Recommend(const std::vector<std::string>& devices,
+                                                  const unsigned int holdTimeSec, const double confidence) const
+{
+    SDiffStorageAdvice advice;
+    double expected = 0;
+    double variance = 0;
+    double capacity = 0;
+
+    if ((confidence <= 0.5) || (confidence >= 1.0))
+        throw std::invalid_argument("The confidence should be in the range (0.5, 1).");
+
+    for (const std::string& device : devices)
+    {
+        const auto it = m_history.find(deviceKey(device));
+        if ((it == m_history.end()) || it->second.rates.empty())
+            continue;
+
+        const SDeviceHistory& history = it->second;
+        double mean = 0;
+        double deviation = 0;
+
+        for (const SRateSample& sample : history.rates)
+            mean += sample.bytesPerSecond;
+        mean /= history.rates.size();
+
+        if (history.rates.size() > 1)
+        {
+            for (const SRateSample& sample : history.rates)
+                deviation += (sample.bytesPerSecond - mean) * (sample.bytesPerSecond - mean);
+            deviation = std::sqrt(deviation / (history.rates.size() - 1));
+        }
+        else
+            deviation = mean;
+
+        expected += std::min(mean * holdTimeSec, static_cast<double>(history.deviceCapacity));
+        variance += (deviation * holdTimeSec) * (deviation * holdTimeSec);
+        capacity += history.deviceCapacity;
+        advice.samplesCount += history.rates.size();
+    }
+
+    double limit = m_minimumBytes;
+    if (advice.samplesCount)
+    {
+        double margin = normalQuantile(confidence) * std::sqrt(variance);
+
+        advice.expectedBytes = static_cast<unsigned long long>(expected);
+        advice.marginBytes = static_cast<unsigned long long>(margin);
+        limit = std::max(limit, std::min(expected + margin, capacity));
+    }
+
+    advice.diffStorageLimitSect = (static_cast<unsigned long long>(limit) + SECTOR_SIZE - 1) >> SECTOR_SHIFT;
+    return advice;
+}
+
+void CDiffStorageAdvisor::Load()
+{
+    m_history.clear();
+    if (m_historyFile.empty())
+        return;
+
+    std::ifstream input(m_historyFile);
+    if (!input.is_open())
+        return;
+
+    std::string line;
+    while (std::getline(input, line))
+    {
+        std::istringstream ss(line);
+        std::string type;
+        std::string key;
+
+        ss >> type >> key;
+        if (type == "device")
+        {
+            SDeviceHistory& history = m_history[key];
+            std::string generationId;
+            unsigned int snapNumber;
+
+            ss >> generationId >> snapNumber >> history.timeLabel >> history.deviceCapacity;
+            if (ss.fail() || uuid_parse(generationId.c_str(), history.generationId))
+                throw std::runtime_error("Invalid record in the history file [" + m_historyFile + "].");
+            history.snapNumber = static_cast<unsigned char>(snapNumber);
+        }
+        else if (type == "rate")
+        {
+            SRateSample sample;
+
+            ss >> sample.timeLabel >> sample.bytesPerSecond;
+            if (ss.fail())
+                throw std::runtime_error("Invalid record in the history file [" + m_historyFile + "].");
+            m_history[key].rates.push_back(sample);
+        }
+    }
+}
+
+void CDiffStorageAdvisor::Save() const
+{
+    if (m_historyFile.empty())
+        return;
+
+    fs::path path(m_historyFile);
+    if (path.has_parent_path())
+        fs::create_directories(path.parent_path());
+
+    std::string tmpFile = m_historyFile + ".tmp";
+    {
+        std::ofstream output(tmpFile, std::ofstream::trunc);
+        if (!output.is_open())
+            throw std::runtime_error("Failed to open file [" + tmpFile + "].");
+
+        output << "# blksnap difference storage advisor history" << std::endl;
+        output << std::setprecision(15);
+        for (const auto& it : m_history)
+        {
+            char generationId[64];
+
+            uuid_unparse(it.second.generationId, generationId);
+            output << "device " << it.first << " " << generationId << " "
+                   << static_cast<unsigned int>(it.second.snapNumber) << " "
+                   << it.second.timeLabel << " " << it.second.deviceCapacity << std::endl;
+            for (const SRateSample& sample : it.second.rates)
+                output << "rate " << it.first << " " << sample.timeLabel << " " << sample.bytesPerSecond << std::endl;
+        }
+        if (output.fail())
+            throw std::runtime_error("Failed to write file [" + tmpFile + "].");
+    }
+    fs::rename(tmpFile, m_historyFile);
+}
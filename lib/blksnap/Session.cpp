@@ -17,18 +17,27 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 
+#include <blksnap/OpenFileHolder.h>
 #include <blksnap/Tracker.h>
 #include <blksnap/Snapshot.h>
 #include <blksnap/Session.h>
+#include <blksnap/SpscRing.h>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include <errno.h>
 #include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <list>
 #include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <mutex>
+#include <set>
+#include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -42,10 +51,37 @@ namespace fs = boost::filesystem;
 
 using namespace blksnap;
 
+struct SSubscription
+{
+    int id;
+    SessionEventCallback callback;
+};
+using SubscriptionList = std::vector<SSubscription>;
+
 struct SState
 {
     std::atomic<bool> stop;
     std::string diffStorage;
+    /*
+     * The list of the subscriptions is replaced entirely on each change and
+     * the version is incremented. The session thread checks the version for
+     * each event and takes the lock only to load the new list after a
+     * change, so the delivery of the events does not take locks.
+     */
+    std::mutex subscriptionLock;
+    std::shared_ptr<const SubscriptionList> subscriptions;
+    std::atomic<unsigned long long> subscriptionVersion;
+    int subscriptionId;
+    /*
+     * The events are delivered without string formatting. If the queue is
+     * full, the event is dropped from it and its description is added to
+     * the failure messages, so GetError() still reports it.
+     */
+    CSpscRing<SBlksnapEvent, 256> events;
+    /*
+     * The session thread failures are rare, so they are stored as strings.
+     */
+    std::atomic<bool> hasFailure;
     std::mutex lock;
     std::list<std::string> errorMessage;
 };
@@ -55,10 +91,22 @@ class CSession : public ISession
 public:
     CSession(const std::vector<std::string>& devices,
              const std::string& diffStorageFilePath,
-             const unsigned long long limit);
+             const unsigned long long limit,
+             const bool isFreeze);
     ~CSession() override;
 
     bool GetError(std::string& errorMessage) override;
+    int Subscribe(const SessionEventCallback& callback) override;
+    void Unsubscribe(const int subscriptionId) override;
+    bool PollEvent(SBlksnapEvent& ev) override;
+    unsigned long long GetDroppedEventCount() override;
+    unsigned long long GetFreezeTimeNs() override
+    {
+        return m_freezeTimeNs;
+    };
+
+private:
+    void Stop();
 
 private:
     CSnapshotId m_id;
@@ -66,6 +114,8 @@ private:
     std::shared_ptr<CSnapshot> m_ptrSnapshot;
     std::shared_ptr<SState> m_ptrState;
     std::shared_ptr<std::thread> m_ptrThread;
+
+    unsigned long long m_freezeTimeNs;
 };
 
 std::shared_ptr<ISession> ISession::Create(
@@ -73,14 +123,233 @@ std::shared_ptr<ISession> ISession::Create(
     const std::string& diffStorageFilePath,
     const unsigned long long limit)
 {
-    return std::make_shared<CSession>(devices, diffStorageFilePath, limit);
+    return std::make_shared<CSession>(devices, diffStorageFilePath, limit, false);
+}
+
+std::shared_ptr<ISession> ISession::Create(
+    const std::vector<std::string>& devices,
+    const std::string& diffStorageFilePath,
+    const unsigned long long limit,
+    const bool isFreeze)
+{
+    return std::make_shared<CSession>(devices, diffStorageFilePath, limit, isFreeze);
+}
+
+/*
+ * Decodes the octal escapes of the spaces and other special characters in
+ * the /proc/self/mountinfo fields.
+ */
+static std::string unescapeMountInfo(const std::string& field)
+{
+    std::string result;
+
+    for (size_t inx = 0; inx < field.size(); inx++)
+    {
+        if ((field[inx] == '\\') && ((inx + 3) < field.size()) && (field[inx + 1] >= '0') && (field[inx + 1] <= '7'))
+        {
+            result += static_cast<char>(std::stoi(field.substr(inx + 1, 3), nullptr, 8));
+            inx += 3;
+        }
+        else
+            result += field[inx];
+    }
+    return result;
+}
+
+/*
+ * Returns one mount point for each file system on the block devices.
+ * The file system can be mounted several times, but it should be frozen
+ * only once.
+ */
+static std::vector<std::string> mountPoints(const std::vector<std::string>& devices)
+{
+    std::set<std::string> deviceIds;
+    std::vector<std::string> result;
+
+    for (const auto& name : devices)
+    {
+        struct stat st;
+
+        if (::stat(name.c_str(), &st))
+            throw std::system_error(errno, std::generic_category(), "Failed to get status for '" + name + "'.");
+
+        deviceIds.insert(std::to_string(major(st.st_rdev)) + ":" + std::to_string(minor(st.st_rdev)));
+    }
+
+    std::ifstream mountInfo("/proc/self/mountinfo");
+    if (!mountInfo.is_open())
+        throw std::runtime_error("Failed to open file [/proc/self/mountinfo].");
+
+    std::string line;
+    while (std::getline(mountInfo, line))
+    {
+        std::istringstream ss(line);
+        std::string mountId;
+        std::string parentId;
+        std::string deviceId;
+        std::string root;
+        std::string mountPoint;
+
+        ss >> mountId >> parentId >> deviceId >> root >> mountPoint;
+        if (deviceIds.erase(deviceId))
+            result.push_back(unescapeMountInfo(mountPoint));
+    }
+    return result;
+}
+
+/*
+ * Freezes the file systems in parallel. The threads are started and the
+ * mount points are opened in advance, so only the ioctl calls remain in the
+ * freeze window.
+ */
+class CFsFreezer
+{
+public:
+    CFsFreezer(const std::vector<std::string>& devices)
+        : m_isStarted(false)
+        , m_isCancelled(false)
+        , m_completed(0)
+    {
+        for (const auto& mountPoint : mountPoints(devices))
+            m_mounts.push_back(
+                {mountPoint, std::make_shared<COpenFileHolder>(mountPoint, O_RDONLY | O_DIRECTORY), 0, false});
+
+        try
+        {
+            for (auto& mount : m_mounts)
+                m_threads.emplace_back(&CFsFreezer::Worker, this, std::ref(mount));
+        }
+        catch (...)
+        {
+            Cancel();
+            throw;
+        }
+    };
+
+    ~CFsFreezer()
+    {
+        Cancel();
+        Thaw();
+    };
+
+    void Freeze()
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_isStarted = true;
+        }
+        m_startCond.notify_all();
+
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_completeCond.wait(guard, [this] { return m_completed == m_mounts.size(); });
+
+        for (const auto& mount : m_mounts)
+        {
+            if (mount.errorCode)
+            {
+                guard.unlock();
+                Thaw();
+                throw std::system_error(mount.errorCode, std::generic_category(),
+                                        "Failed to freeze file system [" + mount.mountPoint + "].");
+            }
+        }
+    };
+
+    void Thaw()
+    {
+        for (auto& mount : m_mounts)
+        {
+            if (!mount.isFrozen)
+                continue;
+
+            if (::ioctl(mount.fd->Get(), FITHAW, 0))
+                std::cerr << "Failed to thaw file system [" << mount.mountPoint << "]: " << std::strerror(errno)
+                          << std::endl;
+            mount.isFrozen = false;
+        }
+    };
+
+private:
+    struct SMount
+    {
+        std::string mountPoint;
+        std::shared_ptr<COpenFileHolder> fd;
+        int errorCode;
+        bool isFrozen;
+    };
+
+    void Cancel()
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_isCancelled = true;
+        }
+        m_startCond.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+        m_threads.clear();
+    };
+
+    void Worker(SMount& mount)
+    {
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            m_startCond.wait(guard, [this] { return m_isStarted || m_isCancelled; });
+            if (!m_isStarted)
+                return;
+        }
+
+        if (::ioctl(mount.fd->Get(), FIFREEZE, 0))
+            mount.errorCode = errno;
+        else
+            mount.isFrozen = true;
+
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_completed++;
+        }
+        m_completeCond.notify_one();
+    };
+
+private:
+    std::vector<SMount> m_mounts;
+    std::vector<std::thread> m_threads;
+    std::mutex m_lock;
+    std::condition_variable m_startCond;
+    std::condition_variable m_completeCond;
+    bool m_isStarted;
+    bool m_isCancelled;
+    size_t m_completed;
+};
+
+static void SetFailure(SState& state, const std::string& errorMessage)
+{
+    std::lock_guard<std::mutex> guard(state.lock);
+
+    state.errorMessage.push_back(errorMessage);
+    state.hasFailure = true;
+}
+
+static std::string eventMessage(const SBlksnapEvent& ev)
+{
+    switch (ev.code)
+    {
+    case blksnap_event_code_corrupted:
+        return std::system_error(ev.corrupted.errorCode, std::generic_category(),
+                                 "Snapshot corrupted for device " + std::to_string(ev.corrupted.origDevIdMj) + ":"
+                                     + std::to_string(ev.corrupted.origDevIdMn))
+            .what();
+    default:
+        return "Invalid blksnap event code " + std::to_string(ev.code) + " received.";
+    }
 }
 
 static void BlksnapThread(std::shared_ptr<CSnapshot> ptrCtl, std::shared_ptr<SState> ptrState)
 {
     struct SBlksnapEvent ev;
-    int diffStorageNumber = 1;
     bool is_eventReady;
+    std::shared_ptr<const SubscriptionList> subscriptions = std::make_shared<const SubscriptionList>();
+    unsigned long long subscriptionVersion = 0;
 
     while (!ptrState->stop)
     {
@@ -90,36 +359,40 @@ static void BlksnapThread(std::shared_ptr<CSnapshot> ptrCtl, std::shared_ptr<SSt
         }
         catch (std::exception& ex)
         {
-            std::cerr << ex.what() << std::endl;
-            std::lock_guard<std::mutex> guard(ptrState->lock);
-            ptrState->errorMessage.push_back(std::string(ex.what()));
+            SetFailure(*ptrState, ex.what());
             break;
         }
 
         if (!is_eventReady)
             continue;
 
-        try
+        if (!ptrState->events.Push(ev))
+            SetFailure(*ptrState, "The event queue is full. " + eventMessage(ev));
+
+        if (ptrState->subscriptionVersion.load(std::memory_order_acquire) != subscriptionVersion)
         {
-            switch (ev.code)
-            {
-            case blksnap_event_code_corrupted:
-                throw std::system_error(ev.corrupted.errorCode, std::generic_category(),
-                    std::string("Snapshot corrupted for device " + std::to_string(ev.corrupted.origDevIdMj) + ":" + std::to_string(ev.corrupted.origDevIdMn)));
-            default:
-                throw std::runtime_error("Invalid blksnap event code received.");
-            }
+            std::lock_guard<std::mutex> guard(ptrState->subscriptionLock);
+
+            subscriptions = ptrState->subscriptions;
+            subscriptionVersion = ptrState->subscriptionVersion.load(std::memory_order_relaxed);
         }
-        catch (std::exception& ex)
+        for (const SSubscription& subscription : *subscriptions)
         {
-            std::cerr << ex.what() << std::endl;
-            std::lock_guard<std::mutex> guard(ptrState->lock);
-            ptrState->errorMessage.push_back(std::string(ex.what()));
+            try
+            {
+                subscription.callback(ev);
+            }
+            catch (std::exception& ex)
+            {
+                SetFailure(*ptrState, ex.what());
+            }
         }
     }
 }
 
-CSession::CSession(const std::vector<std::string>& devices, const std::string& diffStorageFilePath, const unsigned long long limit)
+CSession::CSession(const std::vector<std::string>& devices, const std::string& diffStorageFilePath,
+                   const unsigned long long limit, const bool isFreeze)
+    : m_freezeTimeNs(0)
 {
     for (const auto& name : devices)
         CTracker(name).Attach();
@@ -134,6 +407,10 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
     // Prepare state structure for thread
     m_ptrState = std::make_shared<SState>();
     m_ptrState->stop = false;
+    m_ptrState->hasFailure = false;
+    m_ptrState->subscriptions = std::make_shared<const SubscriptionList>();
+    m_ptrState->subscriptionVersion = 0;
+    m_ptrState->subscriptionId = 0;
 
     // Append first portion for diff storage
     struct SBlksnapEvent ev;
@@ -156,15 +433,40 @@ CSession::CSession(const std::vector<std::string>& devices, const std::string& d
     m_ptrThread = std::make_shared<std::thread>(BlksnapThread, m_ptrSnapshot, m_ptrState);
     ::usleep(0);
 
+    try
+    {
+        if (isFreeze)
+        {
+            // All preparations are done before, only the freeze, take and thaw remain
+            CFsFreezer freezer(devices);
+            auto start = std::chrono::steady_clock::now();
 
-    // Take snapshot
-    m_ptrSnapshot->Take();
+            try
+            {
+                freezer.Freeze();
+                m_ptrSnapshot->Take();
+            }
+            catch (...)
+            {
+                freezer.Thaw();
+                throw;
+            }
+            freezer.Thaw();
+            m_freezeTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                 std::chrono::steady_clock::now() - start).count();
+        }
+        else
+            m_ptrSnapshot->Take();
+    }
+    catch (...)
+    {
+        Stop();
+        throw;
+    }
 }
 
-CSession::~CSession()
+void CSession::Stop()
 {
-    // std::cout << "Destroy blksnap session" << std::endl;
-
     // Stop thread
     m_ptrState->stop = true;
     m_ptrThread->join();
@@ -181,13 +483,70 @@ CSession::~CSession()
     }
 }
 
+CSession::~CSession()
+{
+    // std::cout << "Destroy blksnap session" << std::endl;
+
+    Stop();
+}
+
 bool CSession::GetError(std::string& errorMessage)
 {
+    struct SBlksnapEvent ev;
+
+    if (m_ptrState->events.Pop(ev))
+    {
+        errorMessage = eventMessage(ev);
+        return true;
+    }
+
+    if (!m_ptrState->hasFailure)
+        return false;
+
     std::lock_guard<std::mutex> guard(m_ptrState->lock);
     if (!m_ptrState->errorMessage.size())
         return false;
 
     errorMessage = m_ptrState->errorMessage.front();
     m_ptrState->errorMessage.pop_front();
+    if (m_ptrState->errorMessage.empty())
+        m_ptrState->hasFailure = false;
     return true;
 }
+
+int CSession::Subscribe(const SessionEventCallback& callback)
+{
+    std::lock_guard<std::mutex> guard(m_ptrState->subscriptionLock);
+    auto subscriptions = std::make_shared<SubscriptionList>(*m_ptrState->subscriptions);
+    int id = ++m_ptrState->subscriptionId;
+
+    subscriptions->push_back({id, callback});
+    m_ptrState->subscriptions = subscriptions;
+    m_ptrState->subscriptionVersion.fetch_add(1, std::memory_order_release);
+    return id;
+}
+
+void CSession::Unsubscribe(const int subscriptionId)
+{
+    std::lock_guard<std::mutex> guard(m_ptrState->subscriptionLock);
+    auto subscriptions = std::make_shared<SubscriptionList>(*m_ptrState->subscriptions);
+
+    subscriptions->erase(std::remove_if(subscriptions->begin(), subscriptions->end(),
+                                        [subscriptionId](const SSubscription& subscription)
+                                        {
+                                            return subscription.id == subscriptionId;
+                                        }),
+                         subscriptions->end());
+    m_ptrState->subscriptions = subscriptions;
+    m_ptrState->subscriptionVersion.fetch_add(1, std::memory_order_release);
+}
+
+bool CSession::PollEvent(SBlksnapEvent& ev)
+{
+    return m_ptrState->events.Pop(ev);
+}
+
+unsigned long long CSession::GetDroppedEventCount()
+{
+    return m_ptrState->events.Dropped();
+}
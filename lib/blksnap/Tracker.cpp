@@ -107,20 +107,27 @@ void CTracker::ReadCbtMap(unsigned int offset, unsigned int length, uint8_t* buf
 }
 void CTracker::MarkDirtyBlock(std::vector<struct blksnap_sectors>& ranges)
 {
-    struct blksnap_cbtdirty arg = {
-        .count = static_cast<unsigned int>(ranges.size()),
-        .dirty_sectors = (__u64)ranges.data(),
-    };
-    struct blkfilter_ctl ctl = {
-        .name = BLKSNAP_FILTER_NAME,
-        .cmd = BLKFILTER_CTL_BLKSNAP_CBTDIRTY,
-        .optlen = sizeof(arg),
-        .opt = (__u64)&arg,
-    };
+    /*
+     * The module reads only the first range of the array, so the ranges
+     * are passed one by one.
+     */
+    for (struct blksnap_sectors& range : ranges)
+    {
+        struct blksnap_cbtdirty arg = {
+            .count = 1,
+            .dirty_sectors = (__u64)&range,
+        };
+        struct blkfilter_ctl ctl = {
+            .name = BLKSNAP_FILTER_NAME,
+            .cmd = BLKFILTER_CTL_BLKSNAP_CBTDIRTY,
+            .optlen = sizeof(arg),
+            .opt = (__u64)&arg,
+        };
 
-    if (::ioctl(m_fd, BLKFILTER_CTL, &ctl) < 0)
-        throw std::system_error(errno, std::generic_category(),
-            "Failed to mark block as 'dirty' in CBT map.");
+        if (::ioctl(m_fd, BLKFILTER_CTL, &ctl) < 0)
+            throw std::system_error(errno, std::generic_category(),
+                "Failed to mark block as 'dirty' in CBT map.");
+    }
 }
 void CTracker::SnapshotAdd(const uuid_t& id)
 {
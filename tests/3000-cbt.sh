@@ -107,6 +107,40 @@ echo "dirty blocks:"
 cmp -l ${TESTDIR}/cbt3.map ${TESTDIR}/cbt3_.map 2>&1
 set -e
 
+# increment 4
+echo "Mark several files as dirty"
+DIRTY_FILES=""
+for INX in 1 2 3 4
+do
+	fallocate --length ${INX}MiB "${MOUNTPOINT_1}/dirty_file_${INX}"
+	# the gaps separate the ranges of the files
+	fallocate --length 8MiB "${MOUNTPOINT_1}/gap_file_${INX}"
+	DIRTY_FILES="${DIRTY_FILES} ${MOUNTPOINT_1}/dirty_file_${INX}"
+done
+sync
+
+blksnap_snapshot_create ${DEVICE_1} "${DIFF_STORAGE}" "1G"
+blksnap_snapshot_take
+
+blksnap_readcbt ${DEVICE_1} ${TESTDIR}/cbt4.map
+blksnap_markdirty ${DEVICE_1} ${DIRTY_FILES}
+blksnap_readcbt ${DEVICE_1} ${TESTDIR}/cbt4_all.map
+# marking the files one by one must not change the map any more
+for FILE in ${DIRTY_FILES}
+do
+	blksnap_markdirty ${DEVICE_1} ${FILE}
+done
+blksnap_readcbt ${DEVICE_1} ${TESTDIR}/cbt4_each.map
+
+blksnap_snapshot_destroy
+
+if cmp -s ${TESTDIR}/cbt4.map ${TESTDIR}/cbt4_all.map
+then
+	echo "The dirty files were not marked in the CBT map"
+	exit 1
+fi
+cmp -l ${TESTDIR}/cbt4_all.map ${TESTDIR}/cbt4_each.map
+
 echo "Destroy first device"
 blksnap_detach ${DEVICE_1}
 umount ${MOUNTPOINT_1}
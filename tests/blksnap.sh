@@ -106,9 +106,9 @@ blksnap_readcbt()
 
 blksnap_markdirty()
 {
-	local DIRTYFILE=$2
+	shift
 
-	${BLKSNAP} markdirtyblock --file=${DIRTYFILE}
+	${BLKSNAP} markdirtyblock --file "$@"
 }
 
 blksnap_snapshot_watcher()
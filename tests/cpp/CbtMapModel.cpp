@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <errno.h>
+#include <fstream>
+#include <string.h>
+#include "CbtMapModel.h"
+
+using blksnap::sector_t;
+
+static bool readModuleParam(const std::string& name, unsigned long long& value)
+{
+    std::ifstream input("/sys/module/blksnap/parameters/" + name);
+    unsigned long long param;
+
+    if (!(input >> param))
+        return false;
+    value = param;
+    return true;
+}
+
+SCbtMapParams SCbtMapParams::FromModule()
+{
+    SCbtMapParams params;
+    unsigned long long value;
+
+    if (readModuleParam("tracking_block_minimum_shift", value))
+        params.minimumShift = value;
+    if (readModuleParam("tracking_block_maximum_shift", value))
+        params.maximumShift = value;
+    if (readModuleParam("tracking_block_maximum_count", value))
+        params.maximumCount = value;
+    return params;
+}
+
+static inline unsigned long long countByShift(const sector_t capacity, const unsigned int shift)
+{
+    const sector_t blockSize = 1ULL << (shift - SECTOR_SHIFT);
+
+    return (capacity + blockSize - 1) / blockSize;
+}
+
+CCbtMapModel::CCbtMapModel(const sector_t capacity, const SCbtMapParams& params)
+    : m_params(params)
+    , m_generation(0)
+{
+    Create(capacity);
+}
+
+void CCbtMapModel::CalculateBlockSize(const sector_t capacity, const SCbtMapParams& params,
+                                      unsigned int& blockSizeShift, unsigned long long& blockCount)
+{
+    unsigned int shift = params.minimumShift;
+    unsigned long long count = countByShift(capacity, shift);
+
+    while ((count > params.maximumCount) && (shift < params.maximumShift))
+    {
+        shift++;
+        count = countByShift(capacity, shift);
+    }
+
+    blockSizeShift = shift;
+    blockCount = count;
+}
+
+void CCbtMapModel::Create(const sector_t capacity)
+{
+    m_capacity = capacity;
+    CalculateBlockSize(capacity, m_params, m_blockSizeShift, m_blockCount);
+
+    m_readMap.assign(m_blockCount, 0);
+    m_writeMap.assign(m_blockCount, 0);
+    m_snapNumberPrevious = 0;
+    m_snapNumberActive = 1;
+    m_generation++;
+    m_isCorrupted = false;
+}
+
+int CCbtMapModel::SetMap(const sector_t sector, const sector_t count, const uint8_t snapNumber,
+                         std::vector<uint8_t>& map)
+{
+    const unsigned int shift = m_blockSizeShift - SECTOR_SHIFT;
+    const size_t first = sector >> shift;
+    const size_t last = (sector + count - 1) >> shift;
+
+    for (size_t inx = first; inx <= last; inx++)
+    {
+        if (inx >= m_blockCount)
+            return -EINVAL;
+
+        if (map[inx] < snapNumber)
+            map[inx] = snapNumber;
+    }
+    return 0;
+}
+
+int CCbtMapModel::Set(const sector_t sector, const sector_t count)
+{
+    int ret;
+
+    if (m_isCorrupted)
+        return -EINVAL;
+
+    ret = SetMap(sector, count, m_snapNumberActive, m_writeMap);
+    if (ret)
+        m_isCorrupted = true;
+    return ret;
+}
+
+int CCbtMapModel::SetBoth(const sector_t sector, const sector_t count)
+{
+    int ret;
+
+    if (m_isCorrupted)
+        return -EINVAL;
+
+    ret = SetMap(sector, count, m_snapNumberActive, m_writeMap);
+    if (!ret)
+        ret = SetMap(sector, count, m_snapNumberPrevious, m_readMap);
+    return ret;
+}
+
+void CCbtMapModel::Switch()
+{
+    m_snapNumberPrevious = m_snapNumberActive;
+    m_snapNumberActive++;
+    if (m_snapNumberActive == 256)
+    {
+        /*
+         * The read map is not updated when the generation is reset, it
+         * keeps the state of the previous snapshot.
+         */
+        m_snapNumberActive = 1;
+        memset(m_writeMap.data(), 0, m_writeMap.size());
+        m_generation++;
+    }
+    else
+        m_readMap = m_writeMap;
+}
+
+void CCbtMapModel::Take(const sector_t capacity)
+{
+    if (m_isCorrupted || (capacity != m_capacity))
+        Create(capacity);
+
+    Switch();
+}
@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <blksnap/Sector.h>
+
+/*
+ * The parameters of the kernel module that define the size of the CBT
+ * block. The default values are the same as in the module.
+ */
+struct SCbtMapParams
+{
+    unsigned int minimumShift = 16;
+    unsigned int maximumShift = 26;
+    unsigned long long maximumCount = 2097152;
+
+    /*
+     * Reads the current values from /sys/module/blksnap/parameters, the
+     * parameters that cannot be read keep the default values.
+     */
+    static SCbtMapParams FromModule();
+};
+
+/*
+ * The userspace model of the change tracking map of the kernel module
+ * (struct cbt_map). The functions have the same semantics as cbt_map_set(),
+ * cbt_map_set_both(), cbt_map_switch() and tracker_take_snapshot(),
+ * including the errors, so the model can be used as the reference for the
+ * maps read from the module. The generation identifier is random in the
+ * module, so the model only counts the generations.
+ */
+class CCbtMapModel
+{
+public:
+    CCbtMapModel(const blksnap::sector_t capacity, const SCbtMapParams& params = SCbtMapParams());
+
+    static void CalculateBlockSize(const blksnap::sector_t capacity, const SCbtMapParams& params,
+                                   unsigned int& blockSizeShift, unsigned long long& blockCount);
+
+    /*
+     * The write to the original device. After an error, the map is
+     * corrupted and it is not changed anymore.
+     */
+    int Set(const blksnap::sector_t sector, const blksnap::sector_t count);
+    /*
+     * The write to the snapshot image or the BLKFILTER_CTL_BLKSNAP_CBTDIRTY
+     * command. The blocks are marked in both maps.
+     */
+    int SetBoth(const blksnap::sector_t sector, const blksnap::sector_t count);
+    void Switch();
+    /*
+     * Taking the snapshot. The map is created again if it is corrupted or
+     * the capacity of the device has been changed.
+     */
+    void Take(const blksnap::sector_t capacity);
+
+    blksnap::sector_t Capacity() const
+    {
+        return m_capacity;
+    };
+    unsigned int BlockSizeShift() const
+    {
+        return m_blockSizeShift;
+    };
+    unsigned long long BlockCount() const
+    {
+        return m_blockCount;
+    };
+    unsigned int SnapNumberActive() const
+    {
+        return m_snapNumberActive;
+    };
+    /*
+     * The value that the module reports as the changes_number.
+     */
+    unsigned int SnapNumberPrevious() const
+    {
+        return m_snapNumberPrevious;
+    };
+    unsigned int Generation() const
+    {
+        return m_generation;
+    };
+    bool IsCorrupted() const
+    {
+        return m_isCorrupted;
+    };
+    /*
+     * The map that is read by the BLKFILTER_CTL_BLKSNAP_CBTMAP command.
+     */
+    const std::vector<uint8_t>& ReadMap() const
+    {
+        return m_readMap;
+    };
+    const std::vector<uint8_t>& WriteMap() const
+    {
+        return m_writeMap;
+    };
+
+private:
+    SCbtMapParams m_params;
+    blksnap::sector_t m_capacity;
+    unsigned int m_blockSizeShift;
+    unsigned long long m_blockCount;
+    unsigned int m_snapNumberActive;
+    unsigned int m_snapNumberPrevious;
+    unsigned int m_generation;
+    bool m_isCorrupted;
+    std::vector<uint8_t> m_readMap;
+    std::vector<uint8_t> m_writeMap;
+
+private:
+    void Create(const blksnap::sector_t capacity);
+    int SetMap(const blksnap::sector_t sector, const blksnap::sector_t count, const uint8_t snapNumber,
+               std::vector<uint8_t>& map);
+};
@@ -1,6 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0+
-#include <boost/crc.hpp>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <string.h>
+#include "helpers/Crc32cHelper.h"
 #include "helpers/Log.h"
 #include "helpers/RandomHelper.h"
 #include "TestSector.h"
@@ -10,6 +17,161 @@ using blksnap::SRange;
 
 const char* testHeadMagic = "testhead";
 
+/*
+ * The buffers are processed in parallel by the portions of this number of
+ * sectors, the smaller buffers are processed by the calling thread.
+ */
+const size_t parallelPortionSectors = 128;
+
+namespace
+{
+/*
+ * The pool of the threads that process the portions of the buffers.
+ * Several threads can run jobs at the same time, the calling thread also
+ * processes the portions of its job.
+ */
+class CWorkerPool
+{
+public:
+    static CWorkerPool& Instance()
+    {
+        static CWorkerPool pool;
+        return pool;
+    };
+
+    void Run(const size_t count, const std::function<void(size_t)>& fn)
+    {
+        if ((count < 2) || m_threads.empty())
+        {
+            for (size_t inx = 0; inx < count; inx++)
+                fn(inx);
+            return;
+        }
+
+        auto job = std::make_shared<SJob>(count, fn);
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_jobs.push_back(job);
+        }
+        m_cv.notify_all();
+
+        job->Process();
+        {
+            std::unique_lock<std::mutex> lock(job->lock);
+            job->cv.wait(lock, [&job] { return job->done == job->count; });
+        }
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            for (auto it = m_jobs.begin(); it != m_jobs.end(); it++)
+            {
+                if (*it == job)
+                {
+                    m_jobs.erase(it);
+                    break;
+                }
+            }
+        }
+    };
+
+private:
+    struct SJob
+    {
+        SJob(const size_t inCount, const std::function<void(size_t)>& inFn)
+            : count(inCount)
+            , fn(inFn)
+            , next(0)
+            , done(0)
+        {};
+
+        void Process()
+        {
+            size_t inx;
+
+            while ((inx = next++) < count)
+            {
+                fn(inx);
+                if (++done == count)
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    cv.notify_all();
+                }
+            }
+        };
+
+        const size_t count;
+        const std::function<void(size_t)>& fn;
+        std::atomic<size_t> next;
+        std::atomic<size_t> done;
+        std::mutex lock;
+        std::condition_variable cv;
+    };
+
+    CWorkerPool()
+        : m_isStop(false)
+    {
+        unsigned int threadCount = std::thread::hardware_concurrency();
+
+        for (unsigned int inx = 1; inx < threadCount; inx++)
+            m_threads.emplace_back(&CWorkerPool::Worker, this);
+    };
+
+    ~CWorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_isStop = true;
+        }
+        m_cv.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    };
+
+    void Worker()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+
+        while (!m_isStop)
+        {
+            /*
+             * The job stays in the queue until all its portions are taken,
+             * so all the threads join it. Run() removes the job.
+             */
+            auto it = std::find_if(m_jobs.begin(), m_jobs.end(),
+                                   [](const std::shared_ptr<SJob>& job) { return job->next < job->count; });
+            if (it == m_jobs.end())
+            {
+                m_cv.wait(lock);
+                continue;
+            }
+
+            auto job = *it;
+            lock.unlock();
+            job->Process();
+            lock.lock();
+        }
+    };
+
+private:
+    bool m_isStop;
+    std::mutex m_lock;
+    std::condition_variable m_cv;
+    std::deque<std::shared_ptr<SJob>> m_jobs;
+    std::vector<std::thread> m_threads;
+};
+
+inline int sectorCrc(const unsigned char* buffer)
+{
+    return static_cast<int>(CCrc32cHelper::Calculate(buffer + offsetof(STestHeader, seqNumber),
+                                                     SECTOR_SIZE - offsetof(STestHeader, seqNumber)));
+}
+
+inline uint64_t sectorSeed(const sector_t sector, const int seqNumber, const clock_t seqTime)
+{
+    return (static_cast<uint64_t>(sector) * 0x9E3779B97F4A7C15ULL)
+           ^ (static_cast<uint64_t>(seqNumber) << 32) ^ static_cast<uint64_t>(seqTime);
+}
+} // namespace
+
 void STestHeader::Init(const int inSeqNumber, const sector_t inSector, const clock_t inSeqTime)
 {
     memcpy(head, testHeadMagic, 8);
@@ -19,100 +181,128 @@ void STestHeader::Init(const int inSeqNumber, const sector_t inSector, const clo
     seqTime = inSeqTime;
 };
 
-void CTestSectorGenetor::Generate(unsigned char* buffer, size_t size, sector_t sector, const clock_t seqTime)
+void CTestSectorGenetor::GenerateSectors(unsigned char* buffer, size_t count, sector_t sector, const int seqNumber,
+                                         const clock_t seqTime)
 {
-    for (size_t offset = 0; offset < size; offset += SECTOR_SIZE)
+    for (; count; count--, sector++, buffer += SECTOR_SIZE)
     {
-        STestSector* t = (STestSector*)(buffer + offset);
+        STestSector* t = (STestSector*)buffer;
 
-        t->header.Init(m_seqNumber, sector, seqTime);
+        t->header.Init(seqNumber, sector, seqTime);
 
-        CRandomHelper::GenerateBuffer(t->body, sizeof(t->body));
+        CRandomHelper::GenerateBuffer(t->body, sizeof(t->body), sectorSeed(sector, seqNumber, seqTime));
 
         if (m_useCrc32)
-        {
-            boost::crc_32_type calc;
-            calc.process_bytes(buffer + offset + offsetof(STestHeader, seqNumber),
-                               SECTOR_SIZE - offsetof(STestHeader, seqNumber));
-            t->header.crc = calc.checksum();
-        }
-
-        sector++;
+            t->header.crc = sectorCrc(buffer);
     }
 }
 
+void CTestSectorGenetor::Generate(unsigned char* buffer, size_t size, sector_t sector, const clock_t seqTime)
+{
+    const size_t count = size / SECTOR_SIZE;
+    const size_t portions = (count + parallelPortionSectors - 1) / parallelPortionSectors;
+    const int seqNumber = m_seqNumber;
+
+    CWorkerPool::Instance().Run(portions, [&](size_t inx) {
+        const size_t first = inx * parallelPortionSectors;
+
+        GenerateSectors(buffer + first * SECTOR_SIZE, std::min(parallelPortionSectors, count - first), sector + first,
+                        seqNumber, seqTime);
+    });
+}
+
 void CTestSectorGenetor::Generate(unsigned char* buffer, size_t size, sector_t sector)
 {
     CTestSectorGenetor::Generate(buffer, size, sector, std::clock());
 }
 
-void CTestSectorGenetor::Check(unsigned char* buffer, size_t size, sector_t sector, const int seqNumber, const clock_t seqTime, bool isStrictly/*=false*/)
+void CTestSectorGenetor::CheckSectors(const unsigned char* buffer, size_t count, sector_t sector, const int seqNumber,
+                                      const clock_t seqTime, const bool isStrictly, std::vector<SSectorFail>& fails)
 {
-    for (size_t offset = 0; offset < size; offset += SECTOR_SIZE)
+    for (; count; count--, sector++, buffer += SECTOR_SIZE)
     {
-        struct STestSector* t = (STestSector*)buffer;
+        const STestSector* t = (const STestSector*)buffer;
+        SSectorFail fail;
 
-        int crc = 0xDEC032CC;
-        if (m_useCrc32)
+        fail.crc = m_useCrc32 ? sectorCrc(buffer) : 0xDEC032CC;
+        fail.isCorrupted = (fail.crc != t->header.crc);
+        fail.isIncorrect = (sector != t->header.sector);
+        fail.isInvalidSeqNumber = isStrictly ? (t->header.seqNumber != seqNumber) : (t->header.seqNumber > seqNumber);
+        fail.isInvalidSeqTime = isStrictly ? (t->header.seqTime != seqTime) : (t->header.seqTime > seqTime);
+
+        if (fail.isCorrupted || fail.isIncorrect || fail.isInvalidSeqNumber || fail.isInvalidSeqTime)
         {
-            boost::crc_32_type calc;
-            calc.process_bytes(buffer + offsetof(STestHeader, seqNumber),
-                               SECTOR_SIZE - offsetof(STestHeader, seqNumber));
-            crc = calc.checksum();
+            fail.sector = sector;
+            fail.header = t->header;
+            fails.push_back(fail);
         }
+    }
+}
 
-        bool isCorrupted = (crc != t->header.crc);
-        bool isIncorrect = (sector != t->header.sector);
-        bool isInvalidSeqNumber = isStrictly ? (t->header.seqNumber != seqNumber) : (t->header.seqNumber > seqNumber);
-        bool isInvalidSeqTime = isStrictly ? (t->header.seqTime != seqTime) : (t->header.seqTime > seqTime);
+void CTestSectorGenetor::Check(unsigned char* buffer, size_t size, sector_t sector, const int seqNumber, const clock_t seqTime, bool isStrictly/*=false*/)
+{
+    const size_t count = size / SECTOR_SIZE;
+    const size_t portions = (count + parallelPortionSectors - 1) / parallelPortionSectors;
+    std::vector<std::vector<SSectorFail>> fails(portions);
 
-        if (isCorrupted || isIncorrect || isInvalidSeqNumber || isInvalidSeqTime)
-        {
-            std::string failMessage;
+    CWorkerPool::Instance().Run(portions, [&](size_t inx) {
+        const size_t first = inx * parallelPortionSectors;
 
-            if (m_logLineCount == 30)
-                failMessage = "Too many sectors failed\n";
-            else if (m_logLineCount < 30)
-            {
-                if (isCorrupted)
-                {
-                    failMessage += std::string("Corrupted sector\n");
-                    failMessage += std::string("sector " + std::to_string(sector) + "\n");
-                    failMessage
-                      += std::string("crc " + std::to_string(t->header.crc) + " != " + std::to_string(crc) + "\n");
-                }
-                if (isIncorrect)
-                {
-                    failMessage += std::string("Incorrect sector\n");
-                    failMessage += std::string("sector " + std::to_string(t->header.sector)
-                                               + " != " + std::to_string(sector) + "\n");
-                }
-                if (isInvalidSeqNumber)
-                {
-                    failMessage += std::string("Invalid sequence number\n");
-                    failMessage += std::string("sector " + std::to_string(t->header.sector) + "\n");
-                    failMessage += std::string("seqNumber " + std::to_string(t->header.seqNumber) +
-                                               (isStrictly ? " != " : " > ") +
-                                               std::to_string(seqNumber) + "\n");
-                }
-                if (isInvalidSeqTime)
-                {
-                    failMessage += std::string("Invalid sequence time\n");
-                    failMessage += std::string("sector " + std::to_string(t->header.sector) + "\n");
-                    failMessage += std::string("seqTime " + std::to_string(t->header.seqTime) +
-                                               (isStrictly ? " != " : " > ") +
-                                               std::to_string(seqTime) + "\n");
-                }
-            }
+        CheckSectors(buffer + first * SECTOR_SIZE, std::min(parallelPortionSectors, count - first), sector + first,
+                     seqNumber, seqTime, isStrictly, fails[inx]);
+    });
 
-            SetFailedSector(sector, failMessage);
-            //logger.Err(buffer, 128);
-        }
+    /*
+     * The failed sectors are reported in order by the calling thread,
+     * since the list of the failed ranges is not protected by locks.
+     */
+    for (const auto& portionFails : fails)
+        for (const auto& fail : portionFails)
+            ReportFail(fail, seqNumber, seqTime, isStrictly);
+}
+
+void CTestSectorGenetor::ReportFail(const SSectorFail& fail, const int seqNumber, const clock_t seqTime,
+                                    const bool isStrictly)
+{
+    std::string failMessage;
 
-        sector++;
-        buffer += SECTOR_SIZE;
+    if (m_logLineCount == 30)
+        failMessage = "Too many sectors failed\n";
+    else if (m_logLineCount < 30)
+    {
+        if (fail.isCorrupted)
+        {
+            failMessage += std::string("Corrupted sector\n");
+            failMessage += std::string("sector " + std::to_string(fail.sector) + "\n");
+            failMessage
+              += std::string("crc " + std::to_string(fail.header.crc) + " != " + std::to_string(fail.crc) + "\n");
+        }
+        if (fail.isIncorrect)
+        {
+            failMessage += std::string("Incorrect sector\n");
+            failMessage += std::string("sector " + std::to_string(fail.header.sector)
+                                       + " != " + std::to_string(fail.sector) + "\n");
+        }
+        if (fail.isInvalidSeqNumber)
+        {
+            failMessage += std::string("Invalid sequence number\n");
+            failMessage += std::string("sector " + std::to_string(fail.header.sector) + "\n");
+            failMessage += std::string("seqNumber " + std::to_string(fail.header.seqNumber) +
+                                       (isStrictly ? " != " : " > ") +
+                                       std::to_string(seqNumber) + "\n");
+        }
+        if (fail.isInvalidSeqTime)
+        {
+            failMessage += std::string("Invalid sequence time\n");
+            failMessage += std::string("sector " + std::to_string(fail.header.sector) + "\n");
+            failMessage += std::string("seqTime " + std::to_string(fail.header.seqTime) +
+                                       (isStrictly ? " != " : " > ") +
+                                       std::to_string(seqTime) + "\n");
+        }
     }
-};
+
+    SetFailedSector(fail.sector, failMessage);
+}
 
 void CTestSectorGenetor::LogSector(sector_t sector, const std::string& failMessage)
 {
@@ -74,6 +74,22 @@ private:
     bool m_isCrc32Checking;
 
 private:
+    struct SSectorFail
+    {
+        blksnap::sector_t sector;
+        STestHeader header;
+        int crc;
+        bool isCorrupted;
+        bool isIncorrect;
+        bool isInvalidSeqNumber;
+        bool isInvalidSeqTime;
+    };
+
+    void GenerateSectors(unsigned char* buffer, size_t count, blksnap::sector_t sector, const int seqNumber,
+                         const clock_t seqTime);
+    void CheckSectors(const unsigned char* buffer, size_t count, blksnap::sector_t sector, const int seqNumber,
+                      const clock_t seqTime, const bool isStrictly, std::vector<SSectorFail>& fails);
+    void ReportFail(const SSectorFail& fail, const int seqNumber, const clock_t seqTime, const bool isStrictly);
     void LogSector(blksnap::sector_t sector, const std::string& failMessage);
     void SetFailedSector(blksnap::sector_t sector, const std::string& failMessage);
 
@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include "TraceFile.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+
+static const char traceMagic[8] = {'b', 'l', 'k', 's', 'n', 'a', 'p', 'T'};
+static const uint32_t traceVersion = 1;
+
+void CTraceImporter::AddLine(const std::string& line)
+{
+    std::istringstream ss(line);
+    std::vector<std::string> tokens;
+    std::string token;
+
+    while ((tokens.size() < 10) && (ss >> token))
+        tokens.push_back(token);
+
+    if ((tokens.size() < 10) || (tokens[0].find(',') == std::string::npos) || (tokens[8] != "+"))
+    {
+        m_skipped++;
+        return;
+    }
+    if ((tokens[5] != "Q") || (tokens[6].find('W') == std::string::npos))
+        return;
+
+    try
+    {
+        STraceRecord record = {0};
+        const std::string& time = tokens[3];
+        size_t dot = time.find('.');
+        std::string nsec = (dot == std::string::npos) ? "" : time.substr(dot + 1);
+
+        nsec.resize(9, '0');
+        record.timeNs = std::stoull(time.substr(0, dot)) * 1000000000ULL + std::stoull(nsec);
+        record.sector = std::stoull(tokens[7]);
+        record.count = std::stoul(tokens[9]);
+        for (char ch : tokens[6])
+        {
+            if (ch == 'S')
+                record.flags |= eTraceSync;
+            else if (ch == 'F')
+                record.flags |= eTraceFua;
+            else if (ch == 'M')
+                record.flags |= eTraceMeta;
+        }
+
+        if (record.count)
+            m_records.push_back(record);
+    }
+    catch (std::exception&)
+    {
+        m_skipped++;
+    }
+}
+
+void CTraceImporter::Save(const std::string& traceFile)
+{
+    STraceHeader header;
+
+    std::stable_sort(m_records.begin(), m_records.end(),
+                     [](const STraceRecord& a, const STraceRecord& b) { return a.timeNs < b.timeNs; });
+    if (!m_records.empty())
+    {
+        const uint64_t startNs = m_records.front().timeNs;
+
+        for (STraceRecord& record : m_records)
+            record.timeNs -= startNs;
+    }
+
+    memcpy(header.magic, traceMagic, sizeof(header.magic));
+    header.version = traceVersion;
+    header.recordSize = sizeof(STraceRecord);
+    header.count = m_records.size();
+
+    std::ofstream output(traceFile, std::ios::binary | std::ios::trunc);
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(m_records.data()), m_records.size() * sizeof(STraceRecord));
+    if (output.fail())
+        throw std::runtime_error("Failed to write file '" + traceFile + "'.");
+}
+
+std::vector<STraceRecord> LoadTrace(const std::string& traceFile)
+{
+    STraceHeader header;
+    std::ifstream input(traceFile, std::ios::binary);
+
+    if (!input.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        throw std::runtime_error("Failed to read the header of the trace file '" + traceFile + "'.");
+    if (memcmp(header.magic, traceMagic, sizeof(header.magic)) || (header.version != traceVersion)
+        || (header.recordSize != sizeof(STraceRecord)))
+        throw std::runtime_error("The file '" + traceFile + "' is not a supported trace file.");
+
+    std::vector<STraceRecord> records(header.count);
+    if (!input.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(STraceRecord)))
+        throw std::runtime_error("The trace file '" + traceFile + "' is truncated.");
+    return records;
+}
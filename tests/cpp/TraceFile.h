@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * The trace file consists of the header and the array of the records
+ * sorted by time. The time is counted in nanoseconds from the first
+ * request of the trace, the offset and the size are in sectors.
+ */
+enum ETraceFlags
+{
+    eTraceSync = 1,
+    eTraceFua = 2,
+    eTraceMeta = 4,
+};
+
+struct STraceHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+};
+
+struct STraceRecord
+{
+    uint64_t timeNs;
+    uint64_t sector;
+    uint32_t count;
+    uint32_t flags;
+};
+
+/*
+ * Collects the write requests from the text output of the blkparse with
+ * the default format:
+ *   8,0    3        1     0.000000000  697  Q  WS 223490 + 8 [kjournald]
+ * Only the queued requests are taken, since the blksnap filter handles the
+ * requests at the moment they are submitted to the device.
+ */
+class CTraceImporter
+{
+public:
+    CTraceImporter()
+        : m_skipped(0)
+    {};
+
+    void AddLine(const std::string& line);
+    void Save(const std::string& traceFile);
+
+    size_t Count() const
+    {
+        return m_records.size();
+    };
+
+    size_t Skipped() const
+    {
+        return m_skipped;
+    };
+
+private:
+    std::vector<STraceRecord> m_records;
+    size_t m_skipped;
+};
+
+std::vector<STraceRecord> LoadTrace(const std::string& traceFile);
@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <chrono>
+#include <future>
+#include <blksnap/Async.h>
+#include <blksnap/Snapshot.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "helpers/Log.h"
+
+namespace po = boost::program_options;
+using clock_type = std::chrono::steady_clock;
+
+#ifdef BLKSNAP_ASYNC_COROUTINE
+/*
+ * The coroutine that is started at once and is not awaited by anyone.
+ * The result is returned by the std::promise.
+ */
+struct SDetachedTask
+{
+    struct promise_type
+    {
+        SDetachedTask get_return_object()
+        {
+            return {};
+        };
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        };
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        };
+        void return_void()
+        {};
+        void unhandled_exception()
+        {
+            std::terminate();
+        };
+    };
+};
+
+static SDetachedTask createAndDestroy(blksnap::CAsync& async, const std::string diffStorage,
+                                      const unsigned long long diffStorageLimit, std::promise<void>& done)
+{
+    try
+    {
+        auto ptrSnapshot = co_await async.Await(
+            [&diffStorage, diffStorageLimit] { return blksnap::CSnapshot::Create(diffStorage, diffStorageLimit); });
+
+        logger.Info("Snapshot " + ptrSnapshot->Id().ToString() + " was created in the coroutine");
+        co_await async.Await([ptrSnapshot] { ptrSnapshot->Destroy(); });
+        done.set_value();
+    }
+    catch (...)
+    {
+        done.set_exception(std::current_exception());
+    }
+}
+#endif
+
+static double elapsedMs(const clock_type::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(clock_type::now() - start).count();
+}
+
+/*
+ * All snapshots are waited for at the same time. If the waiting occupied a
+ * thread of the pool, it would take count / threads timeouts.
+ */
+static void checkConcurrentWait(blksnap::CAsync& async,
+                                const std::vector<std::shared_ptr<blksnap::CSnapshot>>& snapshots,
+                                const unsigned int timeoutMs)
+{
+    std::vector<std::future<std::shared_ptr<blksnap::SBlksnapEvent>>> waits;
+
+    logger.Info("-- Wait for the events of " + std::to_string(snapshots.size()) + " snapshots");
+    const auto start = clock_type::now();
+    for (const auto& ptrSnapshot : snapshots)
+        waits.push_back(async.WaitEvent(ptrSnapshot, timeoutMs));
+
+    for (auto& wait : waits)
+    {
+        if (wait.get())
+            throw std::runtime_error("Unexpected event was received");
+    }
+    const double ms = elapsedMs(start);
+
+    logger.Info("All waits were completed in " + std::to_string(ms) + " ms");
+    if (ms > 2.0 * timeoutMs)
+        throw std::runtime_error("The waits were completed in " + std::to_string(ms) + " ms, but the timeout is "
+                                 + std::to_string(timeoutMs) + " ms");
+}
+
+/*
+ * The wait for the snapshot that is destroyed should be completed before
+ * the timeout expires.
+ */
+static void checkWaitDestroyed(blksnap::CAsync& async, const std::shared_ptr<blksnap::CSnapshot>& ptrSnapshot,
+                               const unsigned int timeoutMs)
+{
+    std::promise<std::string> completion;
+    std::future<std::string> result = completion.get_future();
+
+    logger.Info("-- Destroy the snapshot " + ptrSnapshot->Id().ToString() + " while its event is waited for");
+    const auto start = clock_type::now();
+    async.WaitEvent(ptrSnapshot, 10 * timeoutMs,
+                    [&completion](std::exception_ptr ex, std::shared_ptr<blksnap::SBlksnapEvent> ptrEvent) {
+                        try
+                        {
+                            if (ex)
+                                std::rethrow_exception(ex);
+                            if (!ptrEvent)
+                                completion.set_value("timeout");
+                            else
+                                completion.set_value("event " + std::to_string(ptrEvent->code));
+                        }
+                        catch (std::exception& ex)
+                        {
+                            completion.set_value(ex.what());
+                        }
+                    });
+    async.Destroy(ptrSnapshot).get();
+
+    const std::string status = result.get();
+    const double ms = elapsedMs(start);
+    logger.Info("The wait was completed in " + std::to_string(ms) + " ms: " + status);
+    if (status == "timeout")
+        throw std::runtime_error("The wait for the destroyed snapshot was not completed");
+}
+
+void CheckAsync(const std::string& diffStorage, const unsigned long long diffStorageLimit, const unsigned int count,
+                const unsigned int threads, const unsigned int timeoutMs)
+{
+    blksnap::CAsync async(threads);
+    std::vector<std::shared_ptr<blksnap::CSnapshot>> snapshots;
+
+    logger.Info("--- Test: check async ---");
+    logger.Info("diffStorage: " + diffStorage);
+    logger.Info("threads: " + std::to_string(threads));
+
+    try
+    {
+        std::vector<std::future<std::shared_ptr<blksnap::CSnapshot>>> creates;
+
+        for (unsigned int inx = 0; inx < count; inx++)
+            creates.push_back(async.CreateSnapshot(diffStorage, diffStorageLimit));
+        for (auto& create : creates)
+            snapshots.push_back(create.get());
+
+        checkConcurrentWait(async, snapshots, timeoutMs);
+
+        checkWaitDestroyed(async, snapshots.back(), timeoutMs);
+        snapshots.pop_back();
+
+#ifdef BLKSNAP_ASYNC_COROUTINE
+        std::promise<void> done;
+
+        logger.Info("-- Create and destroy the snapshot in the coroutine");
+        createAndDestroy(async, diffStorage, diffStorageLimit, done);
+        done.get_future().get();
+#else
+        logger.Info("-- The coroutines are not supported by the compiler");
+#endif
+    }
+    catch (std::exception&)
+    {
+        for (const auto& ptrSnapshot : snapshots)
+        {
+            try
+            {
+                ptrSnapshot->Destroy();
+            }
+            catch (std::exception& ex)
+            {
+                logger.Err(ex.what());
+            }
+        }
+        throw;
+    }
+
+    for (const auto& ptrSnapshot : snapshots)
+        async.Destroy(ptrSnapshot).get();
+
+    logger.Info("--- Success: check async ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the asynchronous facade of the library.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("diff_storage,s", po::value<std::string>(),
+            "Directory name for allocating diff storage files.")
+        ("diff_storage_limit,L", po::value<unsigned int>()->default_value(64),
+            "The limit of the diff storage of each snapshot in MiB.")
+        ("count,n", po::value<unsigned int>()->default_value(64), "The number of snapshots.")
+        ("threads,t", po::value<unsigned int>()->default_value(2), "The number of threads of the pool.")
+        ("timeout,T", po::value<unsigned int>()->default_value(1000), "The timeout of waiting for the events in milliseconds.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    if (!vm.count("diff_storage"))
+        throw std::invalid_argument("Argument 'diff_storage' is missed.");
+    std::string diffStorage = vm["diff_storage"].as<std::string>();
+
+    unsigned long long diffStorageLimit = static_cast<unsigned long long>(vm["diff_storage_limit"].as<unsigned int>()) << 20;
+
+    unsigned int count = vm["count"].as<unsigned int>();
+    if (count < 2)
+        throw std::invalid_argument("Argument 'count' should be at least 2.");
+
+    unsigned int threads = vm["threads"].as<unsigned int>();
+    if (!threads)
+        throw std::invalid_argument("Argument 'threads' cannot be zero.");
+
+    CheckAsync(diffStorage, diffStorageLimit, count, threads, vm["timeout"].as<unsigned int>());
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include "helpers/AlignedBuffer.hpp"
 #include "helpers/BlockDevice.h"
 #include "helpers/Log.h"
+#include "helpers/TestReport.h"
 #include "TestSector.h"
 
 namespace po = boost::program_options;
@@ -23,6 +24,8 @@ using blksnap::sector_t;
 using blksnap::SRange;
 
 int g_blksz = 512;
+unsigned int g_queueDepth = 32;
+CTestReport g_report("boundary");
 
 void FillBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen,
                 const std::shared_ptr<CBlockDevice>& ptrBdev,
@@ -31,7 +34,7 @@ void FillBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen,
     AlignedBuffer<unsigned char> portion(g_blksz, size);
 
     ptrGen->Generate(portion.Data(), size, offset >> SECTOR_SHIFT, seqTime);
-    ptrBdev->Write(portion.Data(), size, offset);
+    g_report.Measure("write", *ptrBdev, [&]() { ptrBdev->Write(portion.Data(), size, offset); });
 }
 
 void CheckBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen,
@@ -44,7 +47,7 @@ void CheckBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen,
 {
     AlignedBuffer<unsigned char> portion(g_blksz, size);
 
-    ptrBdev->Read(portion.Data(), size, offset);
+    g_report.Measure("read", *ptrBdev, [&]() { ptrBdev->Read(portion.Data(), size, offset); });
     ptrGen->Check(portion.Data(), size, offset >> SECTOR_SHIFT, seqNumber, seqTime, isStrictly);
 
     if (ptrGen->Fails() > 0)
@@ -61,21 +64,14 @@ void CheckBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen,
  */
 void FillAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared_ptr<CBlockDevice>& ptrBdev)
 {
-    AlignedBuffer<unsigned char> portion(g_blksz, 1024 * 1024);
-    off_t sizeBdev = ptrBdev->Size();
-    sector_t sector = 0;
-
     logger.Info("device [" + ptrBdev->Name() + "] size " + std::to_string(ptrBdev->Size()) + " bytes");
-    for (off_t offset = 0; offset < sizeBdev; offset += portion.Size())
-    {
-        size_t portionSize = std::min(portion.Size(), static_cast<size_t>(sizeBdev - offset));
-
-        ptrGen->Generate(portion.Data(), portionSize, sector);
-
-        ptrBdev->Write(portion.Data(), portionSize, offset);
 
-        sector += (portionSize >> SECTOR_SHIFT);
-    }
+    ptrBdev->SetQueueDepth(g_queueDepth);
+    g_report.Measure("fill", *ptrBdev, [&]() {
+        ptrBdev->WriteRange(0, ptrBdev->Size(), 1024 * 1024, [&ptrGen](unsigned char* buf, size_t count, off_t offset) {
+            ptrGen->Generate(buf, count, offset >> SECTOR_SHIFT);
+        });
+    });
 }
 
 /**
@@ -84,24 +80,17 @@ void FillAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared
 void CheckAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared_ptr<CBlockDevice>& ptrBdev,
               const int seqNumber, const clock_t seqTime)
 {
-    AlignedBuffer<unsigned char> portion(g_blksz, 1024 * 1024);
-    off_t sizeBdev = ptrBdev->Size();
-    sector_t sector = 0;
-
     logger.Info("Check on image [" + ptrBdev->Name() + "]");
 
     ::sync();
 
-    for (off_t offset = 0; offset < sizeBdev; offset += portion.Size())
-    {
-        size_t portionSize = std::min(portion.Size(), static_cast<size_t>(sizeBdev - offset));
-
-        ptrBdev->Read(portion.Data(), portionSize, offset);
-
-        ptrGen->Check(portion.Data(), portionSize, sector, seqNumber, seqTime);
-
-        sector += (portionSize >> SECTOR_SHIFT);
-    }
+    ptrBdev->SetQueueDepth(g_queueDepth);
+    g_report.Measure("check", *ptrBdev, [&]() {
+        ptrBdev->ReadRange(0, ptrBdev->Size(), 1024 * 1024,
+                           [&ptrGen, seqNumber, seqTime](unsigned char* buf, size_t count, off_t offset) {
+                               ptrGen->Check(buf, count, offset >> SECTOR_SHIFT, seqNumber, seqTime);
+                           });
+    });
 }
 
 static inline off_t randomChunk(const int chunkSize, const off_t downLimit, const off_t upLimit, std::map<off_t, bool>& excludeHistory)
@@ -381,7 +370,11 @@ void Main(int argc, char* argv[])
         ("duration,u", po::value<int>(), "The test duration limit in minutes.")
         ("sync", "Use O_SYNC for access to original device.")
         ("blksz", po::value<int>()->default_value(512), "Align reads and writes to the block size.")
+        ("queue_depth,q", po::value<unsigned int>()->default_value(32),
+            "The number of asynchronous requests in flight when the whole device is filled or checked.")
         ("chunksize", po::value<int>(), "The size of chunks buffer.")
+        ("json,j", po::value<std::string>(),
+            "The file for the I/O statistics and the results in JSON format. By default, they are written to the log.")
         ;
     po::variables_map vm;
     po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
@@ -440,6 +433,23 @@ void Main(int argc, char* argv[])
     g_blksz = vm["blksz"].as<int>();
     logger.Info("blksz: " + std::to_string(g_blksz));
 
+    g_queueDepth = vm["queue_depth"].as<unsigned int>();
+    if (!g_queueDepth)
+        throw std::invalid_argument("Argument 'queue_depth' cannot be zero.");
+    logger.Info("queue_depth: " + std::to_string(g_queueDepth));
+
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
+    g_report.SetParameter("device", origDevName);
+    g_report.SetParameter("diff_storage_limit", std::to_string(diffStorageLimit));
+    g_report.SetParameter("duration", std::to_string(duration));
+    g_report.SetParameter("sync", std::to_string(isSync));
+    g_report.SetParameter("blksz", std::to_string(g_blksz));
+    g_report.SetParameter("queue_depth", std::to_string(g_queueDepth));
+    g_report.SetParameter("chunksize", std::to_string(chunkSize));
+
     try
     {
         CheckBoundary(origDevName, diffStorage, diffStorageLimit,
@@ -448,8 +458,10 @@ void Main(int argc, char* argv[])
     catch (std::exception& ex)
     {
         logger.Err(ex.what());
+        g_report.Save(jsonFile, ex.what());
         throw std::runtime_error("--- Failed: boundary conditions ---");
     }
+    g_report.Save(jsonFile);
     logger.Info("--- Success: boundary conditions ---");
 }
 
@@ -1,15 +1,613 @@
 // SPDX-License-Identifier: GPL-2.0+
+#include <algorithm>
+#include <chrono>
+#include <random>
 #include <blksnap/Cbt.h>
 #include <blksnap/Session.h>
+#include <blksnap/Snapshot.h>
+#include <blksnap/Tracker.h>
 #include <boost/program_options.hpp>
 #include <iostream>
+#include <string.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
+#include "helpers/LoopDevice.h"
+#include "helpers/TestReport.h"
+#include "CbtMapModel.h"
 
 namespace po = boost::program_options;
 using blksnap::sector_t;
+using clock_type = std::chrono::steady_clock;
+
+/*
+ * Compares the state of the tracker with the model, the whole map is read.
+ */
+static void compareWithModel(blksnap::CTracker& tracker, const CCbtMapModel& model, uuid_t generationId,
+                             unsigned int& generation, const std::string& step)
+{
+    struct blksnap_cbtinfo info;
+
+    tracker.CbtInfo(info);
+    if (info.device_capacity != (static_cast<unsigned long long>(model.Capacity()) << SECTOR_SHIFT))
+        throw std::runtime_error(step + ": device capacity " + std::to_string(info.device_capacity) + " != "
+                                 + std::to_string(model.Capacity() << SECTOR_SHIFT));
+    if (info.block_size != (1U << model.BlockSizeShift()))
+        throw std::runtime_error(step + ": block size " + std::to_string(info.block_size) + " != "
+                                 + std::to_string(1U << model.BlockSizeShift()));
+    if (info.block_count != model.BlockCount())
+        throw std::runtime_error(step + ": block count " + std::to_string(info.block_count) + " != "
+                                 + std::to_string(model.BlockCount()));
+    if (info.changes_number != static_cast<uint8_t>(model.SnapNumberPrevious()))
+        throw std::runtime_error(step + ": changes number " + std::to_string(info.changes_number) + " != "
+                                 + std::to_string(model.SnapNumberPrevious()));
+
+    bool isNewGeneration = !!uuid_compare(generationId, info.generation_id.b);
+    if (isNewGeneration != (generation != model.Generation()))
+        throw std::runtime_error(step + ": the generation was " + (isNewGeneration ? "" : "not ")
+                                 + "changed unexpectedly");
+    uuid_copy(generationId, info.generation_id.b);
+    generation = model.Generation();
+
+    std::vector<uint8_t> map(info.block_count);
+    const unsigned int portion = 1024 * 1024;
+    for (unsigned int offset = 0; offset < info.block_count; offset += portion)
+        tracker.ReadCbtMap(offset, std::min(portion, info.block_count - offset), map.data() + offset);
+
+    const std::vector<uint8_t>& expected = model.ReadMap();
+    auto mismatch = std::mismatch(map.begin(), map.end(), expected.begin());
+    if (mismatch.first != map.end())
+    {
+        size_t inx = mismatch.first - map.begin();
+
+        throw std::runtime_error(step + ": the block " + std::to_string(inx) + " is "
+                                 + std::to_string(map[inx]) + ", but " + std::to_string(expected[inx])
+                                 + " is expected");
+    }
+}
+
+/*
+ * Checks that the module calculates the size of the CBT block in the same
+ * way as the model for devices of different sizes.
+ */
+static const std::vector<unsigned long long> defaultBlockSizeCheckSizes = {
+    1ULL << 20,           // smaller than one block
+    (257ULL << 20) + 512, // not aligned to the block
+    128ULL << 30,         // the maximum count of the minimum blocks
+    (128ULL << 30) + 512,
+    1ULL << 40,
+    100ULL << 40,
+};
+
+/*
+ * The sizes that the file system of the loop directory does not allow, for
+ * example, more than 16 TiB on ext4, are skipped.
+ */
+void CheckBlockSize(const std::string& loopDir, const SCbtMapParams& params,
+                    const std::vector<unsigned long long>& sizes)
+{
+    logger.Info("-- Check the CBT block size");
+    for (unsigned long long size : sizes)
+    {
+        LoopDevice::Ptr loop;
+        try
+        {
+            loop = LoopDevice::Create(loopDir, size, true);
+        }
+        catch (std::system_error& ex)
+        {
+            if ((ex.code() != std::error_code(EFBIG, std::generic_category()))
+                && (ex.code() != std::error_code(EINVAL, std::generic_category())))
+                throw;
+
+            logger.Err("Warning: size " + std::to_string(size) + " is skipped: " + ex.what());
+            continue;
+        }
+        blksnap::CTracker tracker(loop->GetDevice().string());
+        struct blksnap_cbtinfo info;
+        unsigned int shift;
+        unsigned long long count;
+
+        tracker.Attach();
+        tracker.CbtInfo(info);
+        tracker.Detach();
+
+        CCbtMapModel::CalculateBlockSize(size >> SECTOR_SHIFT, params, shift, count);
+        logger.Info("size " + std::to_string(size) + ": block size " + std::to_string(info.block_size) + ", count "
+                    + std::to_string(info.block_count));
+        if ((info.block_size != (1U << shift)) || (info.block_count != count))
+            throw std::runtime_error("The model expects block size " + std::to_string(1U << shift) + " and count "
+                                     + std::to_string(count) + " for the device size " + std::to_string(size));
+    }
+}
+
+/*
+ * Performs the random operations with the tracker and the model and
+ * compares them after each operation. The number of snapshots should be
+ * more than 255 to check the reset of the generation.
+ */
+void CheckModel(const std::string& loopDir, const std::string& diffStorage, const SCbtMapParams& params,
+                const unsigned long long deviceSize, const unsigned int iterations, const unsigned int seed)
+{
+    std::mt19937 rnd(seed);
+    auto loop = LoopDevice::Create(loopDir, deviceSize);
+    const std::string device = loop->GetDevice().string();
+    auto ptrBdev = std::make_shared<CBlockDevice>(device);
+    const sector_t capacity = ptrBdev->Size() >> SECTOR_SHIFT;
+    AlignedBuffer<char> buf(SECTOR_SIZE, 256 * SECTOR_SIZE);
+    std::shared_ptr<blksnap::CSnapshot> ptrSnapshot;
+    std::shared_ptr<CBlockDevice> ptrImage;
+    unsigned int takes = 0;
+
+    logger.Info("-- Check the model with the device " + device + ", seed " + std::to_string(seed));
+    memset(buf.Data(), 0, buf.Size());
+
+    blksnap::CTracker tracker(device);
+    tracker.Attach();
+
+    CCbtMapModel model(capacity, params);
+    unsigned int generation = model.Generation();
+    uuid_t generationId;
+    {
+        struct blksnap_cbtinfo info;
+
+        tracker.CbtInfo(info);
+        uuid_copy(generationId, info.generation_id.b);
+    }
+    compareWithModel(tracker, model, generationId, generation, "attach");
+
+    try
+    {
+        for (unsigned int iteration = 0; iteration < iterations; iteration++)
+        {
+            const unsigned int op = rnd() % 100;
+            const sector_t count = 1 + rnd() % 256;
+            const sector_t sector = rnd() % (capacity - count + 1);
+            std::string step = std::to_string(iteration) + " ";
+
+            if (op < 40)
+            {
+                step += "write " + std::to_string(sector) + ":" + std::to_string(count);
+                ptrBdev->Write(buf.Data(), count << SECTOR_SHIFT, sector << SECTOR_SHIFT);
+                model.Set(sector, count);
+            }
+            else if ((op < 55) && ptrImage)
+            {
+                step += "write image " + std::to_string(sector) + ":" + std::to_string(count);
+                ptrImage->Write(buf.Data(), count << SECTOR_SHIFT, sector << SECTOR_SHIFT);
+                model.SetBoth(sector, count);
+            }
+            else if (op < 70)
+            {
+                /*
+                 * Several separate ranges are marked at once to check that
+                 * none of them is lost.
+                 */
+                std::vector<struct blksnap_sectors> ranges = {{sector, count}};
+                const unsigned int rangeCount = 1 + rnd() % 4;
+
+                while (ranges.size() < rangeCount)
+                {
+                    const sector_t rangeSize = 1 + rnd() % 256;
+
+                    ranges.push_back({rnd() % (capacity - rangeSize + 1), rangeSize});
+                }
+
+                step += "dirty";
+                for (const auto& range : ranges)
+                    step += " " + std::to_string(range.offset) + ":" + std::to_string(range.count);
+                tracker.MarkDirtyBlock(ranges);
+                for (const auto& range : ranges)
+                    model.SetBoth(range.offset, range.count);
+            }
+            else if (op < 72)
+            {
+                std::vector<struct blksnap_sectors> ranges = {{capacity - 1, count + (1ULL << model.BlockSizeShift())}};
+                bool isFailed = false;
+
+                step += "dirty beyond the end";
+                try
+                {
+                    tracker.MarkDirtyBlock(ranges);
+                }
+                catch (std::system_error&)
+                {
+                    isFailed = true;
+                }
+                if (isFailed != !!model.SetBoth(ranges[0].offset, ranges[0].count))
+                    throw std::runtime_error(step + ": the result differs from the model");
+            }
+            else if ((op < 80) && ptrSnapshot)
+            {
+                step += "release";
+                ptrImage.reset();
+                ptrSnapshot->Destroy();
+                ptrSnapshot.reset();
+            }
+            else
+            {
+                step += "take " + std::to_string(++takes);
+                ptrImage.reset();
+                if (ptrSnapshot)
+                    ptrSnapshot->Destroy();
+                ptrSnapshot = blksnap::CSnapshot::Create(diffStorage, deviceSize + (64ULL << 20));
+                tracker.SnapshotAdd(ptrSnapshot->Id().Get());
+                ptrSnapshot->Take();
+                model.Take(capacity);
+                ptrImage = std::make_shared<CBlockDevice>(blksnap::ICbt::Create(device)->GetImage());
+            }
+
+            logger.Detail(step);
+            compareWithModel(tracker, model, generationId, generation, step);
+        }
+    }
+    catch (...)
+    {
+        ptrImage.reset();
+        if (ptrSnapshot)
+            ptrSnapshot->Destroy();
+        tracker.Detach();
+        throw;
+    }
+
+    ptrImage.reset();
+    if (ptrSnapshot)
+        ptrSnapshot->Destroy();
+    tracker.Detach();
+    logger.Info(std::to_string(iterations) + " operations and " + std::to_string(takes)
+                + " snapshots match the model, " + std::to_string(model.Generation()) + " generations");
+}
+
+/*
+ * The alternative implementation of the map for the microbenchmarks.
+ * isUnconditional - the blocks are set by memset(), without comparing with
+ * the current value. It's possible since the values in the map never
+ * exceed the number that is set.
+ * isDirtyPages - the pages of the map that were changed since the previous
+ * switch are tracked, and only they are copied to the read map.
+ */
+template <bool isUnconditional, bool isDirtyPages>
+class CStrategyMap
+{
+public:
+    static const unsigned int pageShift = 12;
+
+    CStrategyMap(const sector_t capacity, const SCbtMapParams& params)
+        : m_snapNumberActive(1)
+        , m_snapNumberPrevious(0)
+    {
+        CCbtMapModel::CalculateBlockSize(capacity, params, m_blockSizeShift, m_blockCount);
+        m_readMap.assign(m_blockCount, 0);
+        m_writeMap.assign(m_blockCount, 0);
+        m_dirtyPages.assign((m_blockCount >> pageShift) + 1, false);
+    };
+
+    int Set(const sector_t sector, const sector_t count)
+    {
+        return SetMap(sector, count, m_snapNumberActive, m_writeMap);
+    };
+
+    int SetBoth(const sector_t sector, const sector_t count)
+    {
+        int ret = SetMap(sector, count, m_snapNumberActive, m_writeMap);
+
+        if (!ret)
+            ret = SetMap(sector, count, m_snapNumberPrevious, m_readMap);
+        return ret;
+    };
+
+    void Switch()
+    {
+        m_snapNumberPrevious = m_snapNumberActive;
+        m_snapNumberActive++;
+        if (m_snapNumberActive == 256)
+        {
+            m_snapNumberActive = 1;
+            memset(m_writeMap.data(), 0, m_writeMap.size());
+            if (isDirtyPages)
+                std::fill(m_dirtyPages.begin(), m_dirtyPages.end(), true);
+            return;
+        }
+
+        if (!isDirtyPages)
+        {
+            memcpy(m_readMap.data(), m_writeMap.data(), m_blockCount);
+            return;
+        }
+
+        for (size_t page = 0; page < m_dirtyPages.size(); page++)
+        {
+            if (!m_dirtyPages[page])
+                continue;
+
+            const size_t offset = page << pageShift;
+            memcpy(m_readMap.data() + offset, m_writeMap.data() + offset,
+                   std::min<size_t>(1ULL << pageShift, m_blockCount - offset));
+            m_dirtyPages[page] = false;
+        }
+    };
+
+    const std::vector<uint8_t>& ReadMap() const
+    {
+        return m_readMap;
+    };
+    const std::vector<uint8_t>& WriteMap() const
+    {
+        return m_writeMap;
+    };
+    unsigned int BlockSizeShift() const
+    {
+        return m_blockSizeShift;
+    };
+    unsigned long long BlockCount() const
+    {
+        return m_blockCount;
+    };
+
+private:
+    int SetMap(const sector_t sector, const sector_t count, const uint8_t snapNumber, std::vector<uint8_t>& map)
+    {
+        const unsigned int shift = m_blockSizeShift - SECTOR_SHIFT;
+        const size_t first = sector >> shift;
+        size_t last = (sector + count - 1) >> shift;
+        int ret = 0;
+
+        if (last >= m_blockCount)
+        {
+            last = m_blockCount - 1;
+            ret = -EINVAL;
+        }
+        if (first > last)
+            return ret;
+
+        if (isUnconditional)
+            memset(map.data() + first, snapNumber, last - first + 1);
+        else
+        {
+            for (size_t inx = first; inx <= last; inx++)
+                if (map[inx] < snapNumber)
+                    map[inx] = snapNumber;
+        }
+
+        if (isDirtyPages)
+            for (size_t page = first >> pageShift; page <= (last >> pageShift); page++)
+                m_dirtyPages[page] = true;
+        return ret;
+    };
+
+private:
+    unsigned int m_blockSizeShift;
+    unsigned long long m_blockCount;
+    unsigned int m_snapNumberActive;
+    unsigned int m_snapNumberPrevious;
+    std::vector<uint8_t> m_readMap;
+    std::vector<uint8_t> m_writeMap;
+    std::vector<bool> m_dirtyPages;
+};
+
+/*
+ * Before measuring, the strategy is checked against the model with the
+ * random operations.
+ */
+template <class TMap>
+static void verifyStrategy(const std::string& name, const sector_t capacity, const SCbtMapParams& params,
+                           const unsigned int seed)
+{
+    std::mt19937_64 rnd(seed);
+    CCbtMapModel model(capacity, params);
+    TMap map(capacity, params);
+
+    for (unsigned int iteration = 0; iteration < 100000; iteration++)
+    {
+        const unsigned int op = rnd() % 100;
+        const sector_t count = 1 + rnd() % 4096;
+        const sector_t sector = rnd() % (capacity - std::min(count, capacity) + 1);
+
+        if (op < 60)
+        {
+            model.Set(sector, count);
+            map.Set(sector, count);
+        }
+        else if (op < 90)
+        {
+            model.SetBoth(sector, count);
+            map.SetBoth(sector, count);
+        }
+        else
+        {
+            model.Switch();
+            map.Switch();
+        }
+
+        if ((op >= 90) || !(iteration % 1000))
+        {
+            if ((model.ReadMap() != map.ReadMap()) || (model.WriteMap() != map.WriteMap()))
+                throw std::runtime_error("The strategy '" + name + "' differs from the model at the operation "
+                                         + std::to_string(iteration));
+        }
+    }
+}
+
+template <class TMap>
+static void benchStrategy(const std::string& name, const sector_t capacity, const SCbtMapParams& params,
+                          const unsigned int operations, const unsigned int seed, CTestResult& result)
+{
+    std::mt19937_64 rnd(seed);
+    TMap map(capacity, params);
+    const sector_t blockSectors = 1ULL << (map.BlockSizeShift() - SECTOR_SHIFT);
+    std::vector<sector_t> sectors(operations);
+
+    for (sector_t& sector : sectors)
+        sector = rnd() % (capacity - 8);
+    auto start = clock_type::now();
+    for (sector_t sector : sectors)
+        map.Set(sector, 8);
+    const double randomSetNs = std::chrono::duration<double, std::nano>(clock_type::now() - start).count() / operations;
+
+    sector_t sector = 0;
+    start = clock_type::now();
+    for (unsigned int inx = 0; inx < operations; inx++)
+    {
+        map.Set(sector, 2048);
+        sector = (sector + 2048) % (capacity - 2048);
+    }
+    const double sequentialSetNs =
+      std::chrono::duration<double, std::nano>(clock_type::now() - start).count() / operations;
+
+    /*
+     * One block of a thousand is changed before each switch.
+     */
+    const unsigned int switches = 16;
+    map.Switch();
+    double elapsed = 0;
+    for (unsigned int inx = 0; inx < switches; inx++)
+    {
+        for (unsigned long long block = 0; block < map.BlockCount() / 1000; block++)
+            map.Set((rnd() % map.BlockCount()) * blockSectors, 1);
+
+        start = clock_type::now();
+        map.Switch();
+        elapsed += std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+    }
+    const double switchSparseUs = elapsed / switches;
+
+    elapsed = 0;
+    for (unsigned int inx = 0; inx < switches; inx++)
+    {
+        map.Set(0, capacity);
+
+        start = clock_type::now();
+        map.Switch();
+        elapsed += std::chrono::duration<double, std::micro>(clock_type::now() - start).count();
+    }
+    const double switchFullUs = elapsed / switches;
+
+    result.Set("strategy", name)
+      .Set("block_count", map.BlockCount())
+      .Set("random_set_ns", randomSetNs)
+      .Set("sequential_set_ns", sequentialSetNs)
+      .Set("switch_sparse_us", switchSparseUs)
+      .Set("switch_full_us", switchFullUs);
+
+    std::stringstream ss;
+    ss << name << " blocks=" << map.BlockCount() << ": random set " << randomSetNs << " ns, sequential set "
+       << sequentialSetNs << " ns, sparse switch " << switchSparseUs << " us, full switch " << switchFullUs << " us";
+    logger.Info(ss);
+}
+
+template <class TMap>
+static void runStrategy(const std::string& name, const sector_t capacity, const SCbtMapParams& params,
+                        const unsigned int operations, const unsigned int seed, CTestReport& report)
+{
+    verifyStrategy<TMap>(name, std::min<sector_t>(capacity, 1ULL << 24), params, seed);
+    benchStrategy<TMap>(name, capacity, params, operations, seed, report.AddResult());
+}
+
+void BenchmarkStrategies(const SCbtMapParams& params, const unsigned int operations, const unsigned int seed,
+                         const std::string& jsonFile)
+{
+    CTestReport report("cbt_benchmark");
+
+    logger.Info("--- Benchmark: CBT map strategies ---");
+    report.SetParameter("operations", std::to_string(operations));
+    report.SetParameter("seed", std::to_string(seed));
+    for (unsigned long long size : {4ULL << 30, 128ULL << 30, 16ULL << 40})
+    {
+        const sector_t capacity = size >> SECTOR_SHIFT;
+
+        runStrategy<CStrategyMap<false, false>>("reference", capacity, params, operations, seed, report);
+        runStrategy<CStrategyMap<true, false>>("memset", capacity, params, operations, seed, report);
+        runStrategy<CStrategyMap<false, true>>("dirty_pages", capacity, params, operations, seed, report);
+        runStrategy<CStrategyMap<true, true>>("memset_dirty_pages", capacity, params, operations, seed, report);
+    }
+
+    report.Save(jsonFile);
+    logger.Info("--- Success: CBT map strategies ---");
+}
 
 void Main(int argc, char* argv[])
 {
-    std::runtime_error("It's not implemented yet.");
+    po::options_description desc;
+    std::string usage = std::string("Checking the change tracking map of the module against the userspace model.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("loop_dir,o", po::value<std::string>(),
+            "Directory name for the images of the loop devices.")
+        ("diff_storage,s", po::value<std::string>(),
+            "Directory name for allocating diff storage files.")
+        ("size,z", po::value<unsigned int>()->default_value(256), "The size of the loop device in MiB.")
+        ("check_size,c", po::value<std::vector<unsigned long long>>()->multitoken(),
+            "The sizes of the sparse loop devices in bytes for checking the block size. By default, 1 MiB, 257 MiB + 512, 128 GiB, 128 GiB + 512, 1 TiB and 100 TiB are checked.")
+        ("iterations,i", po::value<unsigned int>()->default_value(3000), "The number of random operations.")
+        ("seed", po::value<unsigned int>(), "The seed of the random operations. By default, it's random.")
+        ("benchmark,b", "Measure the alternative implementations of the map in userspace, the module is not used.")
+        ("json,j", po::value<std::string>(), "The file for the benchmark results in JSON format. By default, the results are written to the log.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    unsigned int seed = vm.count("seed") ? vm["seed"].as<unsigned int>() : std::random_device()();
+    unsigned int iterations = vm["iterations"].as<unsigned int>();
+
+    if (vm.count("benchmark"))
+    {
+        std::string jsonFile;
+        if (vm.count("json"))
+            jsonFile = vm["json"].as<std::string>();
+
+        BenchmarkStrategies(SCbtMapParams(), 1000000, seed, jsonFile);
+        return;
+    }
+
+    if (!vm.count("loop_dir"))
+        throw std::invalid_argument("Argument 'loop_dir' is missed.");
+    std::string loopDir = vm["loop_dir"].as<std::string>();
+
+    if (!vm.count("diff_storage"))
+        throw std::invalid_argument("Argument 'diff_storage' is missed.");
+    std::string diffStorage = vm["diff_storage"].as<std::string>();
+
+    unsigned long long deviceSize = static_cast<unsigned long long>(vm["size"].as<unsigned int>()) << 20;
+    if (!deviceSize)
+        throw std::invalid_argument("Argument 'size' cannot be zero.");
+
+    std::vector<unsigned long long> checkSizes = defaultBlockSizeCheckSizes;
+    if (vm.count("check_size"))
+    {
+        checkSizes = vm["check_size"].as<std::vector<unsigned long long>>();
+        for (unsigned long long size : checkSizes)
+            if (size & (SECTOR_SIZE - 1))
+                throw std::invalid_argument("Argument 'check_size' should be a multiple of the sector size.");
+    }
+
+    SCbtMapParams params = SCbtMapParams::FromModule();
+
+    logger.Info("--- Test: check CBT map ---");
+    logger.Info("tracking block minimum shift: " + std::to_string(params.minimumShift));
+    logger.Info("tracking block maximum shift: " + std::to_string(params.maximumShift));
+    logger.Info("tracking block maximum count: " + std::to_string(params.maximumCount));
+
+    CheckBlockSize(loopDir, params, checkSizes);
+    CheckModel(loopDir, diffStorage, params, deviceSize, iterations, seed);
+
+    logger.Info("--- Success: check CBT map ---");
 }
 
 int main(int argc, char* argv[])
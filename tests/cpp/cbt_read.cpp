@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <blksnap/Tracker.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
+#include "helpers/LoopDevice.h"
+#include "helpers/RandomHelper.h"
+#include "helpers/TestReport.h"
+
+namespace po = boost::program_options;
+using clock_type = std::chrono::steady_clock;
+
+/*
+ * Writes the blocks to the random offsets at the beginning of the device,
+ * so the sparse image does not grow too much. The latencies are collected
+ * by the device.
+ */
+class CWriter
+{
+public:
+    CWriter(const std::shared_ptr<CBlockDevice>& ptrDevice, const off_t regionSize)
+        : m_ptrDevice(ptrDevice)
+        , m_regionSize(regionSize)
+        , m_isStop(false)
+    {};
+
+    void Start()
+    {
+        m_isStop = false;
+        m_thread = std::thread(&CWriter::Worker, this);
+    };
+
+    void Stop()
+    {
+        m_isStop = true;
+        if (m_thread.joinable())
+            m_thread.join();
+        if (m_error)
+            std::rethrow_exception(m_error);
+    };
+
+private:
+    void Worker()
+    {
+        try
+        {
+            const size_t blockSize = 4096;
+            const off_t blockCount = std::min(m_regionSize, m_ptrDevice->Size()) / blockSize;
+            AlignedBuffer<char> buf(blockSize);
+            std::mt19937_64 rnd(std::rand());
+
+            CRandomHelper::GenerateBuffer(buf.Data(), blockSize);
+            while (!m_isStop)
+                m_ptrDevice->Write(buf.Data(), blockSize, (rnd() % blockCount) * blockSize);
+        }
+        catch (...)
+        {
+            m_error = std::current_exception();
+        }
+    };
+
+private:
+    std::shared_ptr<CBlockDevice> m_ptrDevice;
+    off_t m_regionSize;
+    std::atomic<bool> m_isStop;
+    std::thread m_thread;
+    std::exception_ptr m_error;
+};
+
+/*
+ * Marks the part of the blocks of the map as changed. The blocks are marked
+ * by one range per call.
+ */
+static void MarkDirty(blksnap::CTracker& tracker, const struct blksnap_cbtinfo& info, const unsigned int percent)
+{
+    const unsigned int blockSect = info.block_size >> SECTOR_SHIFT;
+    std::mt19937_64 rnd(std::rand());
+    std::vector<struct blksnap_sectors> range(1);
+    unsigned int count = 0;
+
+    for (unsigned int block = 0; block < info.block_count; block++)
+    {
+        if ((rnd() % 100) >= percent)
+            continue;
+
+        range[0].offset = static_cast<__u64>(block) * blockSect;
+        range[0].count = blockSect;
+        tracker.MarkDirtyBlock(range);
+        count++;
+    }
+    logger.Info("marked blocks: " + std::to_string(count));
+}
+
+static void ReadMap(blksnap::CTracker& tracker, const struct blksnap_cbtinfo& info, const unsigned int window,
+                    const unsigned int durationMs, std::vector<std::shared_ptr<CWriter>>& writers,
+                    CTestResult& result)
+{
+    const unsigned int length = window ? std::min(window, info.block_count) : info.block_count;
+    std::vector<uint8_t> map(length);
+    CLatencyHistogram& callLatency = result.Latency("call");
+    unsigned int mapReads = 0;
+
+    for (auto& writer : writers)
+        writer->Start();
+
+    const auto start = clock_type::now();
+    const auto deadline = start + std::chrono::milliseconds(durationMs);
+    do
+    {
+        for (unsigned int offset = 0; offset < info.block_count; offset += length)
+        {
+            const auto callStart = clock_type::now();
+            tracker.ReadCbtMap(offset, std::min(length, info.block_count - offset), map.data());
+            callLatency.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - callStart).count());
+        }
+        mapReads++;
+    } while (clock_type::now() < deadline);
+    const double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    for (auto& writer : writers)
+        writer->Stop();
+
+    const double mapReadUs = seconds * 1000000 / mapReads;
+    result.Set("window", length)
+      .Set("map_reads", mapReads)
+      .Set("map_read_us", mapReadUs)
+      .Set("blocks_per_sec", info.block_count / seconds * mapReads);
+
+    std::stringstream ss;
+    ss << "window=" << length << " writers=" << writers.size() << ": map read " << mapReadUs << " us, call p50 "
+       << (callLatency.Percentile(50) / 1000.0) << " us, p99 " << (callLatency.Percentile(99) / 1000.0) << " us";
+    logger.Info(ss);
+}
+
+void CheckCbtRead(const std::string& loopDir, const std::vector<unsigned long long>& sizes,
+                  const unsigned int dirtyPercent, const std::vector<unsigned int>& windows,
+                  const std::vector<unsigned int>& writerCounts, const unsigned int durationMs,
+                  const std::string& jsonFile)
+{
+    CTestReport report("cbt_read");
+
+    logger.Info("--- Test: check CBT read ---");
+    logger.Info("loopDir: " + loopDir);
+    report.SetParameter("dirty_percent", std::to_string(dirtyPercent));
+    report.SetParameter("duration_ms", std::to_string(durationMs));
+
+    for (unsigned long long size : sizes)
+    {
+        auto loop = LoopDevice::Create(loopDir, size, true);
+        const std::string device = loop->GetDevice().string();
+        blksnap::CTracker tracker(device);
+        struct blksnap_cbtinfo info;
+
+        logger.Info("-- device " + device + " size " + std::to_string(size));
+        tracker.Attach();
+        try
+        {
+            tracker.CbtInfo(info);
+            logger.Info("block size: " + std::to_string(info.block_size) + " block count: "
+                        + std::to_string(info.block_count));
+            MarkDirty(tracker, info, dirtyPercent);
+
+            auto ptrDevice = std::make_shared<CBlockDevice>(device);
+            for (unsigned int writerCount : writerCounts)
+            {
+                std::vector<std::shared_ptr<CWriter>> writers;
+                for (unsigned int inx = 0; inx < writerCount; inx++)
+                    writers.push_back(std::make_shared<CWriter>(ptrDevice, 1LL << 30));
+
+                /*
+                 * The latency of the writes without reading the map.
+                 */
+                if (writerCount)
+                {
+                    CTestResult& result = report.AddResult();
+
+                    result.Set("device_size", size).Set("block_count", info.block_count).Set("writers", writerCount);
+                    CTestReport::Measure(result.Io(), *ptrDevice, [&]() {
+                        for (auto& writer : writers)
+                            writer->Start();
+                        std::this_thread::sleep_for(std::chrono::milliseconds(durationMs));
+                        for (auto& writer : writers)
+                            writer->Stop();
+                    });
+                    logger.Info("writers=" + std::to_string(writerCount) + " without map reads: "
+                                + result.Io()->ToString());
+                }
+
+                for (unsigned int window : windows)
+                {
+                    CTestResult& result = report.AddResult();
+
+                    result.Set("device_size", size).Set("block_count", info.block_count).Set("writers", writerCount);
+                    CTestReport::Measure(result.Io(), *ptrDevice, [&]() {
+                        ReadMap(tracker, info, window, durationMs, writers, result);
+                    });
+                    if (writerCount)
+                        logger.Info("writes: " + result.Io()->ToString());
+                }
+            }
+        }
+        catch (...)
+        {
+            tracker.Detach();
+            throw;
+        }
+        tracker.Detach();
+    }
+
+    report.Save(jsonFile);
+
+    logger.Info("--- Success: check CBT read ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the performance of reading the change tracking map.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("loop_dir,o", po::value<std::string>(),
+            "Directory name for the sparse images of the loop devices.")
+        ("size,z", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The sizes of the loop devices in GiB. By default, 1, 1024 and 102400 are tested.")
+        ("dirty,p", po::value<unsigned int>()->default_value(10), "The percent of the blocks marked as changed.")
+        ("window,w", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The numbers of blocks read at once. Zero means the whole map. By default, 4096, 32768, 262144, 1048576 and 0 are tested.")
+        ("writers,W", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The numbers of threads writing to the device while the map is read. By default, 0 and 4 are tested.")
+        ("duration,t", po::value<unsigned int>()->default_value(2000), "The duration of each test in milliseconds.")
+        ("json,j", po::value<std::string>(), "The file for the results in JSON format. By default, the results are written to the log.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    if (!vm.count("loop_dir"))
+        throw std::invalid_argument("Argument 'loop_dir' is missed.");
+    std::string loopDir = vm["loop_dir"].as<std::string>();
+
+    std::vector<unsigned long long> sizes = {1ULL << 30, 1ULL << 40, 100ULL << 40};
+    if (vm.count("size"))
+    {
+        sizes.clear();
+        for (unsigned int size : vm["size"].as<std::vector<unsigned int>>())
+        {
+            if (!size)
+                throw std::invalid_argument("Argument 'size' cannot be zero.");
+            sizes.push_back(static_cast<unsigned long long>(size) << 30);
+        }
+    }
+
+    unsigned int dirtyPercent = vm["dirty"].as<unsigned int>();
+    if (dirtyPercent > 100)
+        throw std::invalid_argument("Argument 'dirty' cannot be greater than 100.");
+
+    std::vector<unsigned int> windows = {4096, 32768, 262144, 1048576, 0};
+    if (vm.count("window"))
+        windows = vm["window"].as<std::vector<unsigned int>>();
+
+    std::vector<unsigned int> writerCounts = {0, 4};
+    if (vm.count("writers"))
+        writerCounts = vm["writers"].as<std::vector<unsigned int>>();
+
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
+    std::srand(std::time(0));
+    CheckCbtRead(loopDir, sizes, dirtyPercent, windows, writerCounts, vm["duration"].as<unsigned int>(), jsonFile);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -15,6 +15,7 @@
 #include "helpers/AlignedBuffer.hpp"
 #include "helpers/BlockDevice.h"
 #include "helpers/Log.h"
+#include "helpers/TestReport.h"
 #include "TestSector.h"
 
 namespace po = boost::program_options;
@@ -23,27 +24,22 @@ using blksnap::sector_t;
 using blksnap::SRange;
 
 int g_blksz = 512;
+unsigned int g_queueDepth = 32;
+CTestReport g_report("corrupt");
 
 /**
  * Fill the contents of the block device with special test data.
  */
 void FillAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared_ptr<CBlockDevice>& ptrBdev)
 {
-    AlignedBuffer<unsigned char> portion(g_blksz, 1024 * 1024);
-    off_t sizeBdev = ptrBdev->Size();
-    sector_t sector = 0;
-
     logger.Info("device [" + ptrBdev->Name() + "] size " + std::to_string(ptrBdev->Size()) + " bytes");
-    for (off_t offset = 0; offset < sizeBdev; offset += portion.Size())
-    {
-        size_t portionSize = std::min(portion.Size(), static_cast<size_t>(sizeBdev - offset));
-
-        ptrGen->Generate(portion.Data(), portionSize, sector);
 
-        ptrBdev->Write(portion.Data(), portionSize, offset);
-
-        sector += (portionSize >> SECTOR_SHIFT);
-    }
+    ptrBdev->SetQueueDepth(g_queueDepth);
+    g_report.Measure("fill", *ptrBdev, [&]() {
+        ptrBdev->WriteRange(0, ptrBdev->Size(), 1024 * 1024, [&ptrGen](unsigned char* buf, size_t count, off_t offset) {
+            ptrGen->Generate(buf, count, offset >> SECTOR_SHIFT);
+        });
+    });
 }
 
 /**
@@ -52,24 +48,17 @@ void FillAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared
 void CheckAll(const std::shared_ptr<CTestSectorGenetor> ptrGen, const std::shared_ptr<CBlockDevice>& ptrBdev,
               const int seqNumber, const clock_t seqTime)
 {
-    AlignedBuffer<unsigned char> portion(g_blksz, 1024 * 1024);
-    off_t sizeBdev = ptrBdev->Size();
-    sector_t sector = 0;
-
     logger.Info("Check on image [" + ptrBdev->Name() + "]");
 
     ::sync();
 
-    for (off_t offset = 0; offset < sizeBdev; offset += portion.Size())
-    {
-        size_t portionSize = std::min(portion.Size(), static_cast<size_t>(sizeBdev - offset));
-
-        ptrBdev->Read(portion.Data(), portionSize, offset);
-
-        ptrGen->Check(portion.Data(), portionSize, sector, seqNumber, seqTime);
-
-        sector += (portionSize >> SECTOR_SHIFT);
-    }
+    ptrBdev->SetQueueDepth(g_queueDepth);
+    g_report.Measure("check", *ptrBdev, [&]() {
+        ptrBdev->ReadRange(0, ptrBdev->Size(), 1024 * 1024,
+                           [&ptrGen, seqNumber, seqTime](unsigned char* buf, size_t count, off_t offset) {
+                               ptrGen->Check(buf, count, offset >> SECTOR_SHIFT, seqNumber, seqTime);
+                           });
+    });
 }
 
 void FillBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen, const std::shared_ptr<CBlockDevice>& ptrBdev,
@@ -78,7 +67,7 @@ void FillBlocks(const std::shared_ptr<CTestSectorGenetor>& ptrGen, const std::sh
     AlignedBuffer<unsigned char> portion(g_blksz, size);
 
     ptrGen->Generate(portion.Data(), size, offset >> SECTOR_SHIFT);
-    ptrBdev->Write(portion.Data(), size, offset);
+    g_report.Measure("write", *ptrBdev, [&]() { ptrBdev->Write(portion.Data(), size, offset); });
 }
 
 /**
@@ -826,7 +815,11 @@ void Main(int argc, char* argv[])
         ("duration,u", po::value<int>()->default_value(5), "The test duration limit in minutes.")
         ("sync", "Use O_SYNC for access to original device.")
         ("blksz", po::value<int>()->default_value(512), "Align reads and writes to the block size.")
+        ("queue_depth,q", po::value<unsigned int>()->default_value(32),
+            "The number of asynchronous requests in flight when the whole device is filled or checked.")
         ("blocks", po::value<int>()->default_value(4096), "The maximum limit of writing blocks.")
+        ("json,j", po::value<std::string>(),
+            "The file for the I/O statistics and the results in JSON format. By default, they are written to the log.")
         ;
     po::variables_map vm;
     po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
@@ -885,25 +878,55 @@ void Main(int argc, char* argv[])
     g_blksz = vm["blksz"].as<int>();
     logger.Info("blksz: " + std::to_string(g_blksz));
 
+    g_queueDepth = vm["queue_depth"].as<unsigned int>();
+    if (!g_queueDepth)
+        throw std::invalid_argument("Argument 'queue_depth' cannot be zero.");
+    logger.Info("queue_depth: " + std::to_string(g_queueDepth));
+
     int blocksCountMax = vm["blocks"].as<int>();
     logger.Info("blocks: " + std::to_string(blocksCountMax));
 
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
+    std::string devices;
+    for (const std::string& dev : origDevNames)
+        devices += (devices.empty() ? "" : " ") + dev;
+    g_report.SetParameter("device", devices);
+    g_report.SetParameter("mode", vm.count("multithread") ? "multithread" : (vm.count("simple") ? "simple" : "singlethread"));
+    g_report.SetParameter("diff_storage_limit", std::to_string(diffStorageLimit));
+    g_report.SetParameter("duration", std::to_string(duration));
+    g_report.SetParameter("sync", std::to_string(isSync));
+    g_report.SetParameter("blksz", std::to_string(g_blksz));
+    g_report.SetParameter("queue_depth", std::to_string(g_queueDepth));
+    g_report.SetParameter("blocks", std::to_string(blocksCountMax));
+
     std::srand(std::time(0));
-    if (!!vm.count("multithread"))
-        MultithreadCheckCorruption(origDevNames, diffStorage,
-                                   diffStorageLimit, duration * 60);
-    else {
-        if (origDevNames.size() > 1)
-            logger.Err("In singlethread test mode used only first device.");
-
-        if (!!vm.count("simple"))
-            SimpleCorruption(origDevNames[0], diffStorage, diffStorageLimit,
-                            isSync);
-        else
-            CheckCorruption(origDevNames[0], diffStorage, diffStorageLimit,
-                            duration * 60, isSync, blocksCountMax);
+    try
+    {
+        if (!!vm.count("multithread"))
+            MultithreadCheckCorruption(origDevNames, diffStorage,
+                                       diffStorageLimit, duration * 60);
+        else {
+            if (origDevNames.size() > 1)
+                logger.Err("In singlethread test mode used only first device.");
+
+            if (!!vm.count("simple"))
+                SimpleCorruption(origDevNames[0], diffStorage, diffStorageLimit,
+                                isSync);
+            else
+                CheckCorruption(origDevNames[0], diffStorage, diffStorageLimit,
+                                duration * 60, isSync, blocksCountMax);
 
+        }
+    }
+    catch (std::exception& ex)
+    {
+        g_report.Save(jsonFile, ex.what());
+        throw;
     }
+    g_report.Save(jsonFile);
 }
 
 int main(int argc, char* argv[])
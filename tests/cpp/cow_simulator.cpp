@@ -0,0 +1,446 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <blksnap/Sector.h>
+#include <boost/program_options.hpp>
+#include <stdint.h>
+
+#include "helpers/Log.h"
+#include "helpers/TestReport.h"
+#include "CbtMapModel.h"
+#include "TraceFile.h"
+
+namespace po = boost::program_options;
+using blksnap::sector_t;
+
+/*
+ * The parameters of the kernel module that affect the copy-on-write. The
+ * default values are the same as in the module.
+ */
+struct SCowParams
+{
+    unsigned int chunkMinimumShift = 18;
+    unsigned int chunkMaximumCountShift = 40;
+    unsigned int chunkMaximumShift = 26;
+    unsigned int chunkMaximumInQueue = 16;
+    unsigned int freeDiffBufferPoolSize = 128;
+    sector_t diffStorageMinimum = 2097152;
+    SCbtMapParams cbt;
+};
+
+/*
+ * The counters of the simulation for one set of the parameters.
+ */
+struct SCowCounters
+{
+    SCowParams params;
+    bool isValid;
+    unsigned int chunkShift;
+    unsigned long long chunkCount;
+    unsigned int trackingBlockShift;
+    unsigned long long trackingBlockCount;
+    unsigned int snapshotCount;
+    unsigned long long writtenBytes;
+    unsigned long long chunksStored;
+    unsigned long long cowReadBytes;
+    unsigned long long diffStorageBytes;
+    unsigned long long diffStorageMaxBytes;
+    unsigned long long diffStorageFileMaxBytes;
+    unsigned long long bufferAllocations;
+    unsigned long long bufferPeakBytes;
+    unsigned long long cbtIncrementBytes;
+    unsigned long long cbtIncrementMaxBytes;
+};
+
+/*
+ * The same calculation as in diff_area_calculate_chunk_size(). The module
+ * refuses to create the snapshot if the chunk size exceeds the maximum.
+ */
+static bool calculateChunkSize(const sector_t capacity, const sector_t minIoSect, const SCowParams& params,
+                               unsigned int& chunkShift, unsigned long long& chunkCount)
+{
+    const unsigned long long maximumCount =
+      (params.chunkMaximumCountShift < 64) ? (1ULL << params.chunkMaximumCountShift) : ~0ULL;
+    auto countByShift = [capacity](const unsigned int shift) {
+        const sector_t blockSize = 1ULL << (shift - SECTOR_SHIFT);
+
+        return (capacity + blockSize - 1) / blockSize;
+    };
+
+    chunkShift = params.chunkMinimumShift;
+    chunkCount = countByShift(chunkShift);
+    while ((chunkCount > maximumCount) || ((1ULL << (chunkShift - SECTOR_SHIFT)) < minIoSect))
+    {
+        chunkShift++;
+        chunkCount = countByShift(chunkShift);
+    }
+
+    return chunkShift <= params.chunkMaximumShift;
+}
+
+/*
+ * The model of the difference area of one snapshot. The first write to the
+ * chunk reads the chunk from the original device into the diff buffer and
+ * puts the chunk to the store queue. When the queue is longer than
+ * chunk_maximum_in_queue, the worker stores all chunks of the queue to the
+ * difference storage and releases the buffers to the pool of free buffers,
+ * which keeps at most free_diff_buffer_pool_size buffers.
+ */
+class CDiffAreaModel
+{
+public:
+    CDiffAreaModel(const sector_t capacity, const unsigned int chunkShift, const unsigned long long chunkCount,
+                   const SCowParams& params, SCowCounters& result)
+        : m_capacity(capacity)
+        , m_chunkSectors(1ULL << (chunkShift - SECTOR_SHIFT))
+        , m_params(params)
+        , m_result(result)
+        , m_chunks(chunkCount, false)
+        , m_inQueue(0)
+        , m_freeBuffers(0)
+        , m_storedSectors(0)
+    {};
+
+    ~CDiffAreaModel()
+    {
+        const unsigned long long storedBytes = m_storedSectors << SECTOR_SHIFT;
+        const sector_t portion = std::max<sector_t>(m_params.diffStorageMinimum, 1);
+        const sector_t fileSectors = (m_storedSectors + portion - 1) / portion * portion;
+
+        m_result.diffStorageBytes += storedBytes;
+        m_result.diffStorageMaxBytes = std::max(m_result.diffStorageMaxBytes, storedBytes);
+        m_result.diffStorageFileMaxBytes =
+          std::max(m_result.diffStorageFileMaxBytes, static_cast<unsigned long long>(fileSectors) << SECTOR_SHIFT);
+    };
+
+    void Write(const sector_t sector, const sector_t count)
+    {
+        const sector_t last = (sector + count - 1) / m_chunkSectors;
+
+        for (sector_t number = sector / m_chunkSectors; number <= last; number++)
+        {
+            if (m_chunks[number])
+                continue;
+            m_chunks[number] = true;
+            Copy(number);
+        }
+    };
+
+private:
+    void Copy(const sector_t number)
+    {
+        const sector_t start = number * m_chunkSectors;
+
+        if (m_freeBuffers)
+            m_freeBuffers--;
+        else
+            m_result.bufferAllocations++;
+        m_inQueue++;
+        m_result.bufferPeakBytes = std::max(m_result.bufferPeakBytes,
+                                            (m_inQueue + m_freeBuffers) * (m_chunkSectors << SECTOR_SHIFT));
+
+        m_result.chunksStored++;
+        m_result.cowReadBytes += std::min(m_chunkSectors, m_capacity - start) << SECTOR_SHIFT;
+        m_storedSectors += m_chunkSectors;
+
+        if (m_inQueue <= m_params.chunkMaximumInQueue)
+            return;
+        for (; m_inQueue; m_inQueue--)
+        {
+            if (m_freeBuffers <= m_params.freeDiffBufferPoolSize)
+                m_freeBuffers++;
+        }
+    };
+
+private:
+    sector_t m_capacity;
+    sector_t m_chunkSectors;
+    const SCowParams& m_params;
+    SCowCounters& m_result;
+    std::vector<bool> m_chunks;
+    unsigned long long m_inQueue;
+    unsigned long long m_freeBuffers;
+    sector_t m_storedSectors;
+};
+
+static SCowCounters simulate(const std::vector<STraceRecord>& records, const sector_t capacity, const sector_t minIoSect,
+                        const uint64_t intervalNs, const SCowParams& params)
+{
+    SCowCounters result = {};
+
+    result.params = params;
+    result.isValid = calculateChunkSize(capacity, minIoSect, params, result.chunkShift, result.chunkCount);
+    CCbtMapModel::CalculateBlockSize(capacity, params.cbt, result.trackingBlockShift, result.trackingBlockCount);
+    if (!result.isValid)
+        return result;
+
+    const sector_t trackingBlockSectors = 1ULL << (result.trackingBlockShift - SECTOR_SHIFT);
+    std::vector<bool> changed(result.trackingBlockCount, false);
+    unsigned long long changedCount = 0;
+    auto takeIncrement = [&]() {
+        const unsigned long long bytes = changedCount << result.trackingBlockShift;
+
+        result.cbtIncrementBytes += bytes;
+        result.cbtIncrementMaxBytes = std::max(result.cbtIncrementMaxBytes, bytes);
+        changed.assign(changed.size(), false);
+        changedCount = 0;
+    };
+
+    std::unique_ptr<CDiffAreaModel> ptrDiffArea;
+    uint64_t snapshotEndNs = 0;
+    for (const STraceRecord& record : records)
+    {
+        if (!ptrDiffArea || (intervalNs && (record.timeNs >= snapshotEndNs)))
+        {
+            if (ptrDiffArea)
+                takeIncrement();
+            ptrDiffArea.reset(new CDiffAreaModel(capacity, result.chunkShift, result.chunkCount, params, result));
+            result.snapshotCount++;
+            if (intervalNs)
+                snapshotEndNs = (record.timeNs / intervalNs + 1) * intervalNs;
+        }
+
+        /*
+         * The offsets that are beyond the end of the device are wrapped,
+         * as the test_replay does.
+         */
+        const sector_t count = std::min<sector_t>(record.count, capacity);
+        const sector_t sector = record.sector % (capacity - count + 1);
+
+        result.writtenBytes += count << SECTOR_SHIFT;
+        ptrDiffArea->Write(sector, count);
+
+        const sector_t last = (sector + count - 1) / trackingBlockSectors;
+        for (sector_t inx = sector / trackingBlockSectors; inx <= last; inx++)
+        {
+            if (changed[inx])
+                continue;
+            changed[inx] = true;
+            changedCount++;
+        }
+    }
+    ptrDiffArea.reset();
+    takeIncrement();
+
+    return result;
+}
+
+static void setResult(CTestResult& result, const SCowCounters& counters)
+{
+    const double written = counters.writtenBytes ? static_cast<double>(counters.writtenBytes) : 1.0;
+
+    result.Set("chunk_minimum_shift", counters.params.chunkMinimumShift)
+      .Set("chunk_maximum_count_shift", counters.params.chunkMaximumCountShift)
+      .Set("tracking_block_minimum_shift", counters.params.cbt.minimumShift)
+      .Set("free_diff_buffer_pool_size", counters.params.freeDiffBufferPoolSize)
+      .Set("valid", counters.isValid)
+      .Set("chunk_size", 1ULL << counters.chunkShift)
+      .Set("chunk_count", counters.chunkCount)
+      .Set("tracking_block_size", 1ULL << counters.trackingBlockShift)
+      .Set("tracking_block_count", counters.trackingBlockCount)
+      .Set("snapshots", counters.snapshotCount)
+      .Set("written_bytes", counters.writtenBytes)
+      .Set("chunks_stored", counters.chunksStored)
+      .Set("cow_read_bytes", counters.cowReadBytes)
+      .Set("diff_storage_bytes", counters.diffStorageBytes)
+      .Set("diff_storage_max_bytes", counters.diffStorageMaxBytes)
+      .Set("diff_storage_file_max_bytes", counters.diffStorageFileMaxBytes)
+      .Set("cow_read_amplification", counters.cowReadBytes / written)
+      .Set("write_amplification", (counters.writtenBytes + counters.diffStorageBytes) / written)
+      .Set("buffer_allocations", counters.bufferAllocations)
+      .Set("buffer_peak_bytes", counters.bufferPeakBytes)
+      .Set("cbt_increment_bytes", counters.cbtIncrementBytes)
+      .Set("cbt_increment_max_bytes", counters.cbtIncrementMaxBytes);
+}
+
+void SimulateCow(const std::string& traceFile, unsigned long long capacityBytes, const unsigned int minIo,
+                 const unsigned int intervalSec, const SCowParams& defaults,
+                 const std::vector<unsigned int>& chunkMinimumShifts,
+                 const std::vector<unsigned int>& chunkMaximumCountShifts,
+                 const std::vector<unsigned int>& trackingBlockMinimumShifts,
+                 const std::vector<unsigned int>& freeDiffBufferPoolSizes, const std::string& jsonFile)
+{
+    CTestReport report("cow_simulator");
+
+    logger.Info("--- Test: COW simulation ---");
+    logger.Info("trace: " + traceFile);
+
+    std::vector<STraceRecord> records = LoadTrace(traceFile);
+    if (records.empty())
+        throw std::runtime_error("The trace file '" + traceFile + "' does not contain any writes.");
+
+    if (!capacityBytes)
+    {
+        for (const STraceRecord& record : records)
+            capacityBytes = std::max<unsigned long long>(capacityBytes, (record.sector + record.count) << SECTOR_SHIFT);
+        capacityBytes = (capacityBytes + (1ULL << 20) - 1) & ~((1ULL << 20) - 1);
+    }
+    const sector_t capacity = capacityBytes >> SECTOR_SHIFT;
+
+    logger.Info("writes: " + std::to_string(records.size()));
+    logger.Info("capacity: " + std::to_string(capacityBytes) + " bytes");
+    logger.Info("snapshot interval: " + (intervalSec ? std::to_string(intervalSec) + " s" : std::string("none")));
+    report.SetParameter("trace", traceFile);
+    report.SetParameter("capacity", std::to_string(capacity << SECTOR_SHIFT));
+    report.SetParameter("writes", std::to_string(records.size()));
+
+    for (unsigned int chunkMinimumShift : chunkMinimumShifts)
+    {
+        for (unsigned int chunkMaximumCountShift : chunkMaximumCountShifts)
+        {
+            for (unsigned int trackingBlockMinimumShift : trackingBlockMinimumShifts)
+            {
+                for (unsigned int freeDiffBufferPoolSize : freeDiffBufferPoolSizes)
+                {
+                    SCowParams params = defaults;
+
+                    params.chunkMinimumShift = chunkMinimumShift;
+                    params.chunkMaximumCountShift = chunkMaximumCountShift;
+                    params.cbt.minimumShift = trackingBlockMinimumShift;
+                    params.freeDiffBufferPoolSize = freeDiffBufferPoolSize;
+
+                    SCowCounters result = simulate(records, capacity, minIo >> SECTOR_SHIFT,
+                                              static_cast<uint64_t>(intervalSec) * 1000000000ULL, params);
+                    setResult(report.AddResult(), result);
+
+                    std::stringstream ss;
+                    ss << "chunk_minimum_shift=" << chunkMinimumShift
+                       << " chunk_maximum_count_shift=" << chunkMaximumCountShift
+                       << " tracking_block_minimum_shift=" << trackingBlockMinimumShift
+                       << " free_diff_buffer_pool_size=" << freeDiffBufferPoolSize << ": ";
+                    if (!result.isValid)
+                        ss << "chunk size " << (1ULL << result.chunkShift)
+                           << " bytes exceeds the maximum, the snapshot cannot be created";
+                    else
+                    {
+                        const double written = result.writtenBytes ? static_cast<double>(result.writtenBytes) : 1.0;
+
+                        ss << "chunk " << (1ULL << result.chunkShift) << " x " << result.chunkCount << ", diff storage "
+                           << (result.diffStorageMaxBytes >> 20) << " MiB, COW read x"
+                           << (result.cowReadBytes / written) << ", write x"
+                           << ((result.writtenBytes + result.diffStorageBytes) / written) << ", buffers "
+                           << result.bufferAllocations << " allocated, peak " << (result.bufferPeakBytes >> 10)
+                           << " KiB, CBT block "
+                           << (1ULL << result.trackingBlockShift) << ", increment "
+                           << (result.cbtIncrementMaxBytes >> 20) << " MiB";
+                    }
+                    logger.Info(ss);
+                }
+            }
+        }
+    }
+
+    report.Save(jsonFile);
+
+    logger.Info("--- Success: COW simulation ---");
+}
+
+static std::vector<unsigned int> valuesOrDefault(const po::variables_map& vm, const char* name,
+                                                 const unsigned int defaultValue)
+{
+    if (!vm.count(name))
+        return {defaultValue};
+    return vm[name].as<std::vector<unsigned int>>();
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string(
+      "Simulation of the copy-on-write and the change tracking for a write trace with different module parameters.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("trace,t", po::value<std::string>(), "The trace file that was recorded or imported by the test_replay.")
+        ("capacity,c", po::value<unsigned int>(),
+            "The capacity of the device in MiB. By default, it is calculated by the last sector of the trace.")
+        ("min_io", po::value<unsigned int>()->default_value(4096), "The minimal I/O block of the device in bytes.")
+        ("interval,n", po::value<unsigned int>()->default_value(0),
+            "The interval between the snapshots in seconds. By default, the whole trace is under one snapshot.")
+        ("chunk_minimum_shift", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The values of the chunk_minimum_shift parameter. By default, 18.")
+        ("chunk_maximum_count_shift", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The values of the chunk_maximum_count_shift parameter. By default, 40.")
+        ("tracking_block_minimum_shift", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The values of the tracking_block_minimum_shift parameter. By default, 16.")
+        ("free_diff_buffer_pool_size", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The values of the free_diff_buffer_pool_size parameter. By default, 128.")
+        ("chunk_maximum_shift", po::value<unsigned int>()->default_value(26),
+            "The value of the chunk_maximum_shift parameter.")
+        ("chunk_maximum_in_queue", po::value<unsigned int>()->default_value(16),
+            "The value of the chunk_maximum_in_queue parameter.")
+        ("diff_storage_minimum", po::value<unsigned int>()->default_value(2097152),
+            "The value of the diff_storage_minimum parameter in sectors.")
+        ("json,j", po::value<std::string>(), "The file for the results in JSON format. By default, the results are written to the log.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    if (!vm.count("trace"))
+        throw std::invalid_argument("Argument 'trace' is missed.");
+    std::string traceFile = vm["trace"].as<std::string>();
+
+    unsigned long long capacity = 0;
+    if (vm.count("capacity"))
+    {
+        capacity = static_cast<unsigned long long>(vm["capacity"].as<unsigned int>()) << 20;
+        if (!capacity)
+            throw std::invalid_argument("Argument 'capacity' cannot be zero.");
+    }
+
+    SCowParams defaults;
+    defaults.chunkMaximumShift = vm["chunk_maximum_shift"].as<unsigned int>();
+    defaults.chunkMaximumInQueue = vm["chunk_maximum_in_queue"].as<unsigned int>();
+    defaults.diffStorageMinimum = vm["diff_storage_minimum"].as<unsigned int>();
+
+    std::vector<unsigned int> chunkMinimumShifts =
+      valuesOrDefault(vm, "chunk_minimum_shift", defaults.chunkMinimumShift);
+    std::vector<unsigned int> trackingBlockMinimumShifts =
+      valuesOrDefault(vm, "tracking_block_minimum_shift", defaults.cbt.minimumShift);
+    for (unsigned int shift : chunkMinimumShifts)
+        if ((shift < SECTOR_SHIFT) || (shift > defaults.chunkMaximumShift))
+            throw std::invalid_argument("Argument 'chunk_minimum_shift' is out of range.");
+    for (unsigned int shift : trackingBlockMinimumShifts)
+        if ((shift < SECTOR_SHIFT) || (shift > defaults.cbt.maximumShift))
+            throw std::invalid_argument("Argument 'tracking_block_minimum_shift' is out of range.");
+
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
+    SimulateCow(traceFile, capacity, vm["min_io"].as<unsigned int>(), vm["interval"].as<unsigned int>(), defaults,
+                chunkMinimumShifts, valuesOrDefault(vm, "chunk_maximum_count_shift", defaults.chunkMaximumCountShift),
+                trackingBlockMinimumShifts,
+                valuesOrDefault(vm, "free_diff_buffer_pool_size", defaults.freeDiffBufferPoolSize), jsonFile);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
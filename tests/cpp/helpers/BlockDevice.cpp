@@ -1,16 +1,324 @@
 // SPDX-License-Identifier: GPL-2.0+
 #include "BlockDevice.h"
 
+#include <algorithm>
+#include <chrono>
 #include <fcntl.h>
+#include <linux/aio_abi.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <system_error>
 #include <unistd.h>
+#include <unordered_map>
+#include "Statistics.h"
+
+namespace
+{
+using SResult = std::pair<uint64_t, long long>;
+using clock_type = std::chrono::steady_clock;
+
+static inline uint64_t elapsedNs(const clock_type::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+}
+
+class IAsyncEngine
+{
+public:
+    virtual ~IAsyncEngine(){};
+
+    virtual const char* Name() = 0;
+    /*
+     * The request is queued, it is sent to the kernel at the next call of
+     * Complete().
+     */
+    virtual void Queue(const bool isWrite, int fd, void* buf, size_t count, off_t offset, uint64_t tag) = 0;
+    virtual void Complete(unsigned int minCount, std::vector<SResult>& results) = 0;
+};
+
+/*
+ * The io_uring is used through the system calls, so the liburing is not
+ * required.
+ */
+class CIoUringEngine : public IAsyncEngine
+{
+public:
+    CIoUringEngine(unsigned int depth)
+        : m_toSubmit(0)
+    {
+        struct io_uring_params params;
+
+        memset(&params, 0, sizeof(params));
+        m_fd = ::syscall(__NR_io_uring_setup, depth, &params);
+        if (m_fd < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to setup io_uring.");
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(__u32);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+        m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+        m_sqRing = Map(m_sqRingSize, IORING_OFF_SQ_RING);
+        m_cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? m_sqRing : Map(m_cqRingSize, IORING_OFF_CQ_RING);
+        m_sqes = static_cast<struct io_uring_sqe*>(Map(m_sqesSize, IORING_OFF_SQES));
+
+        char* sq = static_cast<char*>(m_sqRing);
+        m_sqTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+
+        char* cq = static_cast<char*>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    };
+
+    ~CIoUringEngine() override
+    {
+        Release();
+    };
+
+    const char* Name() override
+    {
+        return "io_uring";
+    };
+
+    void Queue(const bool isWrite, int fd, void* buf, size_t count, off_t offset, uint64_t tag) override
+    {
+        unsigned int tail = *m_sqTail;
+        unsigned int index = tail & m_sqMask;
+        struct io_uring_sqe* sqe = &m_sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<__u64>(buf);
+        sqe->len = count;
+        sqe->off = offset;
+        sqe->user_data = tag;
+        m_sqArray[index] = index;
+
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        m_toSubmit++;
+    };
+
+    void Complete(unsigned int minCount, std::vector<SResult>& results) override
+    {
+        unsigned int completed = 0;
+
+        while (true)
+        {
+            unsigned int head = *m_cqHead;
+            unsigned int tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+
+            for (; head != tail; head++, completed++)
+            {
+                const struct io_uring_cqe* cqe = &m_cqes[head & m_cqMask];
+
+                results.emplace_back(cqe->user_data, cqe->res);
+            }
+            __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+            unsigned int waitCount = (completed < minCount) ? (minCount - completed) : 0;
+            if (!waitCount && !m_toSubmit)
+                break;
+
+            int ret = ::syscall(__NR_io_uring_enter, m_fd, m_toSubmit, waitCount,
+                                waitCount ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "Failed to enter io_uring.");
+            }
+            m_toSubmit -= ret;
+        }
+    };
+
+private:
+    void Release()
+    {
+        if (m_sqes)
+            ::munmap(m_sqes, m_sqesSize);
+        if (m_cqRing && (m_cqRing != m_sqRing))
+            ::munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing)
+            ::munmap(m_sqRing, m_sqRingSize);
+        ::close(m_fd);
+    };
+
+    void* Map(size_t size, off_t offset)
+    {
+        void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+
+        if (ptr == MAP_FAILED)
+        {
+            int err = errno;
+
+            Release();
+            throw std::system_error(err, std::generic_category(), "Failed to map io_uring.");
+        }
+        return ptr;
+    };
+
+private:
+    int m_fd;
+    unsigned int m_toSubmit;
+    size_t m_sqRingSize = 0;
+    size_t m_cqRingSize = 0;
+    size_t m_sqesSize = 0;
+    void* m_sqRing = nullptr;
+    void* m_cqRing = nullptr;
+    struct io_uring_sqe* m_sqes = nullptr;
+    unsigned int* m_sqTail;
+    unsigned int m_sqMask;
+    unsigned int* m_sqArray;
+    unsigned int* m_cqHead;
+    unsigned int* m_cqTail;
+    unsigned int m_cqMask;
+    struct io_uring_cqe* m_cqes;
+};
+
+/*
+ * The native AIO of the kernel is used through the system calls, so the
+ * libaio is not required.
+ */
+class CAioEngine : public IAsyncEngine
+{
+public:
+    CAioEngine(unsigned int depth)
+        : m_ctx(0)
+        , m_events(depth)
+    {
+        if (::syscall(__NR_io_setup, depth, &m_ctx) < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to setup AIO context.");
+    };
+
+    ~CAioEngine() override
+    {
+        ::syscall(__NR_io_destroy, m_ctx);
+    };
+
+    const char* Name() override
+    {
+        return "aio";
+    };
+
+    void Queue(const bool isWrite, int fd, void* buf, size_t count, off_t offset, uint64_t tag) override
+    {
+        struct iocb cb;
+
+        memset(&cb, 0, sizeof(cb));
+        cb.aio_lio_opcode = isWrite ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD;
+        cb.aio_fildes = fd;
+        cb.aio_buf = reinterpret_cast<__u64>(buf);
+        cb.aio_nbytes = count;
+        cb.aio_offset = offset;
+        cb.aio_data = tag;
+        m_queue.push_back(cb);
+    };
+
+    void Complete(unsigned int minCount, std::vector<SResult>& results) override
+    {
+        size_t submitted = 0;
+
+        if (!m_queue.empty())
+        {
+            std::vector<struct iocb*> cbs;
+
+            for (auto& cb : m_queue)
+                cbs.push_back(&cb);
+            while (submitted < cbs.size())
+            {
+                long ret = ::syscall(__NR_io_submit, m_ctx, cbs.size() - submitted, &cbs[submitted]);
+                if (ret < 0)
+                {
+                    if (errno == EINTR || errno == EAGAIN)
+                        continue;
+                    throw std::system_error(errno, std::generic_category(), "Failed to submit AIO requests.");
+                }
+                submitted += ret;
+            }
+            m_queue.clear();
+        }
+
+        unsigned int completed = 0;
+        do
+        {
+            long ret = ::syscall(__NR_io_getevents, m_ctx, (completed < minCount) ? (minCount - completed) : 0,
+                                 m_events.size(), m_events.data(), nullptr);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "Failed to get AIO events.");
+            }
+            for (long inx = 0; inx < ret; inx++)
+                results.emplace_back(m_events[inx].data, m_events[inx].res);
+            completed += ret;
+        } while (completed < minCount);
+    };
+
+private:
+    aio_context_t m_ctx;
+    std::vector<struct iocb> m_queue;
+    std::vector<struct io_event> m_events;
+};
+
+struct SRequest
+{
+    bool isWrite;
+    size_t count;
+    off_t offset;
+    clock_type::time_point start;
+};
+
+struct SFreeDeleter
+{
+    void operator()(unsigned char* ptr) const
+    {
+        ::free(ptr);
+    };
+};
+} // namespace
+
+class CAsyncContext
+{
+public:
+    CAsyncContext(unsigned int depth)
+    {
+        try
+        {
+            m_ptrEngine.reset(new CIoUringEngine(depth));
+        }
+        catch (std::system_error&)
+        {
+            m_ptrEngine.reset(new CAioEngine(depth));
+        }
+    };
+
+    /*
+     * The engine is declared last, so it's destroyed before the buffers
+     * that the outstanding requests may still use.
+     */
+    std::unordered_map<uint64_t, SRequest> m_requests;
+    std::vector<std::unique_ptr<unsigned char, SFreeDeleter>> m_pool;
+    size_t m_poolPortionSize = 0;
+    std::unique_ptr<IAsyncEngine> m_ptrEngine;
+};
 
 CBlockDevice::CBlockDevice(const std::string& name, const bool isSync, const off_t size)
     : m_name(name)
     , m_size(size)
     , m_fd(0)
+    , m_queueDepth(32)
 {
     unsigned int flags = isSync ? O_SYNC | O_DSYNC : 0;
 
@@ -21,6 +329,11 @@ CBlockDevice::CBlockDevice(const std::string& name, const bool isSync, const off
 
 CBlockDevice::~CBlockDevice()
 {
+    if (m_async)
+    {
+        Drain();
+        m_async.reset();
+    }
     if (m_fd)
     {
         ::close(m_fd);
@@ -30,7 +343,10 @@ CBlockDevice::~CBlockDevice()
 
 void CBlockDevice::Read(void* buf, size_t count, off_t offset)
 {
+    const auto start = clock_type::now();
     ssize_t ret = ::pread(m_fd, buf, count, offset);
+    if (m_ptrStatistics && (ret >= 0))
+        m_ptrStatistics->AddRead(ret, elapsedNs(start));
     if (ret < 0)
         throw std::system_error(errno, std::generic_category(), "Failed to read block device. offset=" + std::to_string(offset) + " size=" + std::to_string(count));
     if (ret < count)
@@ -39,13 +355,235 @@ void CBlockDevice::Read(void* buf, size_t count, off_t offset)
 
 void CBlockDevice::Write(const void* buf, size_t count, off_t offset)
 {
+    const auto start = clock_type::now();
     ssize_t ret = ::pwrite(m_fd, buf, count, offset);
+    if (m_ptrStatistics && (ret >= 0))
+        m_ptrStatistics->AddWrite(ret, elapsedNs(start));
     if (ret < 0)
         throw std::system_error(errno, std::generic_category(), "Failed to write block device. offset=" + std::to_string(offset) + " size=" + std::to_string(count));
     if (ret < count)
         throw std::runtime_error("Writing outside the boundaries of a block device");
 };
 
+void CBlockDevice::SetQueueDepth(unsigned int depth)
+{
+    if (!depth)
+        throw std::invalid_argument("The queue depth cannot be zero.");
+    if (depth == m_queueDepth)
+        return;
+    if (m_async && !m_async->m_requests.empty())
+        throw std::logic_error("Cannot change the queue depth while requests are in flight.");
+
+    m_queueDepth = depth;
+    m_async.reset();
+}
+
+unsigned int CBlockDevice::QueueDepth()
+{
+    return m_queueDepth;
+}
+
+const char* CBlockDevice::AsyncEngineName()
+{
+    return Async().m_ptrEngine->Name();
+}
+
+CAsyncContext& CBlockDevice::Async()
+{
+    if (!m_async)
+        m_async.reset(new CAsyncContext(m_queueDepth));
+
+    return *m_async;
+}
+
+void CBlockDevice::SubmitRead(void* buf, size_t count, off_t offset, uint64_t tag)
+{
+    CAsyncContext& ctx = Async();
+
+    if (ctx.m_requests.size() >= m_queueDepth)
+        throw std::logic_error("The queue of the block device is full.");
+    if (!ctx.m_requests.emplace(tag, SRequest{false, count, offset, clock_type::now()}).second)
+        throw std::invalid_argument("The request with tag " + std::to_string(tag) + " is already in flight.");
+
+    ctx.m_ptrEngine->Queue(false, m_fd, buf, count, offset, tag);
+}
+
+void CBlockDevice::SubmitWrite(const void* buf, size_t count, off_t offset, uint64_t tag)
+{
+    CAsyncContext& ctx = Async();
+
+    if (ctx.m_requests.size() >= m_queueDepth)
+        throw std::logic_error("The queue of the block device is full.");
+    if (!ctx.m_requests.emplace(tag, SRequest{true, count, offset, clock_type::now()}).second)
+        throw std::invalid_argument("The request with tag " + std::to_string(tag) + " is already in flight.");
+
+    ctx.m_ptrEngine->Queue(true, m_fd, const_cast<void*>(buf), count, offset, tag);
+}
+
+void CBlockDevice::Poll(std::vector<uint64_t>& tags, unsigned int minCount)
+{
+    CAsyncContext& ctx = Async();
+    std::vector<SResult> results;
+    std::string errorMessage;
+    int errorCode = 0;
+
+    ctx.m_ptrEngine->Complete(std::min<size_t>(minCount, ctx.m_requests.size()), results);
+
+    /*
+     * All completed requests are released before the error is reported,
+     * so the device stays usable.
+     */
+    for (const SResult& result : results)
+    {
+        auto it = ctx.m_requests.find(result.first);
+        if (it == ctx.m_requests.end())
+            continue;
+
+        const SRequest req = it->second;
+        ctx.m_requests.erase(it);
+        tags.push_back(result.first);
+
+        if (m_ptrStatistics && (result.second >= 0))
+        {
+            if (req.isWrite)
+                m_ptrStatistics->AddWrite(result.second, elapsedNs(req.start));
+            else
+                m_ptrStatistics->AddRead(result.second, elapsedNs(req.start));
+        }
+
+        if (!errorMessage.empty())
+            continue;
+        if (result.second < 0)
+        {
+            errorCode = -result.second;
+            errorMessage = std::string("Failed to ") + (req.isWrite ? "write" : "read") + " block device. offset="
+                           + std::to_string(req.offset) + " size=" + std::to_string(req.count);
+        }
+        else if (static_cast<size_t>(result.second) < req.count)
+            errorMessage = std::string(req.isWrite ? "Writing" : "Reading")
+                           + " outside the boundaries of a block device";
+    }
+
+    if (errorCode)
+        throw std::system_error(errorCode, std::generic_category(), errorMessage);
+    if (!errorMessage.empty())
+        throw std::runtime_error(errorMessage);
+}
+
+/*
+ * Waits for all the requests in flight, ignoring their errors. If a failure
+ * did not reap any request, the engine is broken, so the context with the
+ * outstanding requests is dropped.
+ */
+void CBlockDevice::Drain()
+{
+    std::vector<uint64_t> tags;
+
+    while (m_async && !m_async->m_requests.empty())
+    {
+        const size_t inFlight = m_async->m_requests.size();
+
+        try
+        {
+            Poll(tags, inFlight);
+        }
+        catch (std::exception&)
+        {
+            if (m_async->m_requests.size() == inFlight)
+                m_async.reset();
+        }
+    }
+}
+
+void CBlockDevice::ProcessRange(const bool isWrite, off_t offset, off_t size, size_t portionSize, const PortionFn& fn)
+{
+    CAsyncContext& ctx = Async();
+    const off_t end = offset + size;
+    std::vector<SRequest> slots(m_queueDepth);
+    std::vector<bool> isDone(m_queueDepth);
+    std::vector<uint64_t> tags;
+    uint64_t submitted = 0;
+    uint64_t finished = 0;
+
+    if (!ctx.m_requests.empty())
+        throw std::logic_error("The asynchronous requests are already in flight.");
+
+    if ((ctx.m_pool.size() != m_queueDepth) || (ctx.m_poolPortionSize != portionSize))
+    {
+        const size_t alignment = 4096;
+
+        ctx.m_pool.clear();
+        for (unsigned int inx = 0; inx < m_queueDepth; inx++)
+        {
+            void* buf = ::aligned_alloc(alignment, (portionSize + alignment - 1) & ~(alignment - 1));
+
+            if (!buf)
+                throw std::bad_alloc();
+            ctx.m_pool.emplace_back(static_cast<unsigned char*>(buf));
+        }
+        ctx.m_poolPortionSize = portionSize;
+    }
+
+    try
+    {
+        while ((finished < submitted) || (offset < end))
+        {
+            while (((submitted - finished) < m_queueDepth) && (offset < end))
+            {
+                const size_t slot = submitted % m_queueDepth;
+                const size_t count = std::min(static_cast<off_t>(portionSize), end - offset);
+                unsigned char* buf = ctx.m_pool[slot].get();
+
+                if (isWrite)
+                {
+                    fn(buf, count, offset);
+                    SubmitWrite(buf, count, offset, slot);
+                }
+                else
+                    SubmitRead(buf, count, offset, slot);
+
+                slots[slot] = SRequest{isWrite, count, offset};
+                isDone[slot] = false;
+                offset += count;
+                submitted++;
+            }
+
+            const size_t slot = finished % m_queueDepth;
+            while (!isDone[slot])
+            {
+                tags.clear();
+                Poll(tags, 1);
+                for (uint64_t tag : tags)
+                    isDone[tag] = true;
+            }
+
+            if (!isWrite)
+                fn(ctx.m_pool[slot].get(), slots[slot].count, slots[slot].offset);
+            finished++;
+        }
+    }
+    catch (...)
+    {
+        Drain();
+        throw;
+    }
+}
+
+void CBlockDevice::SetStatistics(const std::shared_ptr<CIoStatistics>& ptrStatistics)
+{
+    m_ptrStatistics = ptrStatistics;
+}
+
+void CBlockDevice::WriteRange(off_t offset, off_t size, size_t portionSize, const PortionFn& fn)
+{
+    ProcessRange(true, offset, size, portionSize, fn);
+}
+
+void CBlockDevice::ReadRange(off_t offset, off_t size, size_t portionSize, const PortionFn& fn)
+{
+    ProcessRange(false, offset, size, portionSize, fn);
+}
+
 off_t CBlockDevice::Size()
 {
     if (m_size == 0)
@@ -1,16 +1,59 @@
 // SPDX-License-Identifier: GPL-2.0+
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
+#include <stdint.h>
 #include <sys/types.h>
 
+class CAsyncContext;
+class CIoStatistics;
+
 class CBlockDevice
 {
 public:
+    using PortionFn = std::function<void(unsigned char* buf, size_t count, off_t offset)>;
+
     CBlockDevice(const std::string& name, const bool isSync = false, const off_t size = 0);
     ~CBlockDevice();
 
     void Read(void* buf, size_t count, off_t offset);
     void Write(const void* buf, size_t count, off_t offset);
 
+    /*
+     * Asynchronous I/O. The io_uring is used when the kernel allows it,
+     * otherwise the native AIO of the kernel. Up to 'depth' requests can be
+     * in flight. Unlike Read() and Write(), the asynchronous functions must
+     * be called by one thread at a time.
+     */
+    void SetQueueDepth(unsigned int depth);
+    unsigned int QueueDepth();
+    const char* AsyncEngineName();
+    void SubmitRead(void* buf, size_t count, off_t offset, uint64_t tag);
+    void SubmitWrite(const void* buf, size_t count, off_t offset, uint64_t tag);
+    /*
+     * Waits until at least 'minCount' requests are completed and adds their
+     * tags to the list. An exception is thrown for a failed or short
+     * request.
+     */
+    void Poll(std::vector<uint64_t>& tags, unsigned int minCount = 1);
+
+    /*
+     * Write or read the range of the device by the portions from the buffer
+     * pool, keeping the queue full. For writing, 'fn' fills the portion
+     * before it is submitted. For reading, 'fn' is called for the portions
+     * in the order of offsets when they are read.
+     */
+    void WriteRange(off_t offset, off_t size, size_t portionSize, const PortionFn& fn);
+    void ReadRange(off_t offset, off_t size, size_t portionSize, const PortionFn& fn);
+
+    /*
+     * The latency and the size of each read and write, synchronous and
+     * asynchronous, are added to the statistics. It should be set when no
+     * requests are in flight, nullptr stops the collection.
+     */
+    void SetStatistics(const std::shared_ptr<CIoStatistics>& ptrStatistics);
+
     off_t Size();
     size_t BlockSize();
     const std::string& Name();
@@ -19,4 +62,12 @@ private:
     std::string m_name;
     off_t m_size;
     int m_fd;
+    unsigned int m_queueDepth;
+    std::unique_ptr<CAsyncContext> m_async;
+    std::shared_ptr<CIoStatistics> m_ptrStatistics;
+
+private:
+    CAsyncContext& Async();
+    void Drain();
+    void ProcessRange(const bool isWrite, off_t offset, off_t size, size_t portionSize, const PortionFn& fn);
 };
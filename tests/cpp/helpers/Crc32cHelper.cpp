@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include "Crc32cHelper.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace
+{
+const uint32_t crc32cPoly = 0x82F63B78;
+
+class CCrc32cTable
+{
+public:
+    CCrc32cTable()
+    {
+        for (uint32_t inx = 0; inx < 256; inx++)
+        {
+            uint32_t crc = inx;
+
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? ((crc >> 1) ^ crc32cPoly) : (crc >> 1);
+            m_table[0][inx] = crc;
+        }
+        for (uint32_t inx = 0; inx < 256; inx++)
+            for (int slice = 1; slice < 8; slice++)
+                m_table[slice][inx] = (m_table[slice - 1][inx] >> 8) ^ m_table[0][m_table[slice - 1][inx] & 0xFF];
+    };
+
+    uint32_t Calculate(const unsigned char* data, size_t size, uint32_t crc) const
+    {
+        for (; size && (reinterpret_cast<uintptr_t>(data) & 7); size--)
+            crc = (crc >> 8) ^ m_table[0][(crc ^ *data++) & 0xFF];
+
+        for (; size >= 8; size -= 8, data += 8)
+        {
+            uint64_t word;
+
+            memcpy(&word, data, sizeof(word));
+            word ^= crc;
+            crc = m_table[7][word & 0xFF] ^ m_table[6][(word >> 8) & 0xFF] ^ m_table[5][(word >> 16) & 0xFF]
+                  ^ m_table[4][(word >> 24) & 0xFF] ^ m_table[3][(word >> 32) & 0xFF]
+                  ^ m_table[2][(word >> 40) & 0xFF] ^ m_table[1][(word >> 48) & 0xFF] ^ m_table[0][word >> 56];
+        }
+
+        for (; size; size--)
+            crc = (crc >> 8) ^ m_table[0][(crc ^ *data++) & 0xFF];
+        return crc;
+    };
+
+private:
+    uint32_t m_table[8][256];
+};
+
+const CCrc32cTable crc32cTable;
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHw(const unsigned char* data, size_t size, uint32_t crc)
+{
+    uint64_t crc64;
+
+    for (; size && (reinterpret_cast<uintptr_t>(data) & 7); size--)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+
+    for (; size; size--)
+        crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+
+const bool isHwSupported = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+uint32_t crc32cHw(const unsigned char* data, size_t size, uint32_t crc)
+{
+    for (; size && (reinterpret_cast<uintptr_t>(data) & 7); size--)
+        crc = __crc32cb(crc, *data++);
+
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+
+    for (; size; size--)
+        crc = __crc32cb(crc, *data++);
+    return crc;
+}
+
+const bool isHwSupported = true;
+#else
+uint32_t crc32cHw(const unsigned char* data, size_t size, uint32_t crc)
+{
+    return crc32cTable.Calculate(data, size, crc);
+}
+
+const bool isHwSupported = false;
+#endif
+} // namespace
+
+uint32_t CCrc32cHelper::Calculate(const void* data, size_t size, uint32_t crc)
+{
+    const unsigned char* ptr = static_cast<const unsigned char*>(data);
+
+    crc = ~crc;
+    if (isHwSupported)
+        crc = crc32cHw(ptr, size, crc);
+    else
+        crc = crc32cTable.Calculate(ptr, size, crc);
+    return ~crc;
+}
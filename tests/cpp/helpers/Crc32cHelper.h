@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * CRC-32C (Castagnoli) calculation. The CPU instructions are used when they
+ * are available: SSE4.2 on x86_64 is detected at runtime, the ARMv8 CRC
+ * extension is detected at compile time. Otherwise, the slicing-by-8 table
+ * algorithm is used.
+ */
+class CCrc32cHelper
+{
+public:
+    static uint32_t Calculate(const void* data, size_t size, uint32_t crc = 0);
+};
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include "JsonWriter.h"
+
+#include <iomanip>
+
+void CJsonWriter::Separate()
+{
+    if (m_isKey)
+    {
+        m_isKey = false;
+        return;
+    }
+    if (m_isFirst.empty())
+        return;
+
+    if (!m_isFirst.back())
+        m_ss << ",";
+    m_isFirst.back() = false;
+}
+
+void CJsonWriter::Escape(const std::string& str)
+{
+    m_ss << "\"";
+    for (const char ch : str)
+    {
+        switch (ch)
+        {
+        case '"':
+            m_ss << "\\\"";
+            break;
+        case '\\':
+            m_ss << "\\\\";
+            break;
+        case '\n':
+            m_ss << "\\n";
+            break;
+        case '\r':
+            m_ss << "\\r";
+            break;
+        case '\t':
+            m_ss << "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(ch) < 0x20)
+                m_ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(ch) << std::dec;
+            else
+                m_ss << ch;
+        }
+    }
+    m_ss << "\"";
+}
+
+CJsonWriter& CJsonWriter::BeginObject()
+{
+    Separate();
+    m_ss << "{";
+    m_isFirst.push_back(true);
+    return *this;
+}
+
+CJsonWriter& CJsonWriter::EndObject()
+{
+    m_isFirst.pop_back();
+    m_ss << "}";
+    return *this;
+}
+
+CJsonWriter& CJsonWriter::BeginArray()
+{
+    Separate();
+    m_ss << "[";
+    m_isFirst.push_back(true);
+    return *this;
+}
+
+CJsonWriter& CJsonWriter::EndArray()
+{
+    m_isFirst.pop_back();
+    m_ss << "]";
+    return *this;
+}
+
+CJsonWriter& CJsonWriter::Key(const std::string& key)
+{
+    Separate();
+    Escape(key);
+    m_ss << ":";
+    m_isKey = true;
+    return *this;
+}
+
+CJsonWriter& CJsonWriter::Value(const std::string& value)
+{
+    Separate();
+    Escape(value);
+    return *this;
+}
+
+CJsonWriter& CJsonWriter::Value(const char* value)
+{
+    return Value(std::string(value));
+}
+
+CJsonWriter& CJsonWriter::Value(const bool value)
+{
+    Separate();
+    m_ss << (value ? "true" : "false");
+    return *this;
+}
@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Builds the JSON text. The commas between the members of the objects and
+ * the arrays are put automatically, the strings are escaped. The numbers
+ * that are not finite are written as null.
+ */
+class CJsonWriter
+{
+public:
+    CJsonWriter()
+        : m_isKey(false)
+    {};
+
+    CJsonWriter& BeginObject();
+    CJsonWriter& EndObject();
+    CJsonWriter& BeginArray();
+    CJsonWriter& EndArray();
+    CJsonWriter& Key(const std::string& key);
+
+    CJsonWriter& Value(const std::string& value);
+    CJsonWriter& Value(const char* value);
+    CJsonWriter& Value(const bool value);
+    template <typename T>
+    CJsonWriter& Value(const T value)
+    {
+        static_assert(std::is_arithmetic<T>::value, "The value should be a number.");
+
+        Separate();
+        if (std::is_floating_point<T>::value && !std::isfinite(static_cast<double>(value)))
+            m_ss << "null";
+        else
+            m_ss << value;
+        return *this;
+    };
+
+    std::string Str() const
+    {
+        return m_ss.str();
+    };
+
+private:
+    std::stringstream m_ss;
+    std::vector<bool> m_isFirst;
+    bool m_isKey;
+
+private:
+    void Separate();
+    void Escape(const std::string& str);
+};
@@ -17,7 +17,7 @@ LoopDevice::LoopDevice(boost::filesystem::path image, boost::filesystem::path lo
     , m_loopDevice(loop)
 {}
 
-LoopDevice::Ptr LoopDevice::Create(boost::filesystem::path directory, size_t size)
+LoopDevice::Ptr LoopDevice::Create(boost::filesystem::path directory, size_t size, bool isSparse)
 {
     int fd = -1;
     boost::filesystem::path image = directory / (Uuid::GenerateRandom().ToStr() + std::string(".loop_image"));
@@ -27,7 +27,12 @@ LoopDevice::Ptr LoopDevice::Create(boost::filesystem::path directory, size_t siz
         if (fd == -1)
             throw std::system_error(errno, std::generic_category(), "Failed to create loop image file");
 
-        if (::fallocate64(fd, 0, 0, size))
+        if (isSparse)
+        {
+            if (::ftruncate64(fd, size))
+                throw std::system_error(errno, std::generic_category(), "Failed to resize loop image file");
+        }
+        else if (::fallocate64(fd, 0, 0, size))
             throw std::system_error(errno, std::generic_category(), "Failed to allocate loop image file");
 
         ::close(fd);
@@ -10,7 +10,11 @@ public:
     using Ptr = std::shared_ptr<LoopDevice>;
 
     ~LoopDevice();
-    static LoopDevice::Ptr Create(boost::filesystem::path directory, size_t size);
+    /*
+     * The sparse image is not allocated, so the device can be much larger
+     * than the free space of the file system.
+     */
+    static LoopDevice::Ptr Create(boost::filesystem::path directory, size_t size, bool isSparse = false);
 
     boost::filesystem::path GetDevice() const;
     void Mkfs(const std::string fsType = "ext4");
@@ -2,6 +2,7 @@
 #include "RandomHelper.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 
 void CRandomHelper::GenerateBuffer(void* buffer, size_t size)
@@ -18,6 +19,31 @@ void CRandomHelper::GenerateBuffer(void* buffer, size_t size)
         chbuf[offset] = static_cast<char>((offset * rnd) & 0xFF);
 }
 
+void CRandomHelper::GenerateBuffer(void* buffer, size_t size, uint64_t seed)
+{
+    unsigned char* chbuf = static_cast<unsigned char*>(buffer);
+
+    for (;;)
+    {
+        uint64_t value;
+
+        seed += 0x9E3779B97F4A7C15ULL;
+        value = seed;
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        value ^= (value >> 31);
+
+        if (size < sizeof(value))
+        {
+            memcpy(chbuf, &value, size);
+            break;
+        }
+        memcpy(chbuf, &value, sizeof(value));
+        chbuf += sizeof(value);
+        size -= sizeof(value);
+    }
+}
+
 int CRandomHelper::GenerateInt()
 {
     return ::random();
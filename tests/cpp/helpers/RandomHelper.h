@@ -1,9 +1,16 @@
 // SPDX-License-Identifier: GPL-2.0+
+#include <stdint.h>
 #include <sys/types.h>
 
 class CRandomHelper
 {
 public:
     static void GenerateBuffer(void* buffer, size_t size);
+    /*
+     * Fills the buffer with the splitmix64 sequence. The same seed gives
+     * the same content, and no global state is used, so it can be called
+     * from many threads at once.
+     */
+    static void GenerateBuffer(void* buffer, size_t size, uint64_t seed);
     static int GenerateInt();
 };
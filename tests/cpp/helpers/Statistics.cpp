@@ -0,0 +1,217 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include "Statistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include "JsonWriter.h"
+
+CLatencyHistogram::CLatencyHistogram()
+    : m_count(0)
+    , m_sum(0)
+    , m_min(UINT64_MAX)
+    , m_max(0)
+{
+    for (auto& bucket : m_buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+
+unsigned int CLatencyHistogram::BucketIndex(const uint64_t value)
+{
+    if (value < subBucketCount)
+        return static_cast<unsigned int>(value);
+
+    const unsigned int exponent = 63 - __builtin_clzll(value);
+    const unsigned int mantissa = static_cast<unsigned int>(value >> (exponent - subBucketShift)) - subBucketCount;
+
+    return (exponent - subBucketShift + 1) * subBucketCount + mantissa;
+}
+
+uint64_t CLatencyHistogram::BucketLowest(const unsigned int index)
+{
+    if (index < subBucketCount)
+        return index;
+
+    const unsigned int exponent = index / subBucketCount + subBucketShift - 1;
+
+    return static_cast<uint64_t>(subBucketCount + index % subBucketCount) << (exponent - subBucketShift);
+}
+
+uint64_t CLatencyHistogram::BucketHighest(const unsigned int index)
+{
+    if (index < subBucketCount)
+        return index;
+
+    const unsigned int exponent = index / subBucketCount + subBucketShift - 1;
+
+    return BucketLowest(index) + (1ULL << (exponent - subBucketShift)) - 1;
+}
+
+void CLatencyHistogram::UpdateMin(const uint64_t value)
+{
+    uint64_t current = m_min.load(std::memory_order_relaxed);
+
+    while ((value < current) && !m_min.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        ;
+}
+
+void CLatencyHistogram::UpdateMax(const uint64_t value)
+{
+    uint64_t current = m_max.load(std::memory_order_relaxed);
+
+    while ((value > current) && !m_max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        ;
+}
+
+void CLatencyHistogram::Add(const uint64_t valueNs)
+{
+    m_buckets[BucketIndex(valueNs)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(valueNs, std::memory_order_relaxed);
+    UpdateMin(valueNs);
+    UpdateMax(valueNs);
+}
+
+void CLatencyHistogram::Merge(const CLatencyHistogram& other)
+{
+    const uint64_t count = other.Count();
+
+    if (!count)
+        return;
+
+    for (unsigned int inx = 0; inx < bucketCount; inx++)
+    {
+        const uint64_t value = other.m_buckets[inx].load(std::memory_order_relaxed);
+
+        if (value)
+            m_buckets[inx].fetch_add(value, std::memory_order_relaxed);
+    }
+    m_count.fetch_add(count, std::memory_order_relaxed);
+    m_sum.fetch_add(other.m_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    UpdateMin(other.Min());
+    UpdateMax(other.Max());
+}
+
+uint64_t CLatencyHistogram::Count() const
+{
+    return m_count.load(std::memory_order_relaxed);
+}
+
+uint64_t CLatencyHistogram::Min() const
+{
+    return Count() ? m_min.load(std::memory_order_relaxed) : 0;
+}
+
+uint64_t CLatencyHistogram::Max() const
+{
+    return m_max.load(std::memory_order_relaxed);
+}
+
+double CLatencyHistogram::Mean() const
+{
+    const uint64_t count = Count();
+
+    return count ? static_cast<double>(m_sum.load(std::memory_order_relaxed)) / count : 0;
+}
+
+uint64_t CLatencyHistogram::Percentile(const double percent) const
+{
+    const uint64_t count = Count();
+    uint64_t target;
+    uint64_t total = 0;
+
+    if (!count)
+        return 0;
+
+    target = static_cast<uint64_t>(std::ceil(std::min(std::max(percent, 0.0), 100.0) / 100.0 * count));
+    target = std::max<uint64_t>(target, 1);
+    for (unsigned int inx = 0; inx < bucketCount; inx++)
+    {
+        total += m_buckets[inx].load(std::memory_order_relaxed);
+        if (total >= target)
+            return std::min(BucketHighest(inx), Max());
+    }
+    return Max();
+}
+
+void CLatencyHistogram::WriteJson(CJsonWriter& writer) const
+{
+    writer.BeginObject()
+      .Key("count").Value(Count())
+      .Key("min_us").Value(Min() / 1000.0)
+      .Key("mean_us").Value(Mean() / 1000.0)
+      .Key("p50_us").Value(Percentile(50) / 1000.0)
+      .Key("p90_us").Value(Percentile(90) / 1000.0)
+      .Key("p99_us").Value(Percentile(99) / 1000.0)
+      .Key("p999_us").Value(Percentile(99.9) / 1000.0)
+      .Key("max_us").Value(Max() / 1000.0);
+
+    /*
+     * The buckets allow to merge the histograms of several runs later.
+     * Each bucket is written as the lowest value in nanoseconds and the
+     * count.
+     */
+    writer.Key("buckets").BeginArray();
+    for (unsigned int inx = 0; inx < bucketCount; inx++)
+    {
+        const uint64_t value = m_buckets[inx].load(std::memory_order_relaxed);
+
+        if (value)
+            writer.BeginArray().Value(BucketLowest(inx)).Value(value).EndArray();
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
+
+void CIoStatistics::Merge(const CIoStatistics& other)
+{
+    m_elapsedNs.fetch_add(other.m_elapsedNs.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    m_read.Add(other.m_read.Bytes(), other.m_read.Ops());
+    m_write.Add(other.m_write.Bytes(), other.m_write.Ops());
+    m_readLatency.Merge(other.m_readLatency);
+    m_writeLatency.Merge(other.m_writeLatency);
+}
+
+static void writeDirection(CJsonWriter& writer, const CThroughputCounter& counter, const CLatencyHistogram& latency,
+                           const double seconds)
+{
+    writer.BeginObject()
+      .Key("ops").Value(counter.Ops())
+      .Key("bytes").Value(counter.Bytes())
+      .Key("iops").Value(seconds > 0 ? counter.Ops() / seconds : 0.0)
+      .Key("mib_per_s").Value(seconds > 0 ? counter.Bytes() / seconds / (1 << 20) : 0.0)
+      .Key("latency");
+    latency.WriteJson(writer);
+    writer.EndObject();
+}
+
+void CIoStatistics::WriteJson(CJsonWriter& writer) const
+{
+    writer.BeginObject().Key("seconds").Value(Seconds());
+    writer.Key("read");
+    writeDirection(writer, m_read, m_readLatency, Seconds());
+    writer.Key("write");
+    writeDirection(writer, m_write, m_writeLatency, Seconds());
+    writer.EndObject();
+}
+
+std::string CIoStatistics::ToString() const
+{
+    std::stringstream ss;
+    const double seconds = Seconds();
+    auto direction = [&ss, seconds](const char* name, const CThroughputCounter& counter,
+                                    const CLatencyHistogram& latency) {
+        if (!counter.Ops())
+            return;
+        ss << " " << name << " " << (counter.Bytes() / static_cast<double>(1 << 20)) << " MiB";
+        if (seconds > 0)
+            ss << " " << (counter.Bytes() / seconds / (1 << 20)) << " MiB/s " << (counter.Ops() / seconds) << " IOPS";
+        ss << ", latency p50 " << (latency.Percentile(50) / 1000.0) << " us, p99 "
+           << (latency.Percentile(99) / 1000.0) << " us, max " << (latency.Max() / 1000.0) << " us;";
+    };
+
+    ss << seconds << " s;";
+    direction("read", m_read, m_readLatency);
+    direction("write", m_write, m_writeLatency);
+    return ss.str();
+}
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class CJsonWriter;
+
+/*
+ * The histogram of the latencies in nanoseconds with the logarithmic
+ * buckets, as in HdrHistogram. Each power of two is split into 32 buckets,
+ * so the error of the value is less than 3.2 percent. The counters are
+ * atomic, so many threads can add values to the same histogram or merge
+ * their own histograms into it without locks.
+ */
+class CLatencyHistogram
+{
+public:
+    CLatencyHistogram();
+    CLatencyHistogram(const CLatencyHistogram&) = delete;
+    CLatencyHistogram& operator=(const CLatencyHistogram&) = delete;
+
+    void Add(const uint64_t valueNs);
+    void Merge(const CLatencyHistogram& other);
+
+    uint64_t Count() const;
+    uint64_t Min() const;
+    uint64_t Max() const;
+    double Mean() const;
+    /*
+     * Returns the highest value of the bucket that contains the percentile,
+     * but not greater than the maximum value.
+     */
+    uint64_t Percentile(const double percent) const;
+
+    /*
+     * Writes the count, the mean, the percentiles and the non-empty buckets
+     * in microseconds.
+     */
+    void WriteJson(CJsonWriter& writer) const;
+
+private:
+    static const unsigned int subBucketShift = 5;
+    static const unsigned int subBucketCount = 1U << subBucketShift;
+    static const unsigned int bucketCount = (64 - subBucketShift + 1) * subBucketCount;
+
+    std::atomic<uint64_t> m_buckets[bucketCount];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_min;
+    std::atomic<uint64_t> m_max;
+
+private:
+    static unsigned int BucketIndex(const uint64_t value);
+    static uint64_t BucketLowest(const unsigned int index);
+    static uint64_t BucketHighest(const unsigned int index);
+    void UpdateMin(const uint64_t value);
+    void UpdateMax(const uint64_t value);
+};
+
+/*
+ * The number of requests and bytes.
+ */
+class CThroughputCounter
+{
+public:
+    CThroughputCounter()
+        : m_ops(0)
+        , m_bytes(0)
+    {};
+
+    void Add(const uint64_t bytes, const uint64_t ops = 1)
+    {
+        m_ops.fetch_add(ops, std::memory_order_relaxed);
+        m_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    };
+
+    uint64_t Ops() const
+    {
+        return m_ops.load(std::memory_order_relaxed);
+    };
+
+    uint64_t Bytes() const
+    {
+        return m_bytes.load(std::memory_order_relaxed);
+    };
+
+private:
+    std::atomic<uint64_t> m_ops;
+    std::atomic<uint64_t> m_bytes;
+};
+
+/*
+ * The latencies and the throughput of the reads and the writes to the
+ * block device. The elapsed time is the sum of the times of all the
+ * measurements, so the throughput is the throughput of one stream.
+ */
+class CIoStatistics
+{
+public:
+    CIoStatistics()
+        : m_elapsedNs(0)
+    {};
+
+    void AddRead(const size_t bytes, const uint64_t latencyNs)
+    {
+        m_read.Add(bytes);
+        m_readLatency.Add(latencyNs);
+    };
+
+    void AddWrite(const size_t bytes, const uint64_t latencyNs)
+    {
+        m_write.Add(bytes);
+        m_writeLatency.Add(latencyNs);
+    };
+
+    void AddElapsed(const uint64_t elapsedNs)
+    {
+        m_elapsedNs.fetch_add(elapsedNs, std::memory_order_relaxed);
+    };
+
+    void Merge(const CIoStatistics& other);
+
+    double Seconds() const
+    {
+        return m_elapsedNs.load(std::memory_order_relaxed) / 1e9;
+    };
+    const CThroughputCounter& Reads() const
+    {
+        return m_read;
+    };
+    const CThroughputCounter& Writes() const
+    {
+        return m_write;
+    };
+    const CLatencyHistogram& ReadLatency() const
+    {
+        return m_readLatency;
+    };
+    const CLatencyHistogram& WriteLatency() const
+    {
+        return m_writeLatency;
+    };
+
+    void WriteJson(CJsonWriter& writer) const;
+    /*
+     * The short summary for the log.
+     */
+    std::string ToString() const;
+
+private:
+    std::atomic<uint64_t> m_elapsedNs;
+    CThroughputCounter m_read;
+    CThroughputCounter m_write;
+    CLatencyHistogram m_readLatency;
+    CLatencyHistogram m_writeLatency;
+};
@@ -0,0 +1,175 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include "TestReport.h"
+
+#include <chrono>
+#include <fstream>
+#include "BlockDevice.h"
+#include "Log.h"
+
+CTestResult& CTestResult::Set(const std::string& name, const std::string& value)
+{
+    m_fields.emplace_back(name, [value](CJsonWriter& writer) { writer.Value(value); });
+    return *this;
+}
+
+CTestResult& CTestResult::SetSeries(const std::string& name, const std::vector<std::pair<uint64_t, uint64_t>>& points)
+{
+    m_fields.emplace_back(name, [points](CJsonWriter& writer) {
+        writer.BeginArray();
+        for (const auto& point : points)
+            writer.BeginArray().Value(point.first).Value(point.second).EndArray();
+        writer.EndArray();
+    });
+    return *this;
+}
+
+CLatencyHistogram& CTestResult::Latency(const std::string& name)
+{
+    for (auto& latency : m_latencies)
+        if (latency.first == name)
+            return *latency.second;
+
+    m_latencies.emplace_back(name, std::unique_ptr<CLatencyHistogram>(new CLatencyHistogram()));
+    return *m_latencies.back().second;
+}
+
+const std::shared_ptr<CIoStatistics>& CTestResult::Io()
+{
+    if (!m_ptrIo)
+        m_ptrIo = std::make_shared<CIoStatistics>();
+    return m_ptrIo;
+}
+
+void CTestResult::WriteJson(CJsonWriter& writer) const
+{
+    writer.BeginObject();
+    for (const auto& field : m_fields)
+    {
+        writer.Key(field.first);
+        field.second(writer);
+    }
+    for (const auto& latency : m_latencies)
+    {
+        writer.Key(latency.first);
+        latency.second->WriteJson(writer);
+    }
+    if (m_ptrIo)
+    {
+        writer.Key("io");
+        m_ptrIo->WriteJson(writer);
+    }
+    writer.EndObject();
+}
+
+void CTestReport::SetParameter(const std::string& name, const std::string& value)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    for (auto& parameter : m_parameters)
+    {
+        if (parameter.first == name)
+        {
+            parameter.second = value;
+            return;
+        }
+    }
+    m_parameters.emplace_back(name, value);
+}
+
+std::shared_ptr<CIoStatistics> CTestReport::Phase(const std::string& name)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    auto it = m_phases.find(name);
+
+    if (it != m_phases.end())
+        return it->second;
+
+    auto ptrStatistics = std::make_shared<CIoStatistics>();
+    m_phases[name] = ptrStatistics;
+    m_phaseOrder.push_back(name);
+    return ptrStatistics;
+}
+
+void CTestReport::Measure(const std::string& phase, CBlockDevice& device, const std::function<void()>& fn)
+{
+    Measure(Phase(phase), device, fn);
+}
+
+void CTestReport::Measure(const std::shared_ptr<CIoStatistics>& ptrStatistics, CBlockDevice& device,
+                          const std::function<void()>& fn)
+{
+    const auto start = std::chrono::steady_clock::now();
+    auto addElapsed = [&]() {
+        device.SetStatistics(nullptr);
+        ptrStatistics->AddElapsed(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    };
+
+    device.SetStatistics(ptrStatistics);
+    try
+    {
+        fn();
+    }
+    catch (...)
+    {
+        addElapsed();
+        throw;
+    }
+    addElapsed();
+}
+
+CTestResult& CTestReport::AddResult()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    m_results.emplace_back();
+    return m_results.back();
+}
+
+void CTestReport::Save(const std::string& jsonFile, const std::string& errorMessage)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    CJsonWriter writer;
+
+    writer.BeginObject()
+      .Key("test").Value(m_testName)
+      .Key("success").Value(errorMessage.empty());
+    if (!errorMessage.empty())
+        writer.Key("error").Value(errorMessage);
+
+    writer.Key("parameters").BeginObject();
+    for (const auto& parameter : m_parameters)
+        writer.Key(parameter.first).Value(parameter.second);
+    writer.EndObject();
+
+    writer.Key("phases").BeginObject();
+    for (const std::string& name : m_phaseOrder)
+    {
+        const auto& ptrStatistics = m_phases.at(name);
+
+        logger.Info(name + ": " + ptrStatistics->ToString());
+        writer.Key(name);
+        ptrStatistics->WriteJson(writer);
+    }
+    writer.EndObject();
+
+    if (!m_results.empty())
+    {
+        writer.Key("results").BeginArray();
+        for (const CTestResult& result : m_results)
+            result.WriteJson(writer);
+        writer.EndArray();
+    }
+    writer.EndObject();
+
+    if (jsonFile.empty())
+        logger.Info(writer.Str());
+    else
+    {
+        std::ofstream output(jsonFile, std::ios::trunc);
+
+        output << writer.Str() << std::endl;
+        if (output.fail())
+            throw std::runtime_error("Failed to write file '" + jsonFile + "'.");
+    }
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: GPL-2.0+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "JsonWriter.h"
+#include "Statistics.h"
+
+class CBlockDevice;
+
+/*
+ * The result of the test for one combination of its parameters. The fields
+ * are written to the report in the order in which they were set, followed by
+ * the latency histograms and the I/O statistics.
+ */
+class CTestResult
+{
+public:
+    CTestResult& Set(const std::string& name, const std::string& value);
+    CTestResult& Set(const std::string& name, const char* value)
+    {
+        return Set(name, std::string(value));
+    };
+    template <typename T>
+    CTestResult& Set(const std::string& name, const T value)
+    {
+        m_fields.emplace_back(name, [value](CJsonWriter& writer) { writer.Value(value); });
+        return *this;
+    };
+    /*
+     * The series of the points, for example, the value sampled over time.
+     */
+    CTestResult& SetSeries(const std::string& name, const std::vector<std::pair<uint64_t, uint64_t>>& points);
+
+    /*
+     * The histogram of the latencies that are not collected by the block
+     * device, for example, of the calls to the module. It should be created
+     * before the threads start adding to it.
+     */
+    CLatencyHistogram& Latency(const std::string& name);
+    /*
+     * The statistics of the I/O to the devices for CTestReport::Measure().
+     */
+    const std::shared_ptr<CIoStatistics>& Io();
+
+    void WriteJson(CJsonWriter& writer) const;
+
+private:
+    std::vector<std::pair<std::string, std::function<void(CJsonWriter&)>>> m_fields;
+    std::vector<std::pair<std::string, std::unique_ptr<CLatencyHistogram>>> m_latencies;
+    std::shared_ptr<CIoStatistics> m_ptrIo;
+};
+
+/*
+ * The results of the test run: the parameters, the I/O statistics of the
+ * phases of the test, the results for the combinations of the parameters
+ * and the status. The statistics of each phase are
+ * accumulated over all calls of Measure(), including the concurrent calls
+ * from different threads.
+ */
+class CTestReport
+{
+public:
+    CTestReport(const std::string& testName)
+        : m_testName(testName)
+    {};
+
+    void SetParameter(const std::string& name, const std::string& value);
+    std::shared_ptr<CIoStatistics> Phase(const std::string& name);
+
+    /*
+     * Collects the statistics of the I/O to the device while 'fn' is being
+     * executed into the phase.
+     */
+    void Measure(const std::string& phase, CBlockDevice& device, const std::function<void()>& fn);
+    static void Measure(const std::shared_ptr<CIoStatistics>& ptrStatistics, CBlockDevice& device,
+                        const std::function<void()>& fn);
+
+    /*
+     * Adds the result for a combination of the parameters of the test. The
+     * results are written to the "results" array of the report.
+     */
+    CTestResult& AddResult();
+
+    /*
+     * Writes the report in JSON format to the file, or to the log if the
+     * file name is empty. The summary of each phase is written to the log.
+     * The test is considered failed if the error message is not empty.
+     */
+    void Save(const std::string& jsonFile, const std::string& errorMessage = std::string());
+
+private:
+    std::string m_testName;
+    std::mutex m_lock;
+    std::vector<std::pair<std::string, std::string>> m_parameters;
+    std::vector<std::string> m_phaseOrder;
+    std::map<std::string, std::shared_ptr<CIoStatistics>> m_phases;
+    std::list<CTestResult> m_results;
+};
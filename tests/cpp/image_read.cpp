@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <blksnap/Cbt.h>
+#include <blksnap/Service.h>
+#include <blksnap/Session.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
+#include "helpers/RandomHelper.h"
+#include "helpers/TestReport.h"
+
+namespace po = boost::program_options;
+
+/*
+ * Overwrites the first block of the randomly selected chunks of the region,
+ * so the whole chunks are copied to the difference storage.
+ */
+static void MakeCoverage(const std::shared_ptr<CBlockDevice>& ptrOriginal, const off_t regionSize,
+                         const off_t chunkStride, const unsigned int coverage)
+{
+    std::vector<off_t> chunks;
+    size_t blockSize = ptrOriginal->BlockSize();
+    AlignedBuffer<char> buf(blockSize);
+
+    for (off_t offset = 0; (offset + chunkStride) <= regionSize; offset += chunkStride)
+        chunks.push_back(offset);
+    std::shuffle(chunks.begin(), chunks.end(), std::mt19937_64(std::rand()));
+    chunks.resize(chunks.size() * coverage / 100);
+
+    CRandomHelper::GenerateBuffer(buf.Data(), blockSize);
+    for (off_t offset : chunks)
+        ptrOriginal->Write(buf.Data(), blockSize, offset);
+
+    logger.Info("overwritten chunks: " + std::to_string(chunks.size()));
+}
+
+/*
+ * The latencies of the reads are collected by the device into the I/O
+ * statistics of the result.
+ */
+static void ReadImage(const std::shared_ptr<CBlockDevice>& ptrImage, const off_t regionSize, const bool isSequential,
+                      const size_t blockSize, const unsigned int queueDepth, const unsigned int durationSec,
+                      CTestResult& result)
+{
+    const off_t blockCount = regionSize / blockSize;
+    std::atomic<off_t> nextBlock(0);
+    std::atomic<bool> isStop(false);
+    std::vector<std::exception_ptr> errors(queueDepth);
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(durationSec);
+
+    if (!blockCount)
+        throw std::runtime_error("The region is too small for the test.");
+
+    result.Set("pattern", isSequential ? "seq" : "rand").Set("block_size", blockSize).Set("queue_depth", queueDepth);
+
+    CTestReport::Measure(result.Io(), *ptrImage, [&]() {
+        std::vector<std::thread> threads;
+
+        for (unsigned int inx = 0; inx < queueDepth; inx++)
+        {
+            threads.emplace_back([&, inx]() {
+                try
+                {
+                    AlignedBuffer<char> buf(blockSize);
+                    std::mt19937_64 rnd(std::rand() + inx);
+
+                    while (!isStop && (std::chrono::steady_clock::now() < deadline))
+                    {
+                        off_t block = isSequential ? (nextBlock++ % blockCount) : (rnd() % blockCount);
+
+                        ptrImage->Read(buf.Data(), blockSize, block * blockSize);
+                    }
+                }
+                catch (...)
+                {
+                    errors[inx] = std::current_exception();
+                    isStop = true;
+                }
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+    });
+
+    for (const std::exception_ptr& error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}
+
+void CheckImageRead(const std::string& device, const std::string& diffStorage,
+                    const unsigned long long diffStorageLimit, const off_t regionSize, const off_t chunkStride,
+                    const unsigned int durationSec, const std::vector<unsigned int>& coverages,
+                    const std::vector<size_t>& blockSizes, const std::vector<unsigned int>& queueDepths,
+                    const std::string& jsonFile)
+{
+    CTestReport report("image_read");
+    std::string errorMessage;
+
+    logger.Info("--- Test: check image read performance ---");
+    logger.Info("device: " + device);
+    logger.Info("diffStorage: " + diffStorage);
+    logger.Info("diffStorageLimit: " + std::to_string(diffStorageLimit) + " bytes");
+
+    auto ptrOriginal = std::make_shared<CBlockDevice>(device);
+    off_t region = std::min(regionSize, ptrOriginal->Size());
+    logger.Info("device size: " + std::to_string(ptrOriginal->Size()));
+    logger.Info("tested region size: " + std::to_string(region));
+
+    report.SetParameter("device", device);
+    report.SetParameter("region", std::to_string(region));
+    report.SetParameter("chunk", std::to_string(chunkStride));
+    report.SetParameter("duration", std::to_string(durationSec));
+
+    std::vector<std::string> devices;
+    devices.push_back(device);
+
+    for (unsigned int coverage : coverages)
+    {
+        logger.Info("-- coverage " + std::to_string(coverage) + "%");
+
+        auto ptrSession = blksnap::ISession::Create(devices, diffStorage, diffStorageLimit);
+        auto ptrCbt = blksnap::ICbt::Create(device);
+
+        MakeCoverage(ptrOriginal, region, chunkStride, coverage);
+
+        std::string imageDevName = ptrCbt->GetImage();
+        logger.Info("Found image block device [" + imageDevName + "]");
+        auto ptrImage = std::make_shared<CBlockDevice>(imageDevName);
+
+        for (bool isSequential : {true, false})
+        {
+            for (size_t blockSize : blockSizes)
+            {
+                for (unsigned int queueDepth : queueDepths)
+                {
+                    CTestResult& result = report.AddResult();
+
+                    result.Set("coverage", coverage);
+                    ReadImage(ptrImage, region, isSequential, blockSize, queueDepth, durationSec, result);
+                    logger.Info("coverage=" + std::to_string(coverage) + "% " + (isSequential ? "seq" : "rand")
+                                + " bs=" + std::to_string(blockSize) + " qd=" + std::to_string(queueDepth) + ": "
+                                + result.Io()->ToString());
+                }
+            }
+        }
+
+        std::string sessionError;
+        if (ptrSession->GetError(sessionError))
+        {
+            logger.Err("Snapshot failed: " + sessionError);
+            errorMessage = "Snapshot failed: " + sessionError;
+        }
+    }
+
+    report.Save(jsonFile, errorMessage);
+
+    if (!errorMessage.empty())
+        throw std::runtime_error("--- Failed: check image read performance ---");
+
+    logger.Info("--- Success: check image read performance ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the read performance of the snapshot image with the different part of the chunks in the difference storage.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("device,d", po::value<std::string>(), "Device name. ")
+        ("diff_storage,s", po::value<std::string>(),
+            "Directory name for allocating diff storage files.")
+        ("diff_storage_limit,L", po::value<unsigned int>()->default_value(4096),
+            "The limit of the diff storage in MiB.")
+        ("region,r", po::value<unsigned int>()->default_value(1024),
+            "The size of the tested region at the beginning of the device in MiB.")
+        ("chunk,c", po::value<unsigned int>()->default_value(1024),
+            "The chunk size of the module in KiB. The first block of the chunk is overwritten to copy it to the diff storage.")
+        ("coverage,C", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The percents of the chunks that are overwritten after the snapshot is taken. By default, 0, 10, 50 and 100 are tested.")
+        ("block_size,b", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The sizes of the read I/O units in KiB. By default, 4, 64 and 1024 are tested.")
+        ("queue_depth,q", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The numbers of I/O in flight. By default, 1, 8 and 32 are tested.")
+        ("duration,t", po::value<unsigned int>()->default_value(10), "The duration of each test in seconds.")
+        ("json,j", po::value<std::string>(), "The file for the results in JSON format. By default, the results are written to the log.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    if (!vm.count("device"))
+        throw std::invalid_argument("Argument 'device' is missed.");
+    std::string origDevName = vm["device"].as<std::string>();
+
+    if (!vm.count("diff_storage"))
+        throw std::invalid_argument("Argument 'diff_storage' is missed.");
+    std::string diffStorage = vm["diff_storage"].as<std::string>();
+
+    unsigned long long diffStorageLimit = static_cast<unsigned long long>(vm["diff_storage_limit"].as<unsigned int>()) << 20;
+    off_t regionSize = static_cast<off_t>(vm["region"].as<unsigned int>()) << 20;
+    off_t chunkStride = static_cast<off_t>(vm["chunk"].as<unsigned int>()) << 10;
+    unsigned int duration = vm["duration"].as<unsigned int>();
+    if (!regionSize || !chunkStride || !duration)
+        throw std::invalid_argument("The arguments 'region', 'chunk' and 'duration' cannot be zero.");
+
+    std::vector<unsigned int> coverages = {0, 10, 50, 100};
+    if (vm.count("coverage"))
+        coverages = vm["coverage"].as<std::vector<unsigned int>>();
+    for (unsigned int coverage : coverages)
+        if (coverage > 100)
+            throw std::invalid_argument("Argument 'coverage' cannot be greater than 100.");
+
+    std::vector<size_t> blockSizes = {4096, 64 * 1024, 1024 * 1024};
+    if (vm.count("block_size"))
+    {
+        blockSizes.clear();
+        for (unsigned int blockSize : vm["block_size"].as<std::vector<unsigned int>>())
+        {
+            if (!blockSize)
+                throw std::invalid_argument("Argument 'block_size' cannot be zero.");
+            blockSizes.push_back(static_cast<size_t>(blockSize) << 10);
+        }
+    }
+
+    std::vector<unsigned int> queueDepths = {1, 8, 32};
+    if (vm.count("queue_depth"))
+        queueDepths = vm["queue_depth"].as<std::vector<unsigned int>>();
+    for (unsigned int queueDepth : queueDepths)
+        if (!queueDepth)
+            throw std::invalid_argument("Argument 'queue_depth' cannot be zero.");
+
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
+    std::srand(std::time(0));
+    CheckImageRead(origDevName, diffStorage, diffStorageLimit, regionSize, chunkStride, duration, coverages,
+                   blockSizes, queueDepths, jsonFile);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
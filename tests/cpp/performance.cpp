@@ -1,6 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0+
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
+#include <random>
+#include <thread>
 #include <blksnap/Service.h>
 #include <blksnap/Session.h>
 #include <boost/program_options.hpp>
@@ -13,21 +17,245 @@
 #include "helpers/BlockDevice.h"
 #include "helpers/Log.h"
 #include "helpers/RandomHelper.h"
+#include "helpers/TestReport.h"
 #include "TestSector.h"
 
 namespace po = boost::program_options;
 using blksnap::sector_t;
 using blksnap::SRange;
 
-void CheckPerformance(const std::string& device, const std::string& diffStorage)
+/*
+ * The write pattern of the test. The reads of the mixed pattern are random
+ * across the whole region, and they are not affected by the phase.
+ */
+struct SPattern
 {
-    bool isErrorFound = false;
+    std::string name;
+    size_t ioSize;
+    bool isSequential;
+    unsigned int readPercent;
+};
+
+static const std::vector<SPattern> patterns = {
+    {"rand4k", 4096, false, 0},
+    {"rand64k", 64 * 1024, false, 0},
+    {"seq1m", 1024 * 1024, true, 0},
+    {"mixed4k", 4096, false, 70},
+};
+
+/*
+ * The phases of the test:
+ *  no_snapshot - the writes to the original device without the snapshot;
+ *  cow_first - each write touches the chunk that was not copied yet;
+ *  cow_done - the writes to the chunks that were already copied.
+ */
+enum class EPhase
+{
+    NoSnapshot,
+    CowFirst,
+    CowDone
+};
+
+static const char* phaseName(const EPhase phase)
+{
+    switch (phase)
+    {
+    case EPhase::NoSnapshot:
+        return "no_snapshot";
+    case EPhase::CowFirst:
+        return "cow_first";
+    default:
+        return "cow_done";
+    }
+}
+
+class CPerformanceTest
+{
+public:
+    CPerformanceTest(const std::shared_ptr<CBlockDevice>& ptrDevice, const off_t regionSize,
+                     const off_t chunkStride, const unsigned int durationSec)
+        : m_ptrDevice(ptrDevice)
+        , m_regionSize(regionSize)
+        , m_chunkStride(chunkStride)
+        , m_durationSec(durationSec)
+    {};
+
+    /*
+     * The slots are the offsets of the writes for the phases with the
+     * snapshot. The distance between the slots is not less than the chunk
+     * size, so each slot belongs to its own chunk.
+     */
+    void PrepareSlots(const SPattern& pattern)
+    {
+        off_t stride = std::max(static_cast<off_t>(pattern.ioSize), m_chunkStride);
+
+        m_slots.clear();
+        for (off_t offset = 0; (offset + static_cast<off_t>(pattern.ioSize)) <= m_regionSize; offset += stride)
+            m_slots.push_back(offset);
+
+        if (!pattern.isSequential)
+            std::shuffle(m_slots.begin(), m_slots.end(), std::mt19937_64(std::rand()));
+        m_touchedSlots = 0;
+    };
+
+    /*
+     * The latencies of the reads and the writes are collected by the device
+     * into the I/O statistics of the result.
+     */
+    void Run(const SPattern& pattern, const unsigned int queueDepth, const EPhase phase, CTestResult& result)
+    {
+        std::atomic<size_t> nextSlot(0);
+        std::atomic<off_t> nextOffset(0);
+        std::atomic<bool> isStop(false);
+        std::vector<std::exception_ptr> errors(queueDepth);
+        const size_t slotCount = (phase == EPhase::CowDone) ? m_touchedSlots : m_slots.size();
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(m_durationSec);
+
+        if ((phase != EPhase::NoSnapshot) && !slotCount)
+            throw std::runtime_error("The region is too small for the test.");
+
+        /*
+         * Returns the offset of the next write, or -1 if all slots of the
+         * phase have been written.
+         */
+        auto nextWriteOffset = [&](std::mt19937_64& rnd) -> off_t {
+            if (phase == EPhase::NoSnapshot)
+            {
+                if (!pattern.isSequential)
+                    return (rnd() % (m_regionSize / pattern.ioSize)) * pattern.ioSize;
+
+                off_t offset = nextOffset.fetch_add(pattern.ioSize);
+                return offset % (m_regionSize - (m_regionSize % pattern.ioSize));
+            }
+
+            size_t inx = nextSlot++;
+            if (phase == EPhase::CowFirst)
+                return (inx < slotCount) ? m_slots[inx] : -1;
+
+            if (pattern.isSequential)
+                return m_slots[inx % slotCount];
+            return m_slots[rnd() % slotCount];
+        };
+
+        result.Set("pattern", pattern.name).Set("queue_depth", queueDepth).Set("phase", phaseName(phase));
+
+        CTestReport::Measure(result.Io(), *m_ptrDevice, [&]() {
+            std::vector<std::thread> threads;
+
+            for (unsigned int inx = 0; inx < queueDepth; inx++)
+            {
+                threads.emplace_back([&, inx]() {
+                    try
+                    {
+                        AlignedBuffer<char> buf(pattern.ioSize);
+                        std::mt19937_64 rnd(std::rand() + inx);
+
+                        CRandomHelper::GenerateBuffer(buf.Data(), pattern.ioSize);
+                        while (!isStop && (std::chrono::steady_clock::now() < deadline))
+                        {
+                            bool isRead = pattern.readPercent && ((rnd() % 100) < pattern.readPercent);
+                            off_t offset = isRead ? (rnd() % (m_regionSize / pattern.ioSize)) * pattern.ioSize
+                                                  : nextWriteOffset(rnd);
+                            if (offset < 0)
+                            {
+                                isStop = true;
+                                break;
+                            }
+
+                            if (isRead)
+                                m_ptrDevice->Read(buf.Data(), pattern.ioSize, offset);
+                            else
+                                m_ptrDevice->Write(buf.Data(), pattern.ioSize, offset);
+                        }
+                    }
+                    catch (...)
+                    {
+                        errors[inx] = std::current_exception();
+                        isStop = true;
+                    }
+                });
+            }
+            for (std::thread& thread : threads)
+                thread.join();
+        });
+
+        for (const std::exception_ptr& error : errors)
+            if (error)
+                std::rethrow_exception(error);
+
+        if (phase == EPhase::CowFirst)
+            m_touchedSlots = std::min(nextSlot.load(), slotCount);
+
+        logger.Info(pattern.name + " qd=" + std::to_string(queueDepth) + " " + phaseName(phase) + ": "
+                    + result.Io()->ToString());
+    };
+
+private:
+    std::shared_ptr<CBlockDevice> m_ptrDevice;
+    off_t m_regionSize;
+    off_t m_chunkStride;
+    unsigned int m_durationSec;
+    std::vector<off_t> m_slots;
+    size_t m_touchedSlots;
+};
+
+void CheckPerformance(const std::string& device, const std::string& diffStorage,
+                      const unsigned long long diffStorageLimit, const off_t regionSize, const off_t chunkStride,
+                      const unsigned int durationSec, const std::vector<unsigned int>& queueDepths,
+                      const std::string& jsonFile)
+{
+    CTestReport report("performance");
+    std::string errorMessage;
 
     logger.Info("--- Test: check performance ---");
+    logger.Info("device: " + device);
+    logger.Info("diffStorage: " + diffStorage);
+    logger.Info("diffStorageLimit: " + std::to_string(diffStorageLimit) + " bytes");
+
+    auto ptrDevice = std::make_shared<CBlockDevice>(device);
+    off_t region = std::min(regionSize, ptrDevice->Size());
+    logger.Info("device size: " + std::to_string(ptrDevice->Size()));
+    logger.Info("tested region size: " + std::to_string(region));
+
+    std::vector<std::string> devices;
+    devices.push_back(device);
 
-    throw std::runtime_error("Is not implemented yet.");
+    report.SetParameter("device", device);
+    report.SetParameter("region", std::to_string(region));
+    report.SetParameter("chunk", std::to_string(chunkStride));
+    report.SetParameter("duration", std::to_string(durationSec));
 
-    if (isErrorFound)
+    CPerformanceTest test(ptrDevice, region, chunkStride, durationSec);
+    for (const SPattern& pattern : patterns)
+    {
+        for (unsigned int queueDepth : queueDepths)
+        {
+            logger.Info("-- " + pattern.name + " queue depth " + std::to_string(queueDepth));
+
+            test.Run(pattern, queueDepth, EPhase::NoSnapshot, report.AddResult());
+
+            /*
+             * Each combination uses its own snapshot, so the chunks are not
+             * copied by the previous tests.
+             */
+            test.PrepareSlots(pattern);
+            auto ptrSession = blksnap::ISession::Create(devices, diffStorage, diffStorageLimit);
+
+            test.Run(pattern, queueDepth, EPhase::CowFirst, report.AddResult());
+            test.Run(pattern, queueDepth, EPhase::CowDone, report.AddResult());
+
+            std::string sessionError;
+            if (ptrSession->GetError(sessionError))
+            {
+                logger.Err("Snapshot failed: " + sessionError);
+                errorMessage = "Snapshot failed: " + sessionError;
+            }
+        }
+    }
+
+    report.Save(jsonFile, errorMessage);
+
+    if (!errorMessage.empty())
         throw std::runtime_error("--- Failed: check performance ---");
 
     logger.Info("--- Success: check performance ---");
@@ -43,7 +271,17 @@ void Main(int argc, char* argv[])
         ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
         ("device,d", po::value<std::string>(), "Device name. ")
         ("diff_storage,s", po::value<std::string>(),
-            "Directory name for allocating diff storage files.");
+            "Directory name for allocating diff storage files.")
+        ("diff_storage_limit,L", po::value<unsigned int>()->default_value(4096),
+            "The limit of the diff storage in MiB.")
+        ("region,r", po::value<unsigned int>()->default_value(1024),
+            "The size of the tested region at the beginning of the device in MiB.")
+        ("chunk,c", po::value<unsigned int>()->default_value(1024),
+            "The distance between the writes of the phases with the snapshot in KiB. It should not be less than the chunk size of the module.")
+        ("duration,t", po::value<unsigned int>()->default_value(10), "The duration of each test in seconds.")
+        ("queue_depth,q", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The numbers of I/O in flight. By default, 1, 8 and 32 are tested.")
+        ("json,j", po::value<std::string>(), "The file for the results in JSON format. By default, the results are written to the log.");
     po::variables_map vm;
     po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
     po::store(parsed, vm);
@@ -70,8 +308,27 @@ void Main(int argc, char* argv[])
         throw std::invalid_argument("Argument 'diff_storage' is missed.");
     std::string diffStorage = vm["diff_storage"].as<std::string>();
 
+    unsigned long long diffStorageLimit = static_cast<unsigned long long>(vm["diff_storage_limit"].as<unsigned int>()) << 20;
+    off_t regionSize = static_cast<off_t>(vm["region"].as<unsigned int>()) << 20;
+    off_t chunkStride = static_cast<off_t>(vm["chunk"].as<unsigned int>()) << 10;
+    unsigned int duration = vm["duration"].as<unsigned int>();
+    if (!regionSize || !chunkStride || !duration)
+        throw std::invalid_argument("The arguments 'region', 'chunk' and 'duration' cannot be zero.");
+
+    std::vector<unsigned int> queueDepths = {1, 8, 32};
+    if (vm.count("queue_depth"))
+        queueDepths = vm["queue_depth"].as<std::vector<unsigned int>>();
+    for (unsigned int queueDepth : queueDepths)
+        if (!queueDepth)
+            throw std::invalid_argument("Argument 'queue_depth' cannot be zero.");
+
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
     std::srand(std::time(0));
-    CheckPerformance(origDevName, diffStorage);
+    CheckPerformance(origDevName, diffStorage, diffStorageLimit, regionSize, chunkStride, duration, queueDepths,
+                     jsonFile);
 }
 
 int main(int argc, char* argv[])
@@ -0,0 +1,397 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <blksnap/Sector.h>
+#include <blksnap/Session.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
+#include "helpers/RandomHelper.h"
+#include "helpers/TestReport.h"
+#include "TraceFile.h"
+
+namespace po = boost::program_options;
+using clock_type = std::chrono::steady_clock;
+
+void ImportTrace(const std::string& inputFile, const std::string& traceFile)
+{
+    CTraceImporter importer;
+    std::ifstream input;
+    std::string line;
+
+    logger.Info("--- Import blkparse output ---");
+    if (inputFile != "-")
+    {
+        input.open(inputFile);
+        if (!input.is_open())
+            throw std::runtime_error("Failed to open file '" + inputFile + "'.");
+    }
+
+    std::istream& stream = (inputFile == "-") ? std::cin : input;
+    while (std::getline(stream, line))
+        importer.AddLine(line);
+
+    importer.Save(traceFile);
+    logger.Info(std::to_string(importer.Count()) + " writes were saved to '" + traceFile + "', "
+                + std::to_string(importer.Skipped()) + " lines were skipped");
+}
+
+/*
+ * The requests are recorded by the blktrace, so the blktrace and the
+ * blkparse tools should be installed and the debugfs should be mounted.
+ */
+void RecordTrace(const std::string& device, const unsigned int durationSec, const std::string& traceFile)
+{
+    CTraceImporter importer;
+    std::string command =
+      "blktrace -d '" + device + "' -w " + std::to_string(durationSec) + " -o - | blkparse -q -i -";
+    char buffer[4096];
+
+    logger.Info("--- Record the writes to [" + device + "] for " + std::to_string(durationSec) + " seconds ---");
+    FILE* pipe = ::popen(command.c_str(), "r");
+    if (!pipe)
+        throw std::system_error(errno, std::generic_category(), "Failed to run '" + command + "'.");
+
+    std::string line;
+    while (::fgets(buffer, sizeof(buffer), pipe))
+    {
+        line += buffer;
+        if (line.back() != '\n')
+            continue;
+        importer.AddLine(line);
+        line.clear();
+    }
+
+    int status = ::pclose(pipe);
+    if (status)
+        throw std::runtime_error("The command '" + command + "' failed with status " + std::to_string(status) + ".");
+
+    importer.Save(traceFile);
+    logger.Info(std::to_string(importer.Count()) + " writes were saved to '" + traceFile + "'");
+}
+
+/*
+ * The space allocated for the difference storage file. If the difference
+ * storage is a directory, the module creates an unnamed file in it, so only
+ * the space used on the whole file system can be measured.
+ */
+static unsigned long long usedBytes(const std::string& path)
+{
+    struct stat st;
+
+    if (::stat(path.c_str(), &st))
+        return 0;
+    if (!S_ISDIR(st.st_mode))
+        return static_cast<unsigned long long>(st.st_blocks) << SECTOR_SHIFT;
+
+    struct statvfs stfs;
+
+    if (::statvfs(path.c_str(), &stfs))
+        return 0;
+    return static_cast<unsigned long long>(stfs.f_blocks - stfs.f_bfree) * stfs.f_frsize;
+}
+
+/*
+ * Re-issues the writes of the trace to the device. Each thread takes the
+ * next request, waits for its time and writes it synchronously, so the
+ * number of the threads limits the requests in flight. The requests that
+ * are beyond the end of the device are wrapped around.
+ */
+class CReplay
+{
+public:
+    CReplay(const std::shared_ptr<CBlockDevice>& ptrDevice, const std::vector<STraceRecord>& records,
+            const unsigned int threadCount, const bool isFast, const size_t blksz)
+        : m_ptrDevice(ptrDevice)
+        , m_records(records)
+        , m_threadCount(threadCount)
+        , m_isFast(isFast)
+        , m_blksz(blksz)
+        , m_maxSize(blksz)
+    {
+        for (const STraceRecord& record : m_records)
+            m_maxSize = std::max(m_maxSize, AlignUp(static_cast<size_t>(record.count) << SECTOR_SHIFT));
+        m_maxSize = std::min(m_maxSize, static_cast<size_t>(m_ptrDevice->Size()) & ~(m_blksz - 1));
+    };
+
+    void Run(const std::string& diffStorage, CTestResult& result)
+    {
+        std::atomic<size_t> nextRecord(0);
+        std::atomic<bool> isStop(false);
+        std::vector<std::thread> threads;
+        std::vector<unsigned long long> lateCounts(m_threadCount, 0);
+        std::vector<std::exception_ptr> errors(m_threadCount);
+        unsigned long long diffStorageGrowth = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> diffStorageSeries;
+        const auto start = clock_type::now() + std::chrono::milliseconds(10);
+
+        std::thread sampler;
+        if (!diffStorage.empty())
+        {
+            sampler = std::thread([&] {
+                const unsigned long long initialUsed = usedBytes(diffStorage);
+
+                while (!isStop)
+                {
+                    unsigned long long used = usedBytes(diffStorage);
+                    unsigned long long growth = (used > initialUsed) ? (used - initialUsed) : 0;
+                    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - start);
+
+                    diffStorageGrowth = std::max(diffStorageGrowth, growth);
+                    diffStorageSeries.emplace_back(std::max<long long>(0, elapsed.count()), growth);
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+            });
+        }
+
+        CTestReport::Measure(result.Io(), *m_ptrDevice, [&]() {
+            for (unsigned int inx = 0; inx < m_threadCount; inx++)
+            {
+                threads.emplace_back([&, inx] {
+                    try
+                    {
+                        AlignedBuffer<char> buf(m_blksz, m_maxSize);
+                        const off_t deviceSize = m_ptrDevice->Size();
+                        size_t recordInx;
+
+                        CRandomHelper::GenerateBuffer(buf.Data(), m_maxSize, inx);
+                        while (!isStop && ((recordInx = nextRecord++) < m_records.size()))
+                        {
+                            const STraceRecord& record = m_records[recordInx];
+                            const size_t size = std::min(m_maxSize, AlignUp(static_cast<size_t>(record.count) << SECTOR_SHIFT));
+                            off_t offset = static_cast<off_t>(record.sector) << SECTOR_SHIFT;
+
+                            offset %= (deviceSize - size + 1);
+                            offset &= ~static_cast<off_t>(m_blksz - 1);
+
+                            if (!m_isFast)
+                            {
+                                const auto scheduled = start + std::chrono::nanoseconds(record.timeNs);
+
+                                std::this_thread::sleep_until(scheduled);
+                                if ((clock_type::now() - scheduled) > std::chrono::milliseconds(1))
+                                    lateCounts[inx]++;
+                            }
+
+                            m_ptrDevice->Write(buf.Data(), size, offset);
+                        }
+                    }
+                    catch (...)
+                    {
+                        errors[inx] = std::current_exception();
+                        isStop = true;
+                    }
+                });
+            }
+            for (std::thread& thread : threads)
+                thread.join();
+        });
+
+        isStop = true;
+        if (sampler.joinable())
+            sampler.join();
+
+        for (const std::exception_ptr& error : errors)
+            if (error)
+                std::rethrow_exception(error);
+
+        unsigned long long lateCount = 0;
+        for (unsigned long long threadLateCount : lateCounts)
+            lateCount += threadLateCount;
+        result.Set("late", lateCount);
+        if (!diffStorage.empty())
+            result.Set("diff_storage_growth", diffStorageGrowth).SetSeries("diff_storage_series", diffStorageSeries);
+
+        std::stringstream ss;
+        ss << lateCount << " late, " << result.Io()->ToString();
+        if (!diffStorage.empty())
+            ss << ", diff storage growth " << diffStorageGrowth << " bytes";
+        logger.Info(ss);
+    };
+
+private:
+    size_t AlignUp(const size_t size) const
+    {
+        return (size + m_blksz - 1) & ~(m_blksz - 1);
+    };
+
+private:
+    std::shared_ptr<CBlockDevice> m_ptrDevice;
+    const std::vector<STraceRecord>& m_records;
+    unsigned int m_threadCount;
+    bool m_isFast;
+    size_t m_blksz;
+    size_t m_maxSize;
+};
+
+void ReplayTrace(const std::string& device, const std::string& traceFile, const std::string& diffStorage,
+                 const unsigned long long diffStorageLimit, const unsigned int threadCount, const bool isFast,
+                 const size_t blksz, const std::string& jsonFile)
+{
+    CTestReport report("replay");
+    std::string errorMessage;
+
+    logger.Info("--- Test: replay trace ---");
+    logger.Info("device: " + device);
+    logger.Info("trace: " + traceFile);
+    logger.Info("diffStorage: " + diffStorage);
+    logger.Info("diffStorageLimit: " + std::to_string(diffStorageLimit) + " bytes");
+    report.SetParameter("device", device);
+    report.SetParameter("trace", traceFile);
+    report.SetParameter("timing", isFast ? "fast" : "original");
+
+    std::vector<STraceRecord> records = LoadTrace(traceFile);
+    logger.Info("records: " + std::to_string(records.size()));
+    if (!records.empty())
+        logger.Info("trace duration: " + std::to_string(records.back().timeNs / 1000000) + " ms");
+
+    auto ptrDevice = std::make_shared<CBlockDevice>(device);
+    logger.Info("device size: " + std::to_string(ptrDevice->Size()));
+
+    CReplay replay(ptrDevice, records, threadCount, isFast, blksz);
+
+    logger.Info("-- Replay without snapshot");
+    CTestResult& noSnapshot = report.AddResult();
+    noSnapshot.Set("phase", "no_snapshot");
+    replay.Run("", noSnapshot);
+
+    {
+        std::vector<std::string> devices;
+        devices.push_back(device);
+
+        logger.Info("-- Replay with snapshot");
+        auto ptrSession = blksnap::ISession::Create(devices, diffStorage, diffStorageLimit);
+
+        CTestResult& snapshot = report.AddResult();
+        snapshot.Set("phase", "snapshot");
+        replay.Run(diffStorage, snapshot);
+
+        const CLatencyHistogram& baseline = noSnapshot.Io()->WriteLatency();
+        const CLatencyHistogram& latency = snapshot.Io()->WriteLatency();
+        snapshot.Set("cow_p50_us", (static_cast<double>(latency.Percentile(50)) - baseline.Percentile(50)) / 1000)
+          .Set("cow_p99_us", (static_cast<double>(latency.Percentile(99)) - baseline.Percentile(99)) / 1000);
+
+        std::string message;
+        while (ptrSession->GetError(message))
+        {
+            logger.Err("Snapshot failed: " + message);
+            errorMessage = message;
+        }
+    }
+
+    report.Save(jsonFile, errorMessage);
+    if (!errorMessage.empty())
+        throw std::runtime_error("--- Failed: replay trace ---");
+    logger.Info("--- Success: replay trace ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Recording the writes to the block device and replaying them with the snapshot.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("trace,t", po::value<std::string>(), "The trace file.")
+        ("record,r", po::value<std::string>(),
+            "Record the writes to the device with the blktrace to the trace file.")
+        ("duration,u", po::value<unsigned int>()->default_value(60), "The recording duration in seconds.")
+        ("import,i", po::value<std::string>(),
+            "Import the output of the blkparse to the trace file. Use '-' to read the standard input.")
+        ("device,d", po::value<std::string>(), "The device to replay the trace to. Its content is overwritten.")
+        ("diff_storage,s", po::value<std::string>(),
+            "The name of the file to allocate the difference storage.")
+        ("diff_storage_limit,L", po::value<unsigned int>()->default_value(4096),
+            "The limit of the diff storage in MiB.")
+        ("threads,q", po::value<unsigned int>()->default_value(32),
+            "The number of threads that replay the writes, it limits the writes in flight.")
+        ("fast,f", "Replay the writes as fast as possible instead of the original timing.")
+        ("blksz", po::value<int>()->default_value(512), "Align reads and writes to the block size.")
+        ("json,j", po::value<std::string>(), "The file for the results in JSON format. By default, the results are written to the log.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    if (!vm.count("trace"))
+        throw std::invalid_argument("Argument 'trace' is missed.");
+    std::string traceFile = vm["trace"].as<std::string>();
+
+    if (vm.count("record"))
+    {
+        RecordTrace(vm["record"].as<std::string>(), vm["duration"].as<unsigned int>(), traceFile);
+        return;
+    }
+    if (vm.count("import"))
+    {
+        ImportTrace(vm["import"].as<std::string>(), traceFile);
+        return;
+    }
+
+    if (!vm.count("device"))
+        throw std::invalid_argument("Argument 'device' is missed.");
+    std::string device = vm["device"].as<std::string>();
+
+    if (!vm.count("diff_storage"))
+        throw std::invalid_argument("Argument 'diff_storage' is missed.");
+    std::string diffStorage = vm["diff_storage"].as<std::string>();
+
+    unsigned long long diffStorageLimit = static_cast<unsigned long long>(vm["diff_storage_limit"].as<unsigned int>()) << 20;
+
+    unsigned int threadCount = vm["threads"].as<unsigned int>();
+    if (!threadCount)
+        throw std::invalid_argument("Argument 'threads' cannot be zero.");
+
+    int blksz = vm["blksz"].as<int>();
+    if ((blksz < SECTOR_SIZE) || (blksz & (blksz - 1)))
+        throw std::invalid_argument("Argument 'blksz' should be a power of two and not less than the sector size.");
+
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
+    ReplayTrace(device, traceFile, diffStorage, diffStorageLimit, threadCount, !!vm.count("fast"), blksz, jsonFile);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,334 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <blksnap/Service.h>
+#include <blksnap/Snapshot.h>
+#include <blksnap/Tracker.h>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "helpers/AlignedBuffer.hpp"
+#include "helpers/BlockDevice.h"
+#include "helpers/Log.h"
+#include "helpers/LoopDevice.h"
+#include "helpers/RandomHelper.h"
+#include "helpers/TestReport.h"
+
+namespace po = boost::program_options;
+using clock_type = std::chrono::steady_clock;
+
+/*
+ * Writes the blocks to the random offsets of the device until it is stopped,
+ * and records the time of the start and the end of each write.
+ */
+class CWriter
+{
+public:
+    CWriter(const std::string& devicePath)
+        : m_ptrDevice(std::make_shared<CBlockDevice>(devicePath))
+        , m_isStop(false)
+    {};
+
+    void Start()
+    {
+        m_ios.clear();
+        m_isStop = false;
+        m_thread = std::thread(&CWriter::Worker, this);
+    };
+
+    void Stop()
+    {
+        m_isStop = true;
+        if (m_thread.joinable())
+            m_thread.join();
+        if (m_error)
+            std::rethrow_exception(m_error);
+    };
+
+    /*
+     * Returns the longest write that was in progress while the snapshot
+     * was being taken, and collects the latencies of the other writes.
+     */
+    double StallUs(const clock_type::time_point takeStart, const clock_type::time_point takeEnd,
+                   CLatencyHistogram& baseline) const
+    {
+        double stall = 0;
+
+        for (const auto& io : m_ios)
+        {
+            if ((io.first < takeEnd) && (io.second > takeStart))
+                stall = std::max(stall, std::chrono::duration<double, std::micro>(io.second - io.first).count());
+            else
+                baseline.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(io.second - io.first).count());
+        }
+        return stall;
+    };
+
+private:
+    void Worker()
+    {
+        try
+        {
+            const size_t blockSize = 4096;
+            const off_t blockCount = m_ptrDevice->Size() / blockSize;
+            AlignedBuffer<char> buf(blockSize);
+            std::mt19937_64 rnd(std::rand());
+
+            CRandomHelper::GenerateBuffer(buf.Data(), blockSize);
+            while (!m_isStop)
+            {
+                const auto start = clock_type::now();
+                m_ptrDevice->Write(buf.Data(), blockSize, (rnd() % blockCount) * blockSize);
+                m_ios.emplace_back(start, clock_type::now());
+            }
+        }
+        catch (...)
+        {
+            m_error = std::current_exception();
+        }
+    };
+
+private:
+    std::shared_ptr<CBlockDevice> m_ptrDevice;
+    std::atomic<bool> m_isStop;
+    std::thread m_thread;
+    std::exception_ptr m_error;
+    std::vector<std::pair<clock_type::time_point, clock_type::time_point>> m_ios;
+};
+
+void TakeOnce(const std::vector<LoopDevice::Ptr>& loops, std::vector<std::shared_ptr<CWriter>>& writers,
+              const std::string& diffStorage, const unsigned long long diffStorageLimit, const unsigned int settleMs,
+              CTestResult& result)
+{
+    auto ptrSnapshot = blksnap::CSnapshot::Create(diffStorage, diffStorageLimit);
+
+    try
+    {
+        for (const auto& loop : loops)
+        {
+            blksnap::CTracker tracker(loop->GetDevice().string());
+
+            tracker.Attach();
+            tracker.SnapshotAdd(ptrSnapshot->Id().Get());
+        }
+
+        for (auto& writer : writers)
+            writer->Start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(settleMs));
+
+        const auto takeStart = clock_type::now();
+        ptrSnapshot->Take();
+        const auto takeEnd = clock_type::now();
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(settleMs));
+        for (auto& writer : writers)
+            writer->Stop();
+
+        const double takeUs = std::chrono::duration<double, std::micro>(takeEnd - takeStart).count();
+        CLatencyHistogram& baseline = result.Latency("baseline");
+        double stallMax = 0;
+        double stallSum = 0;
+        for (const auto& writer : writers)
+        {
+            double stall = writer->StallUs(takeStart, takeEnd, baseline);
+
+            stallMax = std::max(stallMax, stall);
+            stallSum += stall;
+        }
+        const double stallAvg = writers.empty() ? 0 : stallSum / writers.size();
+        result.Set("take_us", takeUs).Set("stall_max_us", stallMax).Set("stall_avg_us", stallAvg);
+
+        std::stringstream ss;
+        ss << "take " << takeUs << " us, write stall max " << stallMax << " us, avg " << stallAvg
+           << " us, baseline p99 " << (baseline.Percentile(99) / 1000.0) << " us";
+        logger.Info(ss);
+    }
+    catch (...)
+    {
+        for (auto& writer : writers)
+        {
+            try
+            {
+                writer->Stop();
+            }
+            catch (std::exception&)
+            {}
+        }
+        ptrSnapshot->Destroy();
+        throw;
+    }
+
+    ptrSnapshot->Destroy();
+}
+
+static void detachLoops(const std::vector<LoopDevice::Ptr>& loops)
+{
+    for (const auto& loop : loops)
+    {
+        try
+        {
+            blksnap::CTracker(loop->GetDevice().string()).Detach();
+        }
+        catch (std::exception& ex)
+        {
+            logger.Err(ex.what());
+        }
+    }
+}
+
+void CheckTakeLatency(const std::string& loopDir, const std::string& diffStorage,
+                      const unsigned long long diffStorageLimit, const std::vector<unsigned int>& counts,
+                      const std::vector<size_t>& sizes, const unsigned int iterations, const unsigned int settleMs,
+                      const std::string& jsonFile)
+{
+    CTestReport report("take_latency");
+
+    logger.Info("--- Test: check take latency ---");
+    logger.Info("loopDir: " + loopDir);
+    logger.Info("diffStorage: " + diffStorage);
+    logger.Info("diffStorageLimit: " + std::to_string(diffStorageLimit) + " bytes");
+    report.SetParameter("settle_ms", std::to_string(settleMs));
+
+    for (unsigned int count : counts)
+    {
+        std::vector<LoopDevice::Ptr> loops;
+        unsigned long long totalSize = 0;
+
+        std::vector<std::shared_ptr<CWriter>> writers;
+
+        logger.Info("-- " + std::to_string(count) + " devices");
+        try
+        {
+            for (unsigned int inx = 0; inx < count; inx++)
+            {
+                size_t size = sizes[inx % sizes.size()];
+
+                loops.push_back(LoopDevice::Create(loopDir, size));
+                totalSize += size;
+            }
+
+            for (const auto& loop : loops)
+                writers.push_back(std::make_shared<CWriter>(loop->GetDevice().string()));
+
+            for (unsigned int iteration = 0; iteration < iterations; iteration++)
+            {
+                CTestResult& result = report.AddResult();
+
+                result.Set("devices", count).Set("total_size", totalSize).Set("iteration", iteration);
+                logger.Info("devices=" + std::to_string(count) + " iteration " + std::to_string(iteration));
+                TakeOnce(loops, writers, diffStorage, diffStorageLimit, settleMs, result);
+            }
+        }
+        catch (std::exception& ex)
+        {
+            writers.clear();
+            detachLoops(loops);
+            report.Save(jsonFile, ex.what());
+            throw;
+        }
+
+        writers.clear();
+        detachLoops(loops);
+    }
+
+    report.Save(jsonFile);
+
+    logger.Info("--- Success: check take latency ---");
+}
+
+void Main(int argc, char* argv[])
+{
+    po::options_description desc;
+    std::string usage = std::string("Checking the latency of taking the snapshot depending on the number of devices.");
+
+    desc.add_options()
+        ("help,h", "Show usage information.")
+        ("log,l", po::value<std::string>(),"Detailed log of all transactions.")
+        ("loop_dir,o", po::value<std::string>(),
+            "Directory name for the images of the loop devices.")
+        ("diff_storage,s", po::value<std::string>(),
+            "Directory name for allocating diff storage files.")
+        ("diff_storage_limit,L", po::value<unsigned int>()->default_value(4096),
+            "The limit of the diff storage in MiB.")
+        ("count,n", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The numbers of devices in the snapshot. By default, 1, 8, 32 and 128 are tested.")
+        ("size,z", po::value<std::vector<unsigned int>>()->multitoken(),
+            "The sizes of the loop devices in MiB, they are used in turn. By default, 64, 256 and 1024.")
+        ("iterations,i", po::value<unsigned int>()->default_value(3), "The number of snapshots for each number of devices.")
+        ("settle,t", po::value<unsigned int>()->default_value(500),
+            "The time of writing before and after taking the snapshot in milliseconds.")
+        ("json,j", po::value<std::string>(), "The file for the results in JSON format. By default, the results are written to the log.");
+    po::variables_map vm;
+    po::parsed_options parsed = po::command_line_parser(argc, argv).options(desc).run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    if (vm.count("help"))
+    {
+        std::cout << usage << std::endl;
+        std::cout << desc << std::endl;
+        return;
+    }
+
+    if (vm.count("log"))
+    {
+        std::string filename = vm["log"].as<std::string>();
+        logger.Open(filename);
+    }
+
+    if (!vm.count("loop_dir"))
+        throw std::invalid_argument("Argument 'loop_dir' is missed.");
+    std::string loopDir = vm["loop_dir"].as<std::string>();
+
+    if (!vm.count("diff_storage"))
+        throw std::invalid_argument("Argument 'diff_storage' is missed.");
+    std::string diffStorage = vm["diff_storage"].as<std::string>();
+
+    unsigned long long diffStorageLimit = static_cast<unsigned long long>(vm["diff_storage_limit"].as<unsigned int>()) << 20;
+
+    std::vector<unsigned int> counts = {1, 8, 32, 128};
+    if (vm.count("count"))
+        counts = vm["count"].as<std::vector<unsigned int>>();
+
+    std::vector<size_t> sizes = {64ULL << 20, 256ULL << 20, 1024ULL << 20};
+    if (vm.count("size"))
+    {
+        sizes.clear();
+        for (unsigned int size : vm["size"].as<std::vector<unsigned int>>())
+        {
+            if (!size)
+                throw std::invalid_argument("Argument 'size' cannot be zero.");
+            sizes.push_back(static_cast<size_t>(size) << 20);
+        }
+    }
+
+    std::string jsonFile;
+    if (vm.count("json"))
+        jsonFile = vm["json"].as<std::string>();
+
+    std::srand(std::time(0));
+    CheckTakeLatency(loopDir, diffStorage, diffStorageLimit, counts, sizes, vm["iterations"].as<unsigned int>(),
+                     vm["settle"].as<unsigned int>(), jsonFile);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        Main(argc, argv);
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -2,24 +2,42 @@
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <cstring>
+#include <endian.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <random>
+#include <thread>
 #include <vector>
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/fiemap.h>
+#include <linux/aio_abi.h>
 #include <linux/fs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 #include <linux/blksnap.h>
 #include <time.h>
+#include <blksnap/CbtMap.h>
+#include <blksnap/DiffStorage.h>
+#include <blksnap/DiffStorageAdvisor.h>
 
 namespace po = boost::program_options;
 namespace fs = boost::filesystem;
@@ -33,6 +51,16 @@ namespace fs = boost::filesystem;
 
 namespace
 {
+    static const char* defaultHistoryFile = "/var/lib/blksnap/history";
+
+    /*
+     * In the batch mode, the control and device descriptors are kept open
+     * between the commands.
+     */
+    static bool isKeepDescriptors = false;
+    static int blksnapFdCache = -1;
+    static std::map<std::string, int> deviceFdCache;
+
     class Uuid
     {
     public:
@@ -79,13 +107,22 @@ namespace
         {
             const char* blksnap_filename = "/dev/" BLKSNAP_CTL;
 
+            if (blksnapFdCache >= 0)
+            {
+                m_blksnapFd = blksnapFdCache;
+                return;
+            }
+
             m_blksnapFd = ::open(blksnap_filename, O_RDWR);
             if (m_blksnapFd < 0)
                 throw std::system_error(errno, std::generic_category(), blksnap_filename);
+
+            if (isKeepDescriptors)
+                blksnapFdCache = m_blksnapFd;
         };
         ~CBlksnapFileWrap()
         {
-            if (m_blksnapFd > 0)
+            if ((m_blksnapFd > 0) && (m_blksnapFd != blksnapFdCache))
                 ::close(m_blksnapFd);
         };
         int get() const
@@ -104,14 +141,26 @@ namespace
         CDeviceCtl(const std::string& devicePath)
             : m_fd(0)
         {
+            const auto it = deviceFdCache.find(devicePath);
+            if (it != deviceFdCache.end())
+            {
+                m_fd = it->second;
+                m_isCached = true;
+                return;
+            }
+
             m_fd = ::open(devicePath.c_str(), O_DIRECT, 0600);
             if (m_fd < 0)
                 throw std::system_error(errno, std::generic_category(), "Failed to open block device ["+devicePath+"]");
+
+            m_isCached = isKeepDescriptors;
+            if (m_isCached)
+                deviceFdCache[devicePath] = m_fd;
         };
 
         virtual ~CDeviceCtl()
         {
-            if (m_fd > 0)
+            if ((m_fd > 0) && !m_isCached)
                 ::close(m_fd);
         };
 
@@ -125,7 +174,7 @@ namespace
 
     private:
         int m_fd;
-
+        bool m_isCached;
     };
 
     class CBlkFilterCtl
@@ -233,85 +282,118 @@ namespace
         return range;
     }
 
-    static void fiemapStorage(const std::string& filename, std::string& devicePath,
-                              std::vector<struct blksnap_sectors>& ranges)
+    /*
+     * Appends the physical location of the file on its block device to the
+     * ranges. At first, the number of extents is requested, so the buffer
+     * is allocated for all of them. The file may change between the calls,
+     * so the request is repeated from the last extent received.
+     */
+    static void fiemapFile(const std::string& filename, dev_t& devId, std::vector<struct blksnap_sectors>& ranges)
     {
-        int ret = 0;
-        const char* errMessage;
-        int fd = -1;
-        struct fiemap* map = NULL;
-        int extentMax = 500;
-        long long fileSize;
         struct stat64 st;
 
-        if (::stat64(filename.c_str(), &st))
-            throw std::system_error(errno, std::generic_category(), "Failed to get file size.");
+        OpenFileHolder file(filename, O_RDONLY | O_LARGEFILE | O_NOATIME);
+        if (::fstat64(file.Get(), &st))
+            throw std::system_error(errno, std::generic_category(), "Failed to get status for '" + filename + "'.");
 
-        fileSize = st.st_size;
-        devicePath = std::string("/dev/block/") +
-            std::to_string(major(st.st_dev)) + ":" +
-            std::to_string(minor(st.st_dev));
-        std::cout << "device path: '" << devicePath << "'" << std::endl;
+        devId = st.st_dev;
+        if (!st.st_size)
+            return;
 
-        fd = ::open(filename.c_str(), O_RDONLY | O_EXCL | O_LARGEFILE);
-        if (fd < 0)
-        {
-            ret = errno;
-            errMessage = "Failed to open file.";
-            goto out;
-        }
+        std::vector<char> buffer(sizeof(struct fiemap));
+        struct fiemap* map = reinterpret_cast<struct fiemap*>(buffer.data());
+        map->fm_start = 0;
+        map->fm_length = FIEMAP_MAX_OFFSET;
+        map->fm_flags = FIEMAP_FLAG_SYNC;
+        map->fm_extent_count = 0;
+        if (::ioctl(file.Get(), FS_IOC_FIEMAP, map))
+            throw std::system_error(errno, std::generic_category(), "Failed to call FS_IOC_FIEMAP for '" + filename + "'.");
 
-        map = (struct fiemap*)::malloc(sizeof(struct fiemap) + sizeof(struct fiemap_extent) * extentMax);
-        if (!map)
-        {
-            ret = ENOMEM;
-            errMessage = "Failed to allocate memory for fiemap structure.";
-            goto out;
-        }
+        unsigned int extentMax = std::max(map->fm_mapped_extents, 1U);
+        buffer.resize(sizeof(struct fiemap) + sizeof(struct fiemap_extent) * extentMax);
+        map = reinterpret_cast<struct fiemap*>(buffer.data());
 
-        for (long long fileOffset = 0; fileOffset < fileSize;)
+        for (unsigned long long fileOffset = 0; fileOffset < static_cast<unsigned long long>(st.st_size);)
         {
             map->fm_start = fileOffset;
-            map->fm_length = fileSize - fileOffset;
+            map->fm_length = FIEMAP_MAX_OFFSET - fileOffset;
             map->fm_extent_count = extentMax;
+            map->fm_mapped_extents = 0;
             map->fm_flags = 0;
 
-            if (::ioctl(fd, FS_IOC_FIEMAP, map))
-            {
-                ret = errno;
-                errMessage = "Failed to call FS_IOC_FIEMAP.";
-                goto out;
-            }
+            if (::ioctl(file.Get(), FS_IOC_FIEMAP, map))
+                throw std::system_error(errno, std::generic_category(), "Failed to call FS_IOC_FIEMAP for '" + filename + "'.");
+
+            if (!map->fm_mapped_extents)
+                break;
 
-            for (int i = 0; i < map->fm_mapped_extents; ++i)
+            bool isLast = false;
+            for (unsigned int i = 0; i < map->fm_mapped_extents; ++i)
             {
-                struct blksnap_sectors rg;
                 struct fiemap_extent* extent = map->fm_extents + i;
 
-                if (extent->fe_physical & (SECTOR_SIZE - 1))
-                {
-                    ret = EINVAL;
-                    errMessage = "File location is not ordered by sector size.";
-                    goto out;
-                }
+                fileOffset = extent->fe_logical + extent->fe_length;
+                isLast = extent->fe_flags & FIEMAP_EXTENT_LAST;
 
-                rg.offset = extent->fe_physical >> SECTOR_SHIFT;
-                rg.count = extent->fe_length >> SECTOR_SHIFT;
-                ranges.push_back(rg);
+                /*
+                 * The extents without their own location on the block device
+                 * cannot be marked.
+                 */
+                if (extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))
+                    continue;
 
-                fileOffset = extent->fe_logical + extent->fe_length;
+                if (extent->fe_physical & (SECTOR_SIZE - 1))
+                    throw std::system_error(EINVAL, std::generic_category(),
+                                            "File location is not ordered by sector size.");
 
-                std::cout << "allocate range: ofs=" << rg.offset << " cnt=" << rg.count << std::endl;
+                ranges.push_back({extent->fe_physical >> SECTOR_SHIFT,
+                                  (extent->fe_length + SECTOR_SIZE - 1) >> SECTOR_SHIFT});
             }
+            if (isLast)
+                break;
         }
+    }
 
-    out:
-        if (map)
-            ::free(map);
-        if (fd >= 0)
-            ::close(fd);
-        if (ret)
-            throw std::system_error(ret, std::generic_category(), errMessage);
+    /*
+     * Sorts the ranges and merges the overlapping and adjacent ones.
+     */
+    static void mergeRanges(std::vector<struct blksnap_sectors>& ranges)
+    {
+        if (ranges.empty())
+            return;
+
+        std::sort(ranges.begin(), ranges.end(),
+                  [](const struct blksnap_sectors& l, const struct blksnap_sectors& r) { return l.offset < r.offset; });
+
+        size_t last = 0;
+        for (size_t inx = 1; inx < ranges.size(); inx++)
+        {
+            unsigned long long end = ranges[last].offset + ranges[last].count;
+
+            if (ranges[inx].offset <= end)
+                ranges[last].count = std::max(end, ranges[inx].offset + ranges[inx].count) - ranges[last].offset;
+            else
+                ranges[++last] = ranges[inx];
+        }
+        ranges.resize(last + 1);
+    }
+
+    static inline unsigned long long parseSize(std::string str)
+    {
+        unsigned long long multiple = 1;
+
+        switch (str.back())
+        {
+            case 'G':
+                multiple *= 1024;
+            case 'M':
+                multiple *= 1024;
+            case 'K':
+                multiple *= 1024;
+                str.back() = '\0';
+            default:
+                return std::stoll(str.c_str()) * multiple;
+        }
     }
 
     bool isBlockFile(const std::string& path)
@@ -323,6 +405,273 @@ namespace
 
         return S_ISBLK(st.st_mode);
     }
+
+    struct SDeviceState
+    {
+        std::string device;
+        int errorCode;
+        std::string image;
+    };
+
+    /*
+     * Requests the snapshot state from the blksnap filter of the block device.
+     * The descriptor is not cached, so the function can be called from
+     * several threads. Returns false if the filter is not attached.
+     */
+    static bool probeDeviceState(const std::string& devicePath, SDeviceState& state)
+    {
+        struct blksnap_snapshotinfo info = {0};
+        struct blkfilter_ctl ctl = {
+            .name = {'b','l','k','s','n','a','p', '\0'},
+            .cmd = BLKFILTER_CTL_BLKSNAP_SNAPSHOTINFO,
+            .optlen = sizeof(info),
+            .opt = (__u64)&info,
+        };
+
+        int fd = ::open(devicePath.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        int ret = ::ioctl(fd, BLKFILTER_CTL, &ctl);
+        ::close(fd);
+        if (ret < 0)
+            return false;
+
+        std::vector<char> image(IMAGE_DISK_NAME_LEN + 1, '\0');
+        strncpy(image.data(), reinterpret_cast<char*>(info.image), IMAGE_DISK_NAME_LEN);
+
+        state.device = devicePath;
+        state.errorCode = info.error_code;
+        state.image = image[0] ? std::string("/dev/") + image.data() : std::string();
+        return true;
+    }
+
+    /*
+     * Probes all block devices of the system in parallel and returns the
+     * state of the devices with the attached blksnap filter.
+     */
+    static void collectDeviceStates(unsigned int threadCount, std::vector<SDeviceState>& states)
+    {
+        std::vector<std::string> devices;
+
+        for (fs::directory_iterator it("/sys/class/block"), end; it != end; ++it)
+            devices.push_back("/dev/" + it->path().filename().string());
+        std::sort(devices.begin(), devices.end());
+
+        threadCount = std::max(1U, std::min(threadCount, static_cast<unsigned int>(devices.size())));
+
+        std::atomic<size_t> next(0);
+        std::vector<SDeviceState> results(devices.size());
+        std::vector<char> isFound(devices.size(), 0);
+        std::vector<std::thread> threads;
+        for (unsigned int inx = 0; inx < threadCount; inx++)
+        {
+            threads.emplace_back([&]() {
+                for (size_t devInx = next++; devInx < devices.size(); devInx = next++)
+                    isFound[devInx] = probeDeviceState(devices[devInx], results[devInx]);
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+
+        for (size_t inx = 0; inx < devices.size(); inx++)
+            if (isFound[inx])
+                states.push_back(std::move(results[inx]));
+    }
+
+    /*
+     * Maps the whole file to memory for reading.
+     */
+    class CMappedFile
+    {
+    public:
+        CMappedFile(const std::string& path)
+            : m_data(nullptr)
+            , m_size(0)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::system_error(errno, std::generic_category(), "Failed to open file [" + path + "].");
+
+            struct stat st;
+            if (::fstat(fd, &st))
+            {
+                int err = errno;
+
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), "Failed to get status for '" + path + "'.");
+            }
+
+            m_size = st.st_size;
+            if (m_size)
+            {
+                void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (data == MAP_FAILED)
+                {
+                    int err = errno;
+
+                    ::close(fd);
+                    throw std::system_error(err, std::generic_category(), "Failed to map file [" + path + "].");
+                }
+                ::madvise(data, m_size, MADV_SEQUENTIAL);
+                m_data = static_cast<const uint8_t*>(data);
+            }
+            ::close(fd);
+        };
+        ~CMappedFile()
+        {
+            if (m_data)
+                ::munmap(const_cast<uint8_t*>(m_data), m_size);
+        };
+
+        const uint8_t* Data() const
+        {
+            return m_data;
+        };
+        size_t Size() const
+        {
+            return m_size;
+        };
+
+    private:
+        const uint8_t* m_data;
+        size_t m_size;
+    };
+
+    /*
+     * Writes the ranges of sectors in the 'ranges', 'json', 'ndjson' or
+     * 'binary' format. For 'json', only the elements of the array are
+     * written.
+     */
+    class CRangeWriter
+    {
+    public:
+        CRangeWriter(std::ostream& output, const std::string& format)
+            : m_output(output)
+            , m_format(format)
+            , m_isFirst(true)
+        {};
+
+        /*
+         * Writes the ranges and clears the vector.
+         */
+        void Write(std::vector<blksnap::SRange>& ranges)
+        {
+            for (const blksnap::SRange& rg : ranges)
+            {
+                if (m_format == "ranges")
+                    m_output << rg.sector << ":" << rg.count << "\n";
+                else if (m_format == "ndjson")
+                    m_output << "{\"sector\":" << rg.sector << ",\"count\":" << rg.count << "}\n";
+                else if (m_format == "json")
+                {
+                    m_output << (m_isFirst ? "" : ",") << "{\"sector\":" << rg.sector << ",\"count\":" << rg.count
+                             << "}";
+                    m_isFirst = false;
+                }
+                else
+                {
+                    uint64_t pair[2] = {htole64(rg.sector), htole64(rg.count)};
+
+                    m_output.write(reinterpret_cast<char*>(pair), sizeof(pair));
+                }
+            }
+            ranges.clear();
+        };
+
+    private:
+        std::ostream& m_output;
+        std::string m_format;
+        bool m_isFirst;
+    };
+
+    static std::string jsonEscape(const std::string& str)
+    {
+        std::string result;
+
+        for (char ch : str)
+        {
+            switch (ch)
+            {
+            case '"':
+                result += "\\\"";
+                break;
+            case '\\':
+                result += "\\\\";
+                break;
+            case '\n':
+                result += "\\n";
+                break;
+            case '\t':
+                result += "\\t";
+                break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20)
+                {
+                    char buf[8];
+
+                    snprintf(buf, sizeof(buf), "\\u%04x", ch);
+                    result += buf;
+                }
+                else
+                    result += ch;
+            }
+        }
+        return result;
+    }
+
+    /*
+     * Checks that the string is a valid UTF-8 text, so it can be passed in
+     * a JSON string.
+     */
+    static bool isUtf8(const std::string& str)
+    {
+        size_t inx = 0;
+
+        while (inx < str.size())
+        {
+            const unsigned char ch = str[inx++];
+            size_t count;
+
+            if (ch < 0x80)
+                continue;
+            else if ((ch & 0xE0) == 0xC0)
+                count = 1;
+            else if ((ch & 0xF0) == 0xE0)
+                count = 2;
+            else if ((ch & 0xF8) == 0xF0)
+                count = 3;
+            else
+                return false;
+
+            for (; count; count--)
+                if ((inx >= str.size()) || ((static_cast<unsigned char>(str[inx++]) & 0xC0) != 0x80))
+                    return false;
+        }
+        return true;
+    }
+
+    static std::string base64Encode(const std::string& data)
+    {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string result;
+
+        for (size_t inx = 0; inx < data.size(); inx += 3)
+        {
+            uint32_t value = static_cast<unsigned char>(data[inx]) << 16;
+
+            if ((inx + 1) < data.size())
+                value |= static_cast<unsigned char>(data[inx + 1]) << 8;
+            if ((inx + 2) < data.size())
+                value |= static_cast<unsigned char>(data[inx + 2]);
+
+            result += alphabet[(value >> 18) & 0x3F];
+            result += alphabet[(value >> 12) & 0x3F];
+            result += ((inx + 1) < data.size()) ? alphabet[(value >> 6) & 0x3F] : '=';
+            result += ((inx + 2) < data.size()) ? alphabet[value & 0x3F] : '=';
+        }
+        return result;
+    }
 } // namespace
 
 class IArgsProc
@@ -470,8 +819,11 @@ public:
         m_usage = std::string("Read change tracking map.");
         m_desc.add_options()
             ("device,d", po::value<std::string>(), "Device name.")
-            ("file,f", po::value<std::string>(), "File name for output.")
-            ("json,j", "Use json format for output.");
+            ("file,f", po::value<std::string>(), "File name for output. By default, the output is written to stdout.")
+            ("format", po::value<std::string>()->default_value("raw"), "Output format: 'raw' for the map itself, 'ranges' for the list of changed ranges in format 'sector:count', 'json', 'ndjson' or 'binary' for the list of pairs of 64-bit little-endian sector and count.")
+            ("snap-number,n", po::value<unsigned int>()->default_value(0), "The ranges of blocks changed after the snapshot with this number are output.")
+            ("window,w", po::value<unsigned int>()->default_value(32 * 1024), "The number of blocks read at once.")
+            ("json,j", "Use json format for output. It's the same as '--format json'.");
     };
 
     void Execute(po::variables_map& vm) override
@@ -481,22 +833,50 @@ public:
         if (!vm.count("device"))
             throw std::invalid_argument("Argument 'device' is missed.");
 
+        std::string format = vm.count("json") ? "json" : vm["format"].as<std::string>();
+        if ((format != "raw") && (format != "ranges") && (format != "json") && (format != "ndjson")
+            && (format != "binary"))
+            throw std::invalid_argument("Invalid format '" + format + "'.");
+
+        unsigned int snapNumber = vm["snap-number"].as<unsigned int>();
+        if (snapNumber > UINT8_MAX)
+            throw std::invalid_argument("Argument 'snap-number' is out of range.");
+
+        unsigned int window = vm["window"].as<unsigned int>();
+        if (!window)
+            throw std::invalid_argument("Argument 'window' cannot be zero.");
+
         CBlkFilterCtl ctl(vm["device"].as<std::string>());
 
         struct blksnap_cbtinfo info;
         ctl.Control(BLKFILTER_CTL_BLKSNAP_CBTINFO, &info, sizeof(info));
         elapsed = info.block_count;
 
-        if (vm.count("json"))
-            throw std::invalid_argument("Argument 'json' is not supported yet.");
+        std::ofstream outputFile;
+        if (vm.count("file"))
+        {
+            outputFile.open(vm["file"].as<std::string>(), std::ofstream::out | std::ofstream::binary);
+            if (!outputFile.is_open())
+                throw std::runtime_error("Failed to open file [" + vm["file"].as<std::string>() + "].");
+        }
+        std::ostream& output = vm.count("file") ? outputFile : std::cout;
 
-        if (!vm.count("file"))
-            throw std::invalid_argument("Argument 'file' is missed.");
+        if (format == "json")
+        {
+            char generationIdStr[64];
+
+            uuid_unparse(info.generation_id.b, generationIdStr);
+            output << "{\"block_size\":" << info.block_size << ",\"device_capacity\":" << info.device_capacity
+                   << ",\"generation_id\":\"" << generationIdStr << "\",\"changes_number\":"
+                   << static_cast<int>(info.changes_number) << ",\"snap_number\":" << snapNumber
+                   << ",\"ranges\":[";
+        }
 
-        std::ofstream output;
-        output.open(vm["file"].as<std::string>(), std::ofstream::out | std::ofstream::binary);
+        blksnap::CCbtRangeExtractor extractor(info.block_size, info.device_capacity, snapNumber);
+        std::vector<blksnap::SRange> ranges;
+        CRangeWriter writer(output, format);
 
-        std::vector<unsigned char> buf(std::min(32*1024u, elapsed));
+        std::vector<unsigned char> buf(std::min(window, elapsed));
         struct blksnap_cbtmap arg = {
             .offset = 0,
             .buffer = (__u64)buf.data()
@@ -509,55 +889,281 @@ public:
             elapsed -= arg.length;
             arg.offset += arg.length;
 
-            output.write(reinterpret_cast<char *>(arg.buffer), arg.length);
+            if (format == "raw")
+                output.write(reinterpret_cast<char *>(arg.buffer), arg.length);
+            else
+            {
+                extractor.Process(buf.data(), arg.length, ranges);
+                writer.Write(ranges);
+            }
         };
 
-        output.close();
+        if (format != "raw")
+        {
+            extractor.Finish(ranges);
+            writer.Write(ranges);
+        }
+        if (format == "json")
+            output << "]}" << std::endl;
+
+        output.flush();
+        if (output.fail())
+            throw std::runtime_error("Failed to write output.");
+    };
+};
+
+class CbtDiffArgsProc : public IArgsProc
+{
+public:
+    CbtDiffArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Combine the changes from the change tracking maps saved by the 'readcbtmap' command.");
+        m_desc.add_options()
+            ("map,m", po::value<std::vector<std::string>>()->multitoken(), "The file with the map in 'raw' format. It's multitoken argument.")
+            ("snap-number,n", po::value<std::vector<unsigned int>>()->multitoken(), "The snapshot number for each map. The blocks changed after this snapshot are taken from the map. It's multitoken argument.")
+            ("operation,o", po::value<std::string>()->default_value("union"), "'union' outputs the blocks changed in any map, 'diff' outputs the blocks changed in the first map, but not in the others.")
+            ("block-size,b", po::value<std::string>(), "The size of the change tracking block. It's the 'block_size' from the 'cbtinfo' command output.")
+            ("device-capacity,c", po::value<std::string>(), "The size of the device. By default, it's the length of the longest map multiplied by the block size.")
+            ("file,f", po::value<std::string>(), "File name for output. By default, the output is written to stdout.")
+            ("format", po::value<std::string>()->default_value("ranges"), "Output format: 'ranges', 'json', 'ndjson' or 'binary' as for the 'readcbtmap' command.");
+    };
+
+    void Execute(po::variables_map& vm) override
+    {
+        if (!vm.count("map"))
+            throw std::invalid_argument("Argument 'map' is missed.");
+        if (!vm.count("snap-number"))
+            throw std::invalid_argument("Argument 'snap-number' is missed.");
+        if (!vm.count("block-size"))
+            throw std::invalid_argument("Argument 'block-size' is missed.");
+
+        const std::vector<std::string>& mapFiles = vm["map"].as<std::vector<std::string>>();
+        const std::vector<unsigned int>& snapNumbers = vm["snap-number"].as<std::vector<unsigned int>>();
+        if (snapNumbers.size() != mapFiles.size())
+            throw std::invalid_argument("The number of snapshot numbers should be equal to the number of maps.");
+        for (unsigned int snapNumber : snapNumbers)
+            if (snapNumber > UINT8_MAX)
+                throw std::invalid_argument("Argument 'snap-number' is out of range.");
+
+        const std::string& operation = vm["operation"].as<std::string>();
+        if ((operation != "union") && (operation != "diff"))
+            throw std::invalid_argument("Invalid operation '" + operation + "'.");
+
+        std::string format = vm["format"].as<std::string>();
+        if ((format != "ranges") && (format != "json") && (format != "ndjson") && (format != "binary"))
+            throw std::invalid_argument("Invalid format '" + format + "'.");
+
+        unsigned long long blockSize = parseSize(vm["block-size"].as<std::string>());
+        if (!blockSize || (blockSize & (SECTOR_SIZE - 1)))
+            throw std::invalid_argument("Argument 'block-size' should be a multiple of the sector size.");
+
+        std::vector<std::shared_ptr<CMappedFile>> maps;
+        size_t length = 0;
+        for (const std::string& mapFile : mapFiles)
+        {
+            maps.push_back(std::make_shared<CMappedFile>(mapFile));
+            length = std::max(length, maps.back()->Size());
+        }
+        /*
+         * The blocks that are beyond the end of the first map cannot be
+         * changed in the difference.
+         */
+        if (operation == "diff")
+            length = maps[0]->Size();
+
+        unsigned long long capacity = vm.count("device-capacity")
+                                          ? parseSize(vm["device-capacity"].as<std::string>())
+                                          : static_cast<unsigned long long>(length) * blockSize;
+
+        std::ofstream outputFile;
+        if (vm.count("file"))
+        {
+            outputFile.open(vm["file"].as<std::string>(), std::ofstream::out | std::ofstream::binary);
+            if (!outputFile.is_open())
+                throw std::runtime_error("Failed to open file [" + vm["file"].as<std::string>() + "].");
+        }
+        std::ostream& output = vm.count("file") ? outputFile : std::cout;
+
+        if (format == "json")
+            output << "{\"block_size\":" << blockSize << ",\"device_capacity\":" << capacity << ",\"operation\":\""
+                   << operation << "\",\"ranges\":[";
+
+        blksnap::CCbtRangeExtractor extractor(blockSize, capacity, 0);
+        std::vector<blksnap::SRange> ranges;
+        CRangeWriter writer(output, format);
+
+        /*
+         * The maps are combined by windows that fit in the cache.
+         */
+        const size_t window = 256 * 1024;
+        std::vector<uint8_t> flags(std::min(window, length));
+        for (size_t offset = 0; offset < length; offset += window)
+        {
+            size_t count = std::min(window, length - offset);
+
+            std::fill(flags.begin(), flags.begin() + count, 0);
+            for (size_t inx = 0; inx < maps.size(); inx++)
+            {
+                if (offset >= maps[inx]->Size())
+                    continue;
+
+                const uint8_t* map = maps[inx]->Data() + offset;
+                size_t mapCount = std::min(count, maps[inx]->Size() - offset);
+                if ((inx == 0) || (operation == "union"))
+                    blksnap::CbtMergeChanged(map, mapCount, snapNumbers[inx], flags.data());
+                else
+                    blksnap::CbtExcludeChanged(map, mapCount, snapNumbers[inx], flags.data());
+            }
+
+            extractor.Process(flags.data(), count, ranges);
+            writer.Write(ranges);
+        }
+        extractor.Finish(ranges);
+        writer.Write(ranges);
+
+        if (format == "json")
+            output << "]}" << std::endl;
+
+        output.flush();
+        if (output.fail())
+            throw std::runtime_error("Failed to write output.");
     };
 };
 
 class MarkDirtyBlockArgsProc : public IArgsProc
 {
+private:
+    /*
+     * The files are processed by several threads, and each thread collects
+     * the ranges grouped by the device.
+     */
+    static void FiemapFiles(const std::vector<std::string>& files, const unsigned int threadCount,
+                            std::map<dev_t, std::vector<struct blksnap_sectors>>& devices)
+    {
+        std::atomic<size_t> next(0);
+        std::vector<std::map<dev_t, std::vector<struct blksnap_sectors>>> results(threadCount);
+        std::vector<std::exception_ptr> errors(threadCount);
+        std::vector<std::thread> threads;
+
+        for (unsigned int inx = 0; inx < threadCount; inx++)
+        {
+            threads.emplace_back([&, inx]() {
+                try
+                {
+                    for (size_t fileInx = next++; fileInx < files.size(); fileInx = next++)
+                    {
+                        dev_t devId;
+                        std::vector<struct blksnap_sectors> ranges;
+
+                        fiemapFile(files[fileInx], devId, ranges);
+
+                        auto& devRanges = results[inx][devId];
+                        devRanges.insert(devRanges.end(), ranges.begin(), ranges.end());
+                    }
+                }
+                catch (...)
+                {
+                    errors[inx] = std::current_exception();
+                    next = files.size();
+                }
+            });
+        }
+        for (std::thread& thread : threads)
+            thread.join();
+
+        for (const std::exception_ptr& error : errors)
+            if (error)
+                std::rethrow_exception(error);
+
+        for (auto& result : results)
+        {
+            for (auto& it : result)
+            {
+                auto& devRanges = devices[it.first];
+                devRanges.insert(devRanges.end(), it.second.begin(), it.second.end());
+            }
+        }
+    };
+
 public:
     MarkDirtyBlockArgsProc()
         : IArgsProc()
     {
         m_usage = std::string("Mark blocks as changed in change tracking map.");
         m_desc.add_options()
-            ("file,f", po::value<std::string>(), "File name with dirty blocks.")
+            ("file,f", po::value<std::vector<std::string>>()->multitoken(), "File or directory name with dirty blocks. The directories are processed recursively. It's multitoken argument.")
             ("device,d", po::value<std::string>(), "Device name.")
-            ("ranges,r", po::value<std::vector<std::string>>()->multitoken(), "Sectors range in format 'sector:count'. It's multitoken argument.");
+            ("ranges,r", po::value<std::vector<std::string>>()->multitoken(), "Sectors range in format 'sector:count'. It's multitoken argument.")
+            ("threads,t", po::value<unsigned int>(), "The number of threads to get the location of files. By default, it's the number of processors.");
     };
 
     void Execute(po::variables_map& vm) override
     {
-        std::string devicePath;
-        std::vector<struct blksnap_sectors> ranges;
+        std::map<std::string, std::vector<struct blksnap_sectors>> devices;
 
         if (vm.count("file"))
         {
-            fiemapStorage(vm["file"].as<std::string>(), devicePath, ranges);
+            std::vector<std::string> files;
+
+            for (const std::string& name : vm["file"].as<std::vector<std::string>>())
+            {
+                if (!fs::is_directory(name))
+                {
+                    files.push_back(name);
+                    continue;
+                }
+
+                for (fs::recursive_directory_iterator it(name), end; it != end; ++it)
+                    if (fs::is_regular_file(it->symlink_status()))
+                        files.push_back(it->path().string());
+            }
+
+            unsigned int threadCount = vm.count("threads") ? vm["threads"].as<unsigned int>()
+                                                           : std::thread::hardware_concurrency();
+            threadCount = std::max(1U, std::min(threadCount, static_cast<unsigned int>(files.size())));
+
+            std::map<dev_t, std::vector<struct blksnap_sectors>> devIdRanges;
+            FiemapFiles(files, threadCount, devIdRanges);
+            for (auto& it : devIdRanges)
+                devices[std::string("/dev/block/") + std::to_string(major(it.first)) + ":"
+                        + std::to_string(minor(it.first))] = std::move(it.second);
         }
         else
         {
             if (!vm.count("device"))
                 throw std::invalid_argument("Argument 'device' is missed.");
 
-            devicePath = vm["device"].as<std::string>();
-
             if (!vm.count("ranges"))
                 throw std::invalid_argument("Argument 'ranges' is missed.");
 
+            auto& ranges = devices[vm["device"].as<std::string>()];
             for (const std::string& range : vm["ranges"].as<std::vector<std::string>>())
                 ranges.push_back(parseRange(range));
         }
 
-        CBlkFilterCtl ctl(devicePath);
-        struct blksnap_cbtdirty arg = {
-            .count = static_cast<unsigned int>(ranges.size()),
-            .dirty_sectors = (__u64)ranges.data()
-        };
-        ctl.Control(BLKFILTER_CTL_BLKSNAP_CBTDIRTY, &arg, sizeof(arg));
+        for (auto& it : devices)
+        {
+            std::vector<struct blksnap_sectors>& ranges = it.second;
+
+            mergeRanges(ranges);
+            if (ranges.empty())
+                continue;
+
+            /*
+             * The module reads only the first range of the array, so the
+             * merged ranges are passed one by one.
+             */
+            CBlkFilterCtl ctl(it.first);
+            for (struct blksnap_sectors& range : ranges)
+            {
+                struct blksnap_cbtdirty arg = {
+                    .count = 1,
+                    .dirty_sectors = (__u64)&range
+                };
+                ctl.Control(BLKFILTER_CTL_BLKSNAP_CBTDIRTY, &arg, sizeof(arg));
+            }
+        }
     }
 };
 
@@ -669,57 +1275,102 @@ public:
         m_desc.add_options()
             ("device,d", po::value<std::vector<std::string>>()->multitoken(), "Device name for snapshot. It's multitoken argument.")
             ("file,f", po::value<std::string>(), "File for difference storage.")
-            ("limit,l", po::value<std::string>(), "The allowable limit for the size of the difference storage file. The suffixes M, K and G is allowed.");
+            ("limit,l", po::value<std::string>(), "The allowable limit for the size of the difference storage file. The suffixes M, K and G is allowed. The value 'auto' allows to calculate the limit from the history of changes of the devices.")
+            ("hold", po::value<unsigned int>()->default_value(3600), "The expected snapshot holding time in seconds. It's used with '--limit auto'.")
+            ("confidence", po::value<double>()->default_value(0.95, "0.95"), "The probability that the difference storage will not overflow. It's used with '--limit auto'.")
+            ("history", po::value<std::string>(), "The file of the history of changes of the devices. By default, '/var/lib/blksnap/history' is used with '--limit auto'.")
+            ("preallocate", "Allocate the difference storage file of the limit size before creating the snapshot. If the 'file' is a directory, an unnamed temporary file is created in it.");
     };
 
     void Execute(po::variables_map& vm) override
     {
         CBlksnapFileWrap blksnapFd;
         struct blksnap_snapshot_create param = {0};
+        std::vector<std::string> devices;
 
         if (!vm.count("file"))
             throw std::invalid_argument("Argument 'file' is missed.");
 
         std::string filename = vm["file"].as<std::string>();
 
-        unsigned long long limit = 0;
-        unsigned long long multiple = 1;
+        if (vm.count("device"))
+            devices = vm["device"].as<std::vector<std::string>>();
+
         if (!vm.count("limit"))
             throw std::invalid_argument("Argument 'limit' is missed.");
         std::string limit_str = vm["limit"].as<std::string>();
-        switch (limit_str.back())
-        {
-            case 'G':
-                multiple *= 1024;
-            case 'M':
-                multiple *= 1024;
-            case 'K':
-                multiple *= 1024;
-                limit_str.back() = '\0';
-            default:
-                limit = std::stoll(limit_str.c_str()) * multiple;
-        }
-
-        param.diff_storage_limit_sect = limit / 512;
-        param.diff_storage_filename = (__u64)filename.c_str();
-        if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_CREATE, &param))
-            throw std::system_error(errno, std::generic_category(), "Failed to create snapshot object.");
+        bool isAutoLimit = (limit_str == "auto");
 
-        Uuid id(param.id.b);
-        std::cout << id.ToString() << std::endl;
+        std::string historyFile;
+        if (vm.count("history"))
+            historyFile = vm["history"].as<std::string>();
+        else if (isAutoLimit)
+            historyFile = defaultHistoryFile;
 
-        if (vm.count("device"))
+        if (!historyFile.empty())
         {
-            std::vector<std::string> devices = vm["device"].as<std::vector<std::string>>();
+            if (devices.empty())
+                throw std::invalid_argument("Argument 'device' is missed. It's required to use the history of changes.");
 
+            blksnap::CDiffStorageAdvisor advisor(historyFile);
             for (const std::string& devicePath : devices)
-                SnapshotAdd(id.Get(), devicePath);
-        }
-    };
-};
-
-class SnapshotDestroyArgsProc : public IArgsProc
-{
+            {
+                try
+                {
+                    advisor.Record(devicePath);
+                }
+                catch (std::system_error& ex)
+                {
+                    /*
+                     * The change tracker is not attached yet, so there is no
+                     * history of changes for this device. Any other failure
+                     * would leave the history incomplete.
+                     */
+                    if (ex.code() != std::error_code(ENOENT, std::generic_category()))
+                        throw;
+                }
+            }
+            advisor.Save();
+
+            if (isAutoLimit)
+            {
+                blksnap::SDiffStorageAdvice advice =
+                  advisor.Recommend(devices, vm["hold"].as<unsigned int>(), vm["confidence"].as<double>());
+
+                param.diff_storage_limit_sect = advice.diffStorageLimitSect;
+                std::cerr << "Difference storage limit " << (advice.diffStorageLimitSect << SECTOR_SHIFT)
+                          << " bytes is calculated from " << advice.samplesCount << " measurements." << std::endl;
+            }
+        }
+        if (!isAutoLimit)
+            param.diff_storage_limit_sect = parseSize(limit_str) / 512;
+
+        std::shared_ptr<blksnap::CDiffStorage> ptrDiffStorage;
+        if (vm.count("preallocate"))
+        {
+            unsigned long long size = param.diff_storage_limit_sect << SECTOR_SHIFT;
+
+            if (fs::is_directory(filename))
+                ptrDiffStorage = blksnap::CDiffStorage::CreateTemporary(filename, size, devices);
+            else
+                ptrDiffStorage = blksnap::CDiffStorage::Create(filename, size, devices);
+            filename = ptrDiffStorage->Path();
+        }
+
+        param.diff_storage_filename = (__u64)filename.c_str();
+        if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_CREATE, &param))
+            throw std::system_error(errno, std::generic_category(), "Failed to create snapshot object.");
+
+        Uuid id(param.id.b);
+        std::cout << id.ToString() << std::endl;
+
+        for (const std::string& devicePath : devices)
+            SnapshotAdd(id.Get(), devicePath);
+    };
+};
+
+class SnapshotDestroyArgsProc : public IArgsProc
+{
 public:
     SnapshotDestroyArgsProc()
         : IArgsProc()
@@ -873,16 +1524,49 @@ public:
     {
         m_usage = std::string("Get collection of snapshots.");
         m_desc.add_options()
-            ("json,j", "Use json format for output.");
+            ("json,j", "Use json format for output. The state of the devices with the attached filter is output too.")
+            ("threads,t", po::value<unsigned int>(), "The number of threads to probe the devices. By default, it's the number of processors.");
     };
 
     void Execute(po::variables_map& vm) override
     {
-        if (vm.count("json"))
-            throw std::invalid_argument("Argument 'json' is not supported yet.");
-
         std::vector<Uuid> ids;
         CollectSnapshots(ids);
+
+        if (vm.count("json"))
+        {
+            unsigned int threadCount = vm.count("threads") ? vm["threads"].as<unsigned int>()
+                                                           : std::thread::hardware_concurrency();
+            std::vector<SDeviceState> states;
+            collectDeviceStates(threadCount, states);
+
+            /*
+             * The kernel module does not report which snapshot the device
+             * belongs to, so it's known only if there is a single snapshot.
+             */
+            std::string snapshot = (ids.size() == 1) ? "\"" + ids[0].ToString() + "\"" : std::string("null");
+
+            std::cout << "{\"snapshots\":[";
+            for (size_t inx = 0; inx < ids.size(); inx++)
+                std::cout << (inx ? "," : "") << "\"" << ids[inx].ToString() << "\"";
+            std::cout << "],\"devices\":[";
+            for (size_t inx = 0; inx < states.size(); inx++)
+            {
+                const SDeviceState& state = states[inx];
+                bool isMember = !state.image.empty() || state.errorCode;
+
+                std::cout << (inx ? "," : "") << "{\"device\":\"" << jsonEscape(state.device) << "\",\"snapshot\":"
+                          << (isMember ? snapshot : std::string("null")) << ",\"image\":";
+                if (state.image.empty())
+                    std::cout << "null";
+                else
+                    std::cout << "\"" << jsonEscape(state.image) << "\"";
+                std::cout << ",\"error_code\":" << state.errorCode << "}";
+            }
+            std::cout << "]}" << std::endl;
+            return;
+        }
+
         for (const Uuid& id : ids)
             std::cout << id.ToString() << " " << std::endl;
         std::cout << std::endl;
@@ -975,12 +1659,856 @@ public:
     };
 };
 
+/*
+ * The progress of the image transfer of one device. The counters are updated
+ * only by the thread that copies the device, and the reporter reads them on a
+ * timer, so no lock is taken for the I/O. For the incremental backup, the
+ * totals grow while the change tracking map is read, and they are final when
+ * isTotalKnown is set.
+ */
+struct STransferProgress
+{
+    STransferProgress()
+        : bytes(0)
+        , ranges(0)
+        , totalBytes(0)
+        , totalRanges(0)
+        , isTotalKnown(false)
+        , isDone(false)
+    {};
+
+    std::atomic<unsigned long long> bytes;
+    std::atomic<unsigned long long> ranges;
+    std::atomic<unsigned long long> totalBytes;
+    std::atomic<unsigned long long> totalRanges;
+    std::atomic<bool> isTotalKnown;
+    std::atomic<bool> isDone;
+};
+
+/*
+ * Writes the progress of the transfers to the descriptor periodically, as
+ * JSON lines or as human-readable text. The error code of the snapshot of
+ * each device is requested on every report, so the corrupted snapshot is
+ * noticed before the transfer is completed.
+ */
+class CProgressReporter
+{
+public:
+    CProgressReporter(const int fd, const bool isJson, const unsigned int intervalMs)
+        : m_fd(fd)
+        , m_isJson(isJson)
+        , m_intervalMs(intervalMs)
+        , m_isStop(false)
+    {};
+    ~CProgressReporter()
+    {
+        Stop();
+    };
+
+    void Add(const std::string& devicePath, const std::shared_ptr<STransferProgress>& progress)
+    {
+        m_items.push_back({devicePath, progress, 0});
+    };
+
+    void Start()
+    {
+        m_startTime = std::chrono::steady_clock::now();
+        m_lastTime = m_startTime;
+        m_thread = std::thread(&CProgressReporter::Worker, this);
+    };
+
+    /*
+     * Writes the final report.
+     */
+    void Stop()
+    {
+        if (!m_thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_isStop = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    };
+
+private:
+    struct SItem
+    {
+        std::string path;
+        std::shared_ptr<STransferProgress> progress;
+        unsigned long long lastBytes;
+    };
+
+    void Worker()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+
+        while (!m_cond.wait_for(lock, std::chrono::milliseconds(m_intervalMs), [this] { return m_isStop; }))
+            Report();
+        Report();
+    };
+
+    void Report()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - m_startTime).count();
+        const double interval = std::chrono::duration<double>(now - m_lastTime).count();
+        std::ostringstream ss;
+
+        m_lastTime = now;
+        ss << std::fixed << std::setprecision(1);
+        for (SItem& item : m_items)
+        {
+            const unsigned long long bytes = item.progress->bytes.load(std::memory_order_relaxed);
+            const unsigned long long totalBytes = item.progress->totalBytes.load(std::memory_order_relaxed);
+            const unsigned long long totalRanges = item.progress->totalRanges.load(std::memory_order_relaxed);
+            const unsigned long long ranges = item.progress->ranges.load(std::memory_order_relaxed);
+            const unsigned long long remainingRanges = (totalRanges > ranges) ? (totalRanges - ranges) : 0;
+            const bool isDone = item.progress->isDone.load(std::memory_order_relaxed);
+            const bool isTotalKnown = isDone || item.progress->isTotalKnown.load(std::memory_order_relaxed);
+            const double mbps = interval > 0 ? (bytes - item.lastBytes) / interval / (1024 * 1024) : 0;
+            const double avgMbps = elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0;
+            const double eta = (!isDone && (avgMbps > 0) && (totalBytes > bytes))
+                                   ? (totalBytes - bytes) / (avgMbps * 1024 * 1024)
+                                   : 0;
+            SDeviceState state = {item.path, 0, std::string()};
+
+            item.lastBytes = bytes;
+            probeDeviceState(item.path, state);
+            if (m_isJson)
+            {
+                ss << "{\"time\":" << elapsed << ",\"device\":\"" << jsonEscape(item.path) << "\",\"bytes\":" << bytes
+                   << ",\"total_bytes\":" << totalBytes << ",\"mbps\":" << mbps << ",\"avg_mbps\":" << avgMbps
+                   << ",\"eta\":";
+                if (isTotalKnown)
+                    ss << eta;
+                else
+                    ss << "null";
+                ss << ",\"remaining_ranges\":" << remainingRanges << ",\"error_code\":" << state.errorCode
+                   << ",\"done\":" << (isDone ? "true" : "false") << "}\n";
+            }
+            else
+            {
+                ss << item.path << ": ";
+                if (isTotalKnown)
+                    ss << (totalBytes ? (100.0 * bytes / totalBytes) : 100.0) << "% ";
+                ss << (bytes >> 20) << "/" << (totalBytes >> 20) << (isTotalKnown ? "" : "+") << " MiB " << mbps
+                   << " MB/s (avg " << avgMbps << " MB/s)";
+                if (isDone)
+                    ss << " done";
+                else if (isTotalKnown)
+                    ss << " eta " << static_cast<unsigned long long>(eta) << "s";
+                else
+                    ss << " eta unknown";
+                ss << " ranges left " << remainingRanges << " snapshot "
+                   << (state.errorCode ? "corrupted (" + std::to_string(state.errorCode) + ")" : std::string("ok"))
+                   << "\n";
+            }
+        }
+
+        /*
+         * The failure to write the progress does not break the transfer.
+         */
+        const std::string text = ss.str();
+        if (::write(m_fd, text.data(), text.size()) < 0)
+            std::cerr << "Failed to write progress: " << std::strerror(errno) << std::endl;
+    };
+
+private:
+    int m_fd;
+    bool m_isJson;
+    unsigned int m_intervalMs;
+    std::vector<SItem> m_items;
+    std::chrono::steady_clock::time_point m_startTime;
+    std::chrono::steady_clock::time_point m_lastTime;
+
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    bool m_isStop;
+    std::thread m_thread;
+};
+
+class BackupArgsProc : public IArgsProc
+{
+private:
+    struct SDevice
+    {
+        std::string path;
+        std::string name;
+        struct blksnap_cbtinfo info;
+        std::string image;
+        bool isIncremental;
+        unsigned int snapNumber;
+        std::shared_ptr<STransferProgress> progress;
+        std::exception_ptr error;
+    };
+
+    /*
+     * The checkpoint keeps the state of the change tracker at the moment
+     * when the snapshot was taken. The next backup copies only the blocks
+     * changed after it.
+     */
+    static bool ReadCheckpoint(const std::string& fileName, Uuid& generationId, unsigned int& snapNumber)
+    {
+        std::ifstream input(fileName);
+        std::string line;
+        bool isGenerationId = false;
+        bool isSnapNumber = false;
+
+        if (!input.is_open())
+            return false;
+
+        while (std::getline(input, line))
+        {
+            size_t pos = line.find('=');
+            if (pos == std::string::npos)
+                continue;
+
+            std::string key = line.substr(0, pos);
+            std::string value = line.substr(pos + 1);
+            if (key == "generation_id")
+            {
+                generationId.FromString(value);
+                isGenerationId = true;
+            }
+            else if (key == "snap_number")
+            {
+                snapNumber = std::stoul(value);
+                isSnapNumber = true;
+            }
+        }
+        return isGenerationId && isSnapNumber;
+    };
+
+    static void WriteCheckpoint(const std::string& fileName, const struct blksnap_cbtinfo& info)
+    {
+        std::string tmpFileName = fileName + ".tmp";
+        {
+            std::ofstream output(tmpFileName, std::ofstream::trunc);
+            char generationIdStr[64];
+
+            uuid_unparse(info.generation_id.b, generationIdStr);
+            output << "generation_id=" << generationIdStr << std::endl;
+            output << "snap_number=" << static_cast<int>(info.changes_number) << std::endl;
+            output << "block_size=" << info.block_size << std::endl;
+            output << "device_capacity=" << info.device_capacity << std::endl;
+            if (output.fail())
+                throw std::runtime_error("Failed to write file [" + tmpFileName + "].");
+        }
+        fs::rename(tmpFileName, fileName);
+    };
+
+    static void CopyRange(const int imageFd, const int deltaFd, const blksnap::SRange& rg,
+                          std::vector<char>& buffer, STransferProgress& progress)
+    {
+        uint64_t header[2] = {htole64(rg.sector), htole64(rg.count)};
+
+        if (::write(deltaFd, header, sizeof(header)) != sizeof(header))
+            throw std::system_error(errno, std::generic_category(), "Failed to write delta file.");
+
+        off_t offset = static_cast<off_t>(rg.sector) << SECTOR_SHIFT;
+        off_t end = offset + (static_cast<off_t>(rg.count) << SECTOR_SHIFT);
+        while (offset < end)
+        {
+            size_t portion = static_cast<size_t>(std::min(static_cast<off_t>(buffer.size()), end - offset));
+            ssize_t ret = ::pread(imageFd, buffer.data(), portion, offset);
+            if (ret <= 0)
+                throw std::system_error(ret ? errno : EIO, std::generic_category(), "Failed to read snapshot image.");
+
+            if (::write(deltaFd, buffer.data(), ret) != ret)
+                throw std::system_error(errno, std::generic_category(), "Failed to write delta file.");
+
+            offset += ret;
+            progress.bytes.fetch_add(ret, std::memory_order_relaxed);
+        }
+        progress.ranges.fetch_add(1, std::memory_order_relaxed);
+    };
+
+    /*
+     * Reads the change tracking map by windows and passes the changed ranges
+     * of each window to the function.
+     */
+    static void ReadChangedRanges(CBlkFilterCtl& ctl, const SDevice& dev, const unsigned int window,
+                                  const std::function<void(const std::vector<blksnap::SRange>&)>& fn)
+    {
+        blksnap::CCbtRangeExtractor extractor(dev.info.block_size, dev.info.device_capacity, dev.snapNumber);
+        std::vector<blksnap::SRange> ranges;
+        std::vector<unsigned char> map(std::min(window, dev.info.block_count));
+        struct blksnap_cbtmap arg = {
+            .offset = 0,
+            .buffer = (__u64)map.data()
+        };
+        unsigned int elapsed = dev.info.block_count;
+        while (elapsed)
+        {
+            arg.length = std::min(static_cast<unsigned int>(map.size()), elapsed);
+            ctl.Control(BLKFILTER_CTL_BLKSNAP_CBTMAP, &arg, sizeof(struct blksnap_cbtmap));
+            elapsed -= arg.length;
+            arg.offset += arg.length;
+
+            extractor.Process(map.data(), arg.length, ranges);
+            if (!elapsed)
+                extractor.Finish(ranges);
+
+            fn(ranges);
+            ranges.clear();
+        }
+    };
+
+    /*
+     * The changed ranges are calculated from the each part of the change
+     * tracking map and copied at once, so the whole map is not kept in memory.
+     */
+    static void BackupDevice(SDevice& dev, const std::string& outputDir, const unsigned int window,
+                             const size_t bufferSize)
+    {
+        try
+        {
+            OpenFileHolder image(dev.image, O_RDONLY | O_LARGEFILE);
+            std::string deltaFileName = outputDir + "/" + dev.name + ".delta";
+            OpenFileHolder delta(deltaFileName, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+            std::vector<char> buffer(bufferSize);
+
+            ::posix_fadvise(image.Get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+            if (!dev.isIncremental)
+            {
+                dev.progress->totalBytes = dev.info.device_capacity;
+                dev.progress->totalRanges = 1;
+                dev.progress->isTotalKnown = true;
+                CopyRange(image.Get(), delta.Get(), blksnap::SRange(0, dev.info.device_capacity >> SECTOR_SHIFT),
+                          buffer, *dev.progress);
+                dev.progress->isDone = true;
+                return;
+            }
+
+            /*
+             * The map is read once while the snapshot is held, so the amount
+             * of changes is counted for the progress at the same time as the
+             * changes are copied. The totals are final after the last window.
+             */
+            CBlkFilterCtl ctl(dev.path);
+            ReadChangedRanges(ctl, dev, window, [&](const std::vector<blksnap::SRange>& ranges) {
+                unsigned long long sectors = 0;
+
+                for (const blksnap::SRange& rg : ranges)
+                    sectors += rg.count;
+                dev.progress->totalBytes += sectors << SECTOR_SHIFT;
+                dev.progress->totalRanges += ranges.size();
+
+                for (const blksnap::SRange& rg : ranges)
+                    CopyRange(image.Get(), delta.Get(), rg, buffer, *dev.progress);
+            });
+            dev.progress->isTotalKnown = true;
+            dev.progress->isDone = true;
+        }
+        catch (...)
+        {
+            dev.error = std::current_exception();
+        }
+    };
+
+public:
+    BackupArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Create a full or incremental backup of the block devices.");
+        m_desc.add_options()
+            ("device,d", po::value<std::vector<std::string>>()->multitoken(), "Device name. It's multitoken argument.")
+            ("file,f", po::value<std::string>(), "File for difference storage.")
+            ("limit,l", po::value<std::string>(), "The allowable limit for the size of the difference storage file. The suffixes M, K and G is allowed.")
+            ("output,o", po::value<std::string>(), "The directory for the delta files and the new checkpoints.")
+            ("checkpoint,c", po::value<std::string>(), "The directory with the checkpoints of the previous backup. If it's not set, the full backup is created.")
+            ("window,w", po::value<unsigned int>()->default_value(32 * 1024), "The number of blocks of the change tracking map read at once.")
+            ("buffer,b", po::value<std::string>()->default_value("1M"), "The size of the read buffer for each device. The suffixes M and K is allowed.")
+            ("progress,p", po::value<std::string>(), "Report the progress in 'json' or 'human' format.")
+            ("progress-fd", po::value<int>()->default_value(STDERR_FILENO), "The descriptor for the progress reports. By default, it's stderr.")
+            ("progress-interval", po::value<unsigned int>()->default_value(1000), "The interval between the progress reports in milliseconds.");
+    };
+
+    void Execute(po::variables_map& vm) override
+    {
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+        if (!vm.count("file"))
+            throw std::invalid_argument("Argument 'file' is missed.");
+        if (!vm.count("limit"))
+            throw std::invalid_argument("Argument 'limit' is missed.");
+        if (!vm.count("output"))
+            throw std::invalid_argument("Argument 'output' is missed.");
+
+        std::string outputDir = vm["output"].as<std::string>();
+        fs::create_directories(outputDir);
+
+        unsigned int window = vm["window"].as<unsigned int>();
+        if (!window)
+            throw std::invalid_argument("Argument 'window' cannot be zero.");
+        size_t bufferSize = static_cast<size_t>(parseSize(vm["buffer"].as<std::string>()));
+        if (bufferSize < SECTOR_SIZE)
+            throw std::invalid_argument("Argument 'buffer' is too small.");
+
+        std::vector<SDevice> devices;
+        for (const std::string& devicePath : vm["device"].as<std::vector<std::string>>())
+        {
+            SDevice dev;
+
+            dev.path = devicePath;
+            dev.name = fs::path(devicePath).filename().string();
+            dev.isIncremental = false;
+            dev.snapNumber = 0;
+            dev.progress = std::make_shared<STransferProgress>();
+            devices.push_back(dev);
+        }
+
+        std::unique_ptr<CProgressReporter> reporter;
+        if (vm.count("progress"))
+        {
+            std::string format = vm["progress"].as<std::string>();
+            if ((format != "json") && (format != "human"))
+                throw std::invalid_argument("Invalid progress format '" + format + "'.");
+            if (!vm["progress-interval"].as<unsigned int>())
+                throw std::invalid_argument("Argument 'progress-interval' cannot be zero.");
+
+            reporter.reset(new CProgressReporter(vm["progress-fd"].as<int>(), format == "json",
+                                                 vm["progress-interval"].as<unsigned int>()));
+            for (const SDevice& dev : devices)
+                reporter->Add(dev.path, dev.progress);
+        }
+
+        // Create snapshot
+        CBlksnapFileWrap blksnapFd;
+        std::string diffStorage = vm["file"].as<std::string>();
+        struct blksnap_snapshot_create createParam = {0};
+        createParam.diff_storage_limit_sect = parseSize(vm["limit"].as<std::string>()) / SECTOR_SIZE;
+        createParam.diff_storage_filename = (__u64)diffStorage.c_str();
+        if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_CREATE, &createParam))
+            throw std::system_error(errno, std::generic_category(), "Failed to create snapshot object.");
+
+        struct blksnap_uuid id;
+        uuid_copy(id.b, createParam.id.b);
+        bool isDestroyed = false;
+        auto destroy = [&]() {
+            if (isDestroyed)
+                return;
+            isDestroyed = true;
+            if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_DESTROY, &id))
+                throw std::system_error(errno, std::generic_category(), "Failed to destroy snapshot.");
+        };
+
+        try
+        {
+            for (const SDevice& dev : devices)
+                SnapshotAdd(id.b, dev.path);
+
+            if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_TAKE, &id))
+                throw std::system_error(errno, std::generic_category(), "Failed to take snapshot");
+
+            for (SDevice& dev : devices)
+            {
+                CBlkFilterCtl ctl(dev.path);
+                struct blksnap_snapshotinfo snapshotInfo;
+
+                ctl.Control(BLKFILTER_CTL_BLKSNAP_CBTINFO, &dev.info, sizeof(dev.info));
+                ctl.Control(BLKFILTER_CTL_BLKSNAP_SNAPSHOTINFO, &snapshotInfo, sizeof(snapshotInfo));
+
+                std::vector<char> image(IMAGE_DISK_NAME_LEN + 1);
+                strncpy(image.data(), reinterpret_cast<char *>(snapshotInfo.image), IMAGE_DISK_NAME_LEN);
+                dev.image = std::string("/dev/") + std::string(image.data());
+
+                Uuid generationId;
+                unsigned int snapNumber;
+                if (vm.count("checkpoint")
+                    && ReadCheckpoint(vm["checkpoint"].as<std::string>() + "/" + dev.name + ".checkpoint",
+                                      generationId, snapNumber))
+                {
+                    if (uuid_compare(generationId.Get(), dev.info.generation_id.b) || (snapNumber > UINT8_MAX))
+                        std::cerr << "The change tracker of the device [" << dev.path
+                                  << "] was reset, the full backup is created." << std::endl;
+                    else
+                    {
+                        dev.isIncremental = true;
+                        dev.snapNumber = snapNumber;
+                    }
+                }
+            }
+
+            if (reporter)
+                reporter->Start();
+            std::vector<std::thread> threads;
+            for (SDevice& dev : devices)
+                threads.emplace_back(BackupDevice, std::ref(dev), outputDir, window, bufferSize);
+            for (std::thread& thread : threads)
+                thread.join();
+            if (reporter)
+                reporter->Stop();
+
+            for (SDevice& dev : devices)
+            {
+                struct blksnap_snapshotinfo snapshotInfo;
+
+                CBlkFilterCtl(dev.path).Control(BLKFILTER_CTL_BLKSNAP_SNAPSHOTINFO, &snapshotInfo,
+                                                sizeof(snapshotInfo));
+                if (snapshotInfo.error_code && !dev.error)
+                    dev.error = std::make_exception_ptr(std::system_error(
+                        snapshotInfo.error_code, std::generic_category(), "The snapshot was corrupted"));
+            }
+
+            // The images are drained, the snapshot is no longer needed
+            destroy();
+        }
+        catch (...)
+        {
+            try
+            {
+                destroy();
+            }
+            catch (std::exception& ex)
+            {
+                std::cerr << ex.what() << std::endl;
+            }
+            throw;
+        }
+
+        bool isFailed = false;
+        for (const SDevice& dev : devices)
+        {
+            if (dev.error)
+            {
+                try
+                {
+                    std::rethrow_exception(dev.error);
+                }
+                catch (std::exception& ex)
+                {
+                    std::cerr << "Failed to backup device [" << dev.path << "]: " << ex.what() << std::endl;
+                }
+                isFailed = true;
+                continue;
+            }
+
+            WriteCheckpoint(outputDir + "/" + dev.name + ".checkpoint", dev.info);
+            std::cout << "device=" << dev.path << " mode=" << (dev.isIncremental ? "incremental" : "full")
+                      << " bytes=" << dev.progress->bytes << std::endl;
+        }
+        if (isFailed)
+            throw std::runtime_error("Backup failed.");
+    };
+};
+
+/*
+ * The simple I/O generator for the bench command. It uses the native Linux
+ * AIO with O_DIRECT, so the queue depth is kept without additional threads.
+ * The write is performed as a read of the block and a write of the same data
+ * back, so the contents of the device are not changed. Only the time of the
+ * write is measured.
+ */
+class CAioBench
+{
+public:
+    struct SResult
+    {
+        std::string name;
+        unsigned long long ioCount;
+        double seconds;
+        std::vector<uint64_t> latencies;
+    };
+
+    CAioBench(const unsigned int queueDepth, const size_t blockSize)
+        : m_ctx(0)
+        , m_blockSize(blockSize)
+        , m_slots(queueDepth)
+        , m_random(std::random_device{}())
+    {
+        if (::syscall(__NR_io_setup, queueDepth, &m_ctx))
+            throw std::system_error(errno, std::generic_category(), "Failed to setup AIO context.");
+
+        for (SSlot& slot : m_slots)
+        {
+            void* buf;
+
+            if (::posix_memalign(&buf, 4096, blockSize))
+                throw std::runtime_error("Failed to allocate buffer.");
+            slot.buffer = static_cast<char*>(buf);
+        }
+    };
+    ~CAioBench()
+    {
+        for (SSlot& slot : m_slots)
+            ::free(slot.buffer);
+        ::syscall(__NR_io_destroy, m_ctx);
+    };
+
+    /*
+     * If the seconds is zero, the region is passed once sequentially.
+     */
+    SResult Run(const std::string& name, const int fd, const bool isWrite, const bool isRandom,
+                const unsigned long long offset, const unsigned long long size, const double seconds)
+    {
+        SResult result = {name, 0, 0, {}};
+        const unsigned long long blockCount = size / m_blockSize;
+        unsigned long long cursor = 0;
+        unsigned int inflight = 0;
+        bool isStopped = false;
+        std::vector<struct io_event> events(m_slots.size());
+        auto start = std::chrono::steady_clock::now();
+
+        if (!blockCount)
+            throw std::invalid_argument("The benchmark region is too small.");
+
+        auto next = [&](SSlot& slot) -> bool {
+            if (!isStopped && seconds
+                && (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= seconds))
+                isStopped = true;
+            if (!isStopped && !seconds && (cursor == blockCount))
+                isStopped = true;
+            if (isStopped)
+                return false;
+
+            unsigned long long block = isRandom ? (m_random() % blockCount) : (cursor++ % blockCount);
+            slot.offset = offset + block * m_blockSize;
+            slot.isWriting = false;
+            // The write begins with reading the data that is written back
+            Submit(slot, fd, IOCB_CMD_PREAD);
+            return true;
+        };
+
+        for (SSlot& slot : m_slots)
+            if (next(slot))
+                inflight++;
+
+        while (inflight)
+        {
+            int ret = ::syscall(__NR_io_getevents, m_ctx, 1, events.size(), events.data(), nullptr);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "Failed to get AIO events.");
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            for (int inx = 0; inx < ret; inx++)
+            {
+                SSlot& slot = m_slots[events[inx].data];
+
+                if (events[inx].res != static_cast<__s64>(m_blockSize))
+                    throw std::system_error(events[inx].res < 0 ? -events[inx].res : EIO, std::generic_category(),
+                                            "Failed to perform I/O.");
+
+                if (isWrite && !slot.isWriting)
+                {
+                    slot.isWriting = true;
+                    Submit(slot, fd, IOCB_CMD_PWRITE);
+                    continue;
+                }
+
+                result.latencies.push_back(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(now - slot.start).count());
+                result.ioCount++;
+                if (!next(slot))
+                    inflight--;
+            }
+        }
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    };
+
+private:
+    struct SSlot
+    {
+        struct iocb cb;
+        char* buffer;
+        unsigned long long offset;
+        bool isWriting;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    void Submit(SSlot& slot, const int fd, const unsigned int opcode)
+    {
+        struct iocb* cbs[1] = {&slot.cb};
+
+        memset(&slot.cb, 0, sizeof(slot.cb));
+        slot.cb.aio_data = &slot - m_slots.data();
+        slot.cb.aio_lio_opcode = opcode;
+        slot.cb.aio_fildes = fd;
+        slot.cb.aio_buf = reinterpret_cast<__u64>(slot.buffer);
+        slot.cb.aio_nbytes = m_blockSize;
+        slot.cb.aio_offset = slot.offset;
+        slot.start = std::chrono::steady_clock::now();
+
+        if (::syscall(__NR_io_submit, m_ctx, 1, cbs) != 1)
+            throw std::system_error(errno, std::generic_category(), "Failed to submit AIO.");
+    };
+
+private:
+    aio_context_t m_ctx;
+    size_t m_blockSize;
+    std::vector<SSlot> m_slots;
+    std::mt19937_64 m_random;
+};
+
+class BenchArgsProc : public IArgsProc
+{
+private:
+    static void PrintResult(std::ostream& output, CAioBench::SResult& result, const size_t blockSize)
+    {
+        std::vector<uint64_t>& lat = result.latencies;
+        double avg = 0;
+
+        std::sort(lat.begin(), lat.end());
+        for (uint64_t value : lat)
+            avg += value;
+        if (!lat.empty())
+            avg /= lat.size();
+
+        auto percentile = [&lat](const double p) -> double {
+            return lat.empty() ? 0 : lat[std::min(lat.size() - 1, static_cast<size_t>(p * lat.size()))] / 1000.0;
+        };
+
+        output << "{\"name\":\"" << result.name << "\""
+               << ",\"io_count\":" << result.ioCount
+               << ",\"seconds\":" << result.seconds
+               << ",\"iops\":" << (result.seconds > 0 ? result.ioCount / result.seconds : 0)
+               << ",\"bandwidth_bytes\":" << (result.seconds > 0 ? result.ioCount * blockSize / result.seconds : 0)
+               << ",\"lat_avg_us\":" << avg / 1000.0
+               << ",\"lat_p50_us\":" << percentile(0.5)
+               << ",\"lat_p99_us\":" << percentile(0.99)
+               << ",\"lat_max_us\":" << (lat.empty() ? 0 : lat.back() / 1000.0) << "}";
+    };
+
+public:
+    BenchArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Measure the overhead of the snapshot and the snapshot image read performance.");
+        m_desc.add_options()
+            ("device,d", po::value<std::string>(), "Device name. The contents of the tested region are overwritten, the blocks are read and written back. The device is opened exclusively, so a mounted or used device is refused.")
+            ("file,f", po::value<std::string>(), "File for difference storage.")
+            ("limit,l", po::value<std::string>()->default_value("1G"), "The allowable limit for the size of the difference storage file. The suffixes M, K and G is allowed.")
+            ("offset", po::value<std::string>()->default_value("0"), "The offset of the tested region on the device. The suffixes M, K and G is allowed.")
+            ("size,s", po::value<std::string>()->default_value("256M"), "The size of the tested region, the hot set. The suffixes M, K and G is allowed.")
+            ("block-size,b", po::value<std::string>()->default_value("4K"), "The size of I/O unit. The suffixes M and K is allowed.")
+            ("queue-depth,q", po::value<unsigned int>()->default_value(32), "The number of I/O units in flight.")
+            ("time,t", po::value<double>()->default_value(10.0), "The duration of each test in seconds.");
+    };
+
+    void Execute(po::variables_map& vm) override
+    {
+        if (!vm.count("device"))
+            throw std::invalid_argument("Argument 'device' is missed.");
+        if (!vm.count("file"))
+            throw std::invalid_argument("Argument 'file' is missed.");
+
+        std::string devicePath = vm["device"].as<std::string>();
+        unsigned long long offset = parseSize(vm["offset"].as<std::string>());
+        unsigned long long size = parseSize(vm["size"].as<std::string>());
+        size_t blockSize = static_cast<size_t>(parseSize(vm["block-size"].as<std::string>()));
+        unsigned int queueDepth = vm["queue-depth"].as<unsigned int>();
+        double seconds = vm["time"].as<double>();
+
+        if (!blockSize || (blockSize & (SECTOR_SIZE - 1)) || (offset & (SECTOR_SIZE - 1)))
+            throw std::invalid_argument("The block size and the offset should be multiples of the sector size.");
+        if (!queueDepth)
+            throw std::invalid_argument("Argument 'queue-depth' cannot be zero.");
+        if (seconds <= 0)
+            throw std::invalid_argument("Argument 'time' should be positive.");
+
+        /*
+         * The region is overwritten, so the device that is mounted or used
+         * by another process is refused.
+         */
+        OpenFileHolder device(devicePath, O_RDWR | O_DIRECT | O_LARGEFILE | O_EXCL);
+        unsigned long long deviceSize;
+        if (::ioctl(device.Get(), BLKGETSIZE64, &deviceSize))
+            throw std::system_error(errno, std::generic_category(), "Failed to get size of device.");
+        if (offset >= deviceSize)
+            throw std::invalid_argument("Argument 'offset' is out of the device.");
+        size = std::min(size, deviceSize - offset);
+
+        CAioBench bench(queueDepth, blockSize);
+        std::vector<CAioBench::SResult> results;
+
+        results.push_back(bench.Run("write_nosnap", device.Get(), true, true, offset, size, seconds));
+
+        CBlksnapFileWrap blksnapFd;
+        std::string diffStorage = vm["file"].as<std::string>();
+        struct blksnap_snapshot_create createParam = {0};
+        createParam.diff_storage_limit_sect = parseSize(vm["limit"].as<std::string>()) / SECTOR_SIZE;
+        createParam.diff_storage_filename = (__u64)diffStorage.c_str();
+        if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_CREATE, &createParam))
+            throw std::system_error(errno, std::generic_category(), "Failed to create snapshot object.");
+
+        struct blksnap_uuid id;
+        uuid_copy(id.b, createParam.id.b);
+        try
+        {
+            SnapshotAdd(id.b, devicePath);
+            if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_TAKE, &id))
+                throw std::system_error(errno, std::generic_category(), "Failed to take snapshot");
+
+            struct blksnap_snapshotinfo snapshotInfo;
+            CBlkFilterCtl(devicePath).Control(BLKFILTER_CTL_BLKSNAP_SNAPSHOTINFO, &snapshotInfo, sizeof(snapshotInfo));
+            std::vector<char> imageName(IMAGE_DISK_NAME_LEN + 1);
+            strncpy(imageName.data(), reinterpret_cast<char *>(snapshotInfo.image), IMAGE_DISK_NAME_LEN);
+            OpenFileHolder image(std::string("/dev/") + std::string(imageName.data()), O_RDONLY | O_DIRECT | O_LARGEFILE);
+
+            // The first writes to the chunks cause copy-on-write
+            results.push_back(bench.Run("write_cow", device.Get(), true, true, offset, size, seconds));
+            // Complete the copy-on-write of the whole hot set
+            bench.Run("cow_fill", device.Get(), true, false, offset, size, 0);
+            results.push_back(bench.Run("write_after_cow", device.Get(), true, true, offset, size, seconds));
+
+            results.push_back(bench.Run("image_read_seq", image.Get(), false, false, offset, size, seconds));
+            results.push_back(bench.Run("image_read_rand", image.Get(), false, true, offset, size, seconds));
+
+            struct blksnap_snapshotinfo info;
+            CBlkFilterCtl(devicePath).Control(BLKFILTER_CTL_BLKSNAP_SNAPSHOTINFO, &info, sizeof(info));
+            if (info.error_code)
+                throw std::system_error(info.error_code, std::generic_category(), "The snapshot was corrupted");
+        }
+        catch (...)
+        {
+            ::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_DESTROY, &id);
+            throw;
+        }
+        if (::ioctl(blksnapFd.get(), IOCTL_BLKSNAP_SNAPSHOT_DESTROY, &id))
+            throw std::system_error(errno, std::generic_category(), "Failed to destroy snapshot.");
+
+        std::cout << "{\"device\":\"" << devicePath << "\",\"offset\":" << offset << ",\"size\":" << size
+                  << ",\"block_size\":" << blockSize << ",\"queue_depth\":" << queueDepth << ",\"results\":[";
+        for (size_t inx = 0; inx < results.size(); inx++)
+        {
+            std::cout << (inx ? "," : "");
+            PrintResult(std::cout, results[inx], blockSize);
+        }
+        std::cout << "]}" << std::endl;
+    };
+};
+
+class BatchArgsProc : public IArgsProc
+{
+public:
+    BatchArgsProc()
+        : IArgsProc()
+    {
+        m_usage = std::string("Execute the commands from the file or stdin in one process.");
+        m_desc.add_options()
+            ("file,f", po::value<std::string>(), "The file with the commands. By default, the commands are read from stdin.")
+            ("stop-on-error", "Stop the execution after the first failed command.");
+    };
+
+    void Execute(po::variables_map& vm) override;
+};
+
 static std::map<std::string, std::shared_ptr<IArgsProc>> argsProcMap{
   {"version", std::make_shared<VersionArgsProc>()},
   {"attach", std::make_shared<AttachArgsProc>()},
   {"detach", std::make_shared<DetachArgsProc>()},
   {"cbtinfo", std::make_shared<CbtInfoArgsProc>()},
   {"readcbtmap", std::make_shared<ReadCbtMapArgsProc>()},
+  {"cbtdiff", std::make_shared<CbtDiffArgsProc>()},
   {"markdirtyblock", std::make_shared<MarkDirtyBlockArgsProc>()},
   {"snapshot_info", std::make_shared<SnapshotInfoArgsProc>()},
   {"snapshot_add", std::make_shared<SnapshotAddArgsProc>()},
@@ -990,8 +2518,97 @@ static std::map<std::string, std::shared_ptr<IArgsProc>> argsProcMap{
   {"snapshot_waitevent", std::make_shared<SnapshotWaitEventArgsProc>()},
   {"snapshot_collect", std::make_shared<SnapshotCollectArgsProc>()},
   {"snapshot_watcher", std::make_shared<SnapshotWatcherArgsProc>()},
+  {"backup", std::make_shared<BackupArgsProc>()},
+  {"bench", std::make_shared<BenchArgsProc>()},
+  {"batch", std::make_shared<BatchArgsProc>()},
 };
 
+/*
+ * Each line contains the command with arguments in the same form as in the
+ * command line. The result of each command is printed as a JSON object on a
+ * separate line, and the output of the command is passed in it. The output
+ * that is not a UTF-8 text is passed in base64.
+ */
+void BatchArgsProc::Execute(po::variables_map& vm)
+{
+    std::ifstream inputFile;
+    if (vm.count("file"))
+    {
+        inputFile.open(vm["file"].as<std::string>());
+        if (!inputFile.is_open())
+            throw std::runtime_error("Failed to open file [" + vm["file"].as<std::string>() + "].");
+    }
+    std::istream& input = vm.count("file") ? inputFile : std::cin;
+    bool isStopOnError = vm.count("stop-on-error");
+    bool isFailed = false;
+    std::string line;
+    unsigned int lineNumber = 0;
+
+    isKeepDescriptors = true;
+    while (std::getline(input, line))
+    {
+        lineNumber++;
+
+        std::vector<std::string> args = po::split_unix(line);
+        if (args.empty() || (args[0][0] == '#'))
+            continue;
+
+        std::vector<char*> argv;
+        std::string programName("blksnap");
+        argv.push_back(&programName[0]);
+        for (std::string& arg : args)
+            argv.push_back(&arg[0]);
+
+        std::ostringstream output;
+        std::streambuf* coutBuf = std::cout.rdbuf(output.rdbuf());
+        std::string errorMessage;
+        try
+        {
+            const auto& itArgsProc = argsProcMap.find(args[0]);
+            if ((itArgsProc == argsProcMap.end()) || (args[0] == "batch"))
+                throw std::runtime_error("Command '" + args[0] + "' is not supported.");
+
+            itArgsProc->second->Process(static_cast<int>(argv.size() - 1), argv.data() + 1);
+        }
+        catch (std::exception& ex)
+        {
+            errorMessage = ex.what();
+        }
+        std::cout.rdbuf(coutBuf);
+
+        std::cout << "{\"line\":" << lineNumber << ",\"command\":\"" << jsonEscape(args[0]) << "\",\"result\":\""
+                  << (errorMessage.empty() ? "ok" : "error") << "\"";
+        /*
+         * The output in the binary format cannot be passed in a JSON string.
+         */
+        if (isUtf8(output.str()))
+            std::cout << ",\"output\":\"" << jsonEscape(output.str()) << "\"";
+        else
+            std::cout << ",\"output_base64\":\"" << base64Encode(output.str()) << "\"";
+        if (!errorMessage.empty())
+            std::cout << ",\"error\":\"" << jsonEscape(errorMessage) << "\"";
+        std::cout << "}" << std::endl;
+
+        if (!errorMessage.empty())
+        {
+            isFailed = true;
+            if (isStopOnError)
+                break;
+        }
+    }
+
+    isKeepDescriptors = false;
+    if (blksnapFdCache >= 0)
+        ::close(blksnapFdCache);
+    blksnapFdCache = -1;
+    for (const auto& it : deviceFdCache)
+        ::close(it.second);
+    deviceFdCache.clear();
+
+    if (isFailed)
+        throw std::runtime_error("Some of the commands failed.");
+}
+
 static void printUsage()
 {
     std::cout << "Usage:" << std::endl;
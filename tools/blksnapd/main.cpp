@@ -0,0 +1,1153 @@
+// SPDX-License-Identifier: GPL-2.0+
+#include <blksnap/CbtMap.h>
+#include <blksnap/Service.h>
+#include <blksnap/Snapshot.h>
+#include <blksnap/Tracker.h>
+#include <boost/program_options.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace po = boost::program_options;
+
+/*
+ * The daemon serves the clients over the Unix domain socket. Each request
+ * is a line of words separated by spaces. The response begins with the line
+ * 'ok' or 'error' followed by the result. The lists of the 'collect' and
+ * 'ranges' requests end with the line 'end'. The events of the subscribed
+ * snapshots are sent to the client as the lines that begin with 'event',
+ * but never inside a response.
+ *
+ * All requests except 'version' and 'unsubscribe' are executed by the worker
+ * thread, so the ioctls do not stop the event loop. The requests of one
+ * client are executed in order.
+ *
+ * Requests:
+ *   version
+ *   attach <device>
+ *   detach <device>
+ *   create <diff_storage> <limit_bytes> <device> [<device> ...]
+ *   take <id>
+ *   destroy <id>
+ *   collect
+ *   cbtinfo <device>
+ *   ranges <device> <snap_number>
+ *   image <device>
+ *   subscribe <id>
+ *   unsubscribe <id>
+ *
+ * If the metrics file is set, the state of the change trackers and snapshots
+ * is written to it periodically in the Prometheus text format.
+ */
+
+static const char* defaultSocketPath = "/run/blksnapd.sock";
+static const unsigned int watchIntervalMs = 100;
+static const size_t cbtWindow = 32 * 1024;
+static const unsigned int defaultMetricsInterval = 10;
+static const unsigned int untrackedCheckInterval = 300;
+
+static std::atomic<bool> isTerminate(false);
+
+static void signalHandler(int)
+{
+    isTerminate = true;
+}
+
+static std::string errorResponse(const std::exception& ex)
+{
+    std::string message(ex.what());
+
+    std::replace(message.begin(), message.end(), '\n', ' ');
+    return "error " + message + "\n";
+}
+
+/*
+ * Reads the change tracking map by windows, so the ranges are sent to the
+ * client while the rest of the map is being read.
+ */
+class CRangeReader
+{
+public:
+    CRangeReader(const std::string& device, const uint8_t snapNumber)
+        : m_device(device)
+        , m_snapNumber(snapNumber)
+        , m_offset(0)
+    {};
+
+    /*
+     * Reads the next window and appends the ranges completed in it to the
+     * output. Returns true when the whole map has been read.
+     */
+    bool Read(std::string& output)
+    {
+        std::vector<blksnap::SRange> ranges;
+        std::ostringstream ss;
+
+        if (!m_ptrTracker)
+        {
+            m_ptrTracker = std::make_shared<blksnap::CTracker>(m_device);
+            m_ptrTracker->CbtInfo(m_info);
+            m_ptrExtractor = std::make_shared<blksnap::CCbtRangeExtractor>(m_info.block_size,
+                                                                           m_info.device_capacity, m_snapNumber);
+            m_map.resize(std::min(cbtWindow, static_cast<size_t>(m_info.block_count)));
+        }
+
+        if (m_offset < m_info.block_count)
+        {
+            unsigned int length = std::min(static_cast<unsigned int>(m_map.size()), m_info.block_count - m_offset);
+
+            m_ptrTracker->ReadCbtMap(m_offset, length, m_map.data());
+            m_ptrExtractor->Process(m_map.data(), length, ranges);
+            m_offset += length;
+        }
+
+        const bool isFinished = (m_offset >= m_info.block_count);
+        if (isFinished)
+            m_ptrExtractor->Finish(ranges);
+
+        for (const blksnap::SRange& rg : ranges)
+            ss << rg.sector << ":" << rg.count << "\n";
+        if (isFinished)
+            ss << "end\n";
+        output += ss.str();
+        return isFinished;
+    };
+
+private:
+    std::string m_device;
+    uint8_t m_snapNumber;
+    unsigned int m_offset;
+    std::shared_ptr<blksnap::CTracker> m_ptrTracker;
+    std::shared_ptr<blksnap::CCbtRangeExtractor> m_ptrExtractor;
+    struct blksnap_cbtinfo m_info;
+    std::vector<uint8_t> m_map;
+};
+
+class CDaemon
+{
+public:
+    CDaemon(const std::string& socketPath, const std::string& metricsFile, const unsigned int metricsInterval)
+        : m_socketPath(socketPath)
+        , m_metricsFile(metricsFile)
+        , m_metricsInterval(metricsInterval)
+        , m_listenFd(-1)
+        , m_epollFd(-1)
+        , m_eventFd(-1)
+        , m_nextClientId(0)
+        , m_corruptedEvents(0)
+        , m_isFilterAttached(false)
+    {
+        struct sockaddr_un addr = {0};
+
+        if (socketPath.size() >= sizeof(addr.sun_path))
+            throw std::invalid_argument("The socket path is too long.");
+
+        m_listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_listenFd < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to create socket.");
+
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+        ::unlink(socketPath.c_str());
+
+        /*
+         * The socket is created with the permissions for the owner only.
+         * Changing the mode after bind() would leave a moment when other
+         * users could connect.
+         */
+        mode_t mask = ::umask(0177);
+        int ret = ::bind(m_listenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+        int error = errno;
+        ::umask(mask);
+        if (ret)
+            throw std::system_error(error, std::generic_category(), "Failed to bind socket [" + socketPath + "].");
+        if (::listen(m_listenFd, SOMAXCONN))
+            throw std::system_error(errno, std::generic_category(), "Failed to listen socket.");
+
+        m_eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (m_eventFd < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to create eventfd.");
+
+        m_epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+        if (m_epollFd < 0)
+            throw std::system_error(errno, std::generic_category(), "Failed to create epoll.");
+
+        AddFd(m_listenFd, EPOLLIN);
+        AddFd(m_eventFd, EPOLLIN);
+    };
+
+    ~CDaemon()
+    {
+        for (const auto& it : m_clients)
+            ::close(it.first);
+        if (m_epollFd >= 0)
+            ::close(m_epollFd);
+        if (m_eventFd >= 0)
+            ::close(m_eventFd);
+        if (m_listenFd >= 0)
+        {
+            ::close(m_listenFd);
+            ::unlink(m_socketPath.c_str());
+        }
+    };
+
+    void Run()
+    {
+        std::thread watcher(&CDaemon::Watcher, this);
+        std::thread worker(&CDaemon::Worker, this);
+        std::thread metrics;
+        std::vector<struct epoll_event> events(64);
+
+        if (!m_metricsFile.empty())
+            metrics = std::thread(&CDaemon::MetricsWriter, this);
+
+        while (!isTerminate)
+        {
+            int count = ::epoll_wait(m_epollFd, events.data(), events.size(), -1);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                isTerminate = true;
+                watcher.join();
+                worker.join();
+                if (metrics.joinable())
+                    metrics.join();
+                throw std::system_error(errno, std::generic_category(), "Failed to wait epoll.");
+            }
+
+            for (int inx = 0; inx < count; inx++)
+            {
+                int fd = events[inx].data.fd;
+
+                if (fd == m_listenFd)
+                    Accept();
+                else if (fd == m_eventFd)
+                    DeliverEvents();
+                else
+                {
+                    if (events[inx].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                        Receive(fd);
+                    if ((events[inx].events & EPOLLOUT) && m_clients.count(fd))
+                        Send(fd);
+                }
+            }
+        }
+        watcher.join();
+        worker.join();
+        if (metrics.joinable())
+            metrics.join();
+    };
+
+private:
+    struct SLatency
+    {
+        SLatency()
+            : sum(0)
+            , count(0)
+        {};
+
+        double sum;
+        unsigned long long count;
+    };
+
+    struct SClient;
+
+    /*
+     * The request that is executed by the worker thread. The step is called
+     * again and again until it returns true. The next step is called only
+     * after the output of the previous one has been sent to the client.
+     */
+    struct SJob
+    {
+        SJob(const int fd, const unsigned long long clientId, const std::function<bool(std::string&)>& step,
+             const std::function<void(SClient&)>& complete)
+            : fd(fd)
+            , clientId(clientId)
+            , step(step)
+            , complete(complete)
+            , isQueued(false)
+            , isStarted(false)
+            , isDone(false)
+            , isFailed(false)
+        {};
+
+        int fd;
+        unsigned long long clientId;
+        std::function<bool(std::string&)> step;
+        // Called on the event loop thread if the job has succeeded.
+        std::function<void(SClient&)> complete;
+        std::string output;
+        bool isQueued;
+        bool isStarted;
+        bool isDone;
+        bool isFailed;
+    };
+
+    struct SClient
+    {
+        SClient()
+            : id(0)
+        {};
+
+        unsigned long long id;
+        std::string input;
+        std::string output;
+        std::set<std::string> subscriptions;
+        /*
+         * While the job is executed, the next requests wait in the input
+         * and the events wait here.
+         */
+        std::shared_ptr<SJob> job;
+        std::string events;
+    };
+
+    void AddFd(const int fd, const uint32_t flags)
+    {
+        struct epoll_event ev = {0};
+
+        ev.events = flags;
+        ev.data.fd = fd;
+        if (::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &ev))
+            throw std::system_error(errno, std::generic_category(), "Failed to add descriptor to epoll.");
+    };
+
+    void Accept()
+    {
+        while (true)
+        {
+            int fd = ::accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            AddFd(fd, EPOLLIN);
+            m_clients[fd] = SClient();
+            m_clients[fd].id = ++m_nextClientId;
+        }
+    };
+
+    void Close(const int fd)
+    {
+        std::set<std::string> subscriptions;
+
+        subscriptions.swap(m_clients[fd].subscriptions);
+        ::epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        m_clients.erase(fd);
+        for (const std::string& id : subscriptions)
+            Unsubscribe(id);
+    };
+
+    void Receive(const int fd)
+    {
+        char buf[4096];
+        ssize_t ret;
+
+        while ((ret = ::read(fd, buf, sizeof(buf))) > 0)
+            m_clients[fd].input.append(buf, ret);
+
+        if ((ret == 0) || ((ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+        {
+            Close(fd);
+            return;
+        }
+
+        ProcessInput(fd);
+        Send(fd);
+    };
+
+    void ProcessInput(const int fd)
+    {
+        SClient& client = m_clients[fd];
+        size_t pos;
+
+        while (!client.job && ((pos = client.input.find('\n')) != std::string::npos))
+        {
+            std::string line = client.input.substr(0, pos);
+
+            client.input.erase(0, pos + 1);
+            client.output += Process(fd, client, line);
+        }
+    };
+
+    void Send(const int fd)
+    {
+        SClient& client = m_clients[fd];
+
+        while (!client.output.empty())
+        {
+            ssize_t ret = ::send(fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+            if (ret < 0)
+            {
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                    break;
+                Close(fd);
+                return;
+            }
+            client.output.erase(0, ret);
+        }
+
+        if (client.output.empty() && client.job && !client.job->isQueued)
+            QueueJob(client.job);
+
+        struct epoll_event ev = {0};
+        ev.events = client.output.empty() ? EPOLLIN : (EPOLLIN | EPOLLOUT);
+        ev.data.fd = fd;
+        ::epoll_ctl(m_epollFd, EPOLL_CTL_MOD, fd, &ev);
+    };
+
+    std::string Process(const int fd, SClient& client, const std::string& line)
+    {
+        std::istringstream ss(line);
+        std::vector<std::string> args;
+        std::string arg;
+
+        while (ss >> arg)
+            args.push_back(arg);
+        if (args.empty())
+            return std::string();
+
+        try
+        {
+            if (StartJob(fd, client, args))
+                return std::string();
+            return "ok\n" + Execute(client, args);
+        }
+        catch (std::exception& ex)
+        {
+            return errorResponse(ex);
+        }
+    };
+
+    /*
+     * Starts the requests that call the module or read the change tracking
+     * map, since any ioctl may block. The response is added to the output of
+     * the client when the job is completed.
+     */
+    bool StartJob(const int fd, SClient& client, const std::vector<std::string>& args)
+    {
+        const std::string& cmd = args[0];
+        std::function<bool(std::string&)> step;
+        std::function<void(SClient&)> complete;
+
+        auto checkArgs = [&args](const size_t count) {
+            if (args.size() < count)
+                throw std::invalid_argument("Not enough arguments.");
+        };
+
+        if ((cmd == "version") || (cmd == "unsubscribe"))
+            return false;
+
+        if (cmd == "ranges")
+        {
+            checkArgs(3);
+            unsigned int snapNumber = std::stoul(args[2]);
+            if (snapNumber > UINT8_MAX)
+                throw std::invalid_argument("The snapshot number is out of range.");
+
+            auto ptrReader = std::make_shared<CRangeReader>(args[1], snapNumber);
+            step = [ptrReader](std::string& output) {
+                return ptrReader->Read(output);
+            };
+        }
+        else if (cmd == "subscribe")
+        {
+            checkArgs(2);
+            const std::string id = args[1];
+            auto ptrSnapshot = std::make_shared<std::shared_ptr<blksnap::CSnapshot>>();
+
+            step = [this, id, ptrSnapshot](std::string&) {
+                *ptrSnapshot = FindSnapshot(id);
+                return true;
+            };
+            complete = [this, id, ptrSnapshot](SClient& client) {
+                Subscribe(client, id, *ptrSnapshot);
+            };
+        }
+        else
+        {
+            step = [this, args](std::string& output) {
+                output += ExecuteJob(args);
+                return true;
+            };
+        }
+
+        client.job = std::make_shared<SJob>(fd, client.id, step, complete);
+        QueueJob(client.job);
+        return true;
+    };
+
+    void QueueJob(const std::shared_ptr<SJob>& job)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+
+        job->isQueued = true;
+        m_jobs.push_back(job);
+        m_jobCond.notify_one();
+    };
+
+    std::shared_ptr<blksnap::CSnapshot> FindSnapshot(const std::string& id)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            const auto it = m_snapshots.find(id);
+
+            if (it != m_snapshots.end())
+                return it->second;
+        }
+        return blksnap::CSnapshot::Open(blksnap::CSnapshotId(id));
+    };
+
+    /*
+     * The snapshots that were not created by the daemon are watched only
+     * while someone is subscribed to them, since the watcher takes their
+     * events from the process that owns them.
+     */
+    void Subscribe(SClient& client, const std::string& id, const std::shared_ptr<blksnap::CSnapshot>& ptrSnapshot)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+
+            if (!m_snapshots.count(id))
+            {
+                m_snapshots[id] = ptrSnapshot;
+                m_foreignSnapshots.insert(id);
+            }
+        }
+        client.subscriptions.insert(id);
+    };
+
+    void Unsubscribe(const std::string& id)
+    {
+        for (const auto& it : m_clients)
+            if (it.second.subscriptions.count(id))
+                return;
+
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_foreignSnapshots.erase(id))
+            m_snapshots.erase(id);
+    };
+
+    /*
+     * The requests that are executed on the event loop thread.
+     */
+    std::string Execute(SClient& client, const std::vector<std::string>& args)
+    {
+        const std::string& cmd = args[0];
+        std::ostringstream result;
+
+        if (cmd == "version")
+        {
+            unsigned short major, minor, revision, build;
+
+            blksnap::CService().Version(major, minor, revision, build);
+            result << major << "." << minor << "." << revision << "." << build << "\n";
+        }
+        else if (cmd == "unsubscribe")
+        {
+            if (args.size() < 2)
+                throw std::invalid_argument("Not enough arguments.");
+            client.subscriptions.erase(args[1]);
+            Unsubscribe(args[1]);
+        }
+        return result.str();
+    };
+
+    /*
+     * The requests that are executed by the worker thread.
+     */
+    std::string ExecuteJob(const std::vector<std::string>& args)
+    {
+        const std::string& cmd = args[0];
+        std::ostringstream result;
+
+        auto checkArgs = [&args](const size_t count) {
+            if (args.size() < count)
+                throw std::invalid_argument("Not enough arguments.");
+        };
+
+        if (cmd == "attach")
+        {
+            checkArgs(2);
+            result << (blksnap::CTracker(args[1]).Attach() ? "attached" : "already attached") << "\n";
+            m_isFilterAttached = true;
+        }
+        else if (cmd == "detach")
+        {
+            checkArgs(2);
+            blksnap::CTracker(args[1]).Detach();
+        }
+        else if (cmd == "create")
+        {
+            checkArgs(4);
+
+            auto ptrSnapshot = blksnap::CSnapshot::Create(args[1], std::stoull(args[2]));
+            try
+            {
+                for (size_t inx = 3; inx < args.size(); inx++)
+                {
+                    blksnap::CTracker tracker(args[inx]);
+
+                    tracker.Attach();
+                    m_isFilterAttached = true;
+                    tracker.SnapshotAdd(ptrSnapshot->Id().Get());
+                }
+            }
+            catch (...)
+            {
+                ptrSnapshot->Destroy();
+                throw;
+            }
+
+            std::string id = ptrSnapshot->Id().ToString();
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                m_snapshots[id] = ptrSnapshot;
+            }
+            result << id << "\n";
+        }
+        else if (cmd == "take")
+        {
+            checkArgs(2);
+            auto ptrSnapshot = FindSnapshot(args[1]);
+
+            const auto start = std::chrono::steady_clock::now();
+            ptrSnapshot->Take();
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_takeLatency.sum += seconds;
+            m_takeLatency.count++;
+            m_sessionTakeLatency[args[1]] = seconds;
+        }
+        else if (cmd == "destroy")
+        {
+            checkArgs(2);
+            auto ptrSnapshot = FindSnapshot(args[1]);
+
+            const auto start = std::chrono::steady_clock::now();
+            ptrSnapshot->Destroy();
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_destroyLatency.sum += seconds;
+            m_destroyLatency.count++;
+            m_sessionTakeLatency.erase(args[1]);
+            m_snapshots.erase(args[1]);
+            m_foreignSnapshots.erase(args[1]);
+        }
+        else if (cmd == "collect")
+        {
+            std::vector<blksnap::CSnapshotId> ids;
+
+            blksnap::CService().Collect(ids);
+            for (const auto& id : ids)
+                result << id.ToString() << "\n";
+            result << "end\n";
+        }
+        else if (cmd == "cbtinfo")
+        {
+            struct blksnap_cbtinfo info;
+            char generationIdStr[64];
+
+            checkArgs(2);
+            blksnap::CTracker(args[1]).CbtInfo(info);
+            uuid_unparse(info.generation_id.b, generationIdStr);
+            result << "block_size=" << info.block_size << " block_count=" << info.block_count
+                   << " device_capacity=" << info.device_capacity << " generation_id=" << generationIdStr
+                   << " changes_number=" << static_cast<int>(info.changes_number) << "\n";
+        }
+        else if (cmd == "image")
+        {
+            struct blksnap_snapshotinfo info;
+
+            checkArgs(2);
+            blksnap::CTracker(args[1]).SnapshotInfo(info);
+            std::string name("/dev/");
+            for (int inx = 0; (inx < IMAGE_DISK_NAME_LEN) && (info.image[inx] != '\0'); inx++)
+                name += static_cast<char>(info.image[inx]);
+            result << name << " error_code=" << info.error_code << "\n";
+        }
+        else
+            throw std::invalid_argument("Unknown command '" + cmd + "'.");
+
+        return result.str();
+    };
+
+    /*
+     * The only thread that waits for the events of all snapshots. The events
+     * are passed to the main loop via the eventfd.
+     */
+    void Watcher()
+    {
+        while (!isTerminate)
+        {
+            std::vector<std::pair<std::string, std::shared_ptr<blksnap::CSnapshot>>> snapshots;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                snapshots.assign(m_snapshots.begin(), m_snapshots.end());
+            }
+
+            bool isReceived = false;
+            for (const auto& it : snapshots)
+            {
+                std::string message;
+
+                try
+                {
+                    blksnap::SBlksnapEvent ev;
+
+                    if (!it.second->WaitEvent(0, ev))
+                        continue;
+
+                    if (ev.code == blksnap_event_code_corrupted)
+                    {
+                        m_corruptedEvents++;
+                        message = "event " + it.first + " corrupted " + std::to_string(ev.corrupted.origDevIdMj) + ":"
+                                  + std::to_string(ev.corrupted.origDevIdMn) + " "
+                                  + std::to_string(ev.corrupted.errorCode);
+                    }
+                    else
+                        message = "event " + it.first + " code " + std::to_string(ev.code);
+                }
+                catch (std::system_error& ex)
+                {
+                    if (ex.code() != std::error_code(ESRCH, std::generic_category()))
+                        continue;
+
+                    message = "event " + it.first + " destroyed";
+                    std::lock_guard<std::mutex> guard(m_lock);
+                    m_sessionTakeLatency.erase(it.first);
+                    m_snapshots.erase(it.first);
+                    m_foreignSnapshots.erase(it.first);
+                }
+
+                {
+                    std::lock_guard<std::mutex> guard(m_lock);
+                    m_events.emplace_back(it.first, message + "\n");
+                }
+                isReceived = true;
+            }
+
+            if (isReceived)
+            {
+                Notify();
+                continue;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(watchIntervalMs));
+        }
+    };
+
+    /*
+     * Executes the steps of the jobs one at a time. The completed steps are
+     * passed to the main loop via the eventfd, as the events are.
+     */
+    void Worker()
+    {
+        while (!isTerminate)
+        {
+            std::shared_ptr<SJob> job;
+            {
+                std::unique_lock<std::mutex> guard(m_lock);
+
+                if (m_jobs.empty())
+                {
+                    m_jobCond.wait_for(guard, std::chrono::milliseconds(watchIntervalMs));
+                    continue;
+                }
+                job = m_jobs.front();
+                m_jobs.pop_front();
+            }
+
+            std::string output;
+            try
+            {
+                job->isDone = job->step(output);
+                if (!job->isStarted)
+                    output = "ok\n" + output;
+            }
+            catch (std::exception& ex)
+            {
+                /*
+                 * If the response has already been started, the error line
+                 * is sent instead of the end of the list.
+                 */
+                output = errorResponse(ex);
+                job->isDone = true;
+                job->isFailed = true;
+            }
+            job->isStarted = true;
+
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+
+                job->output = output;
+                m_completedJobs.push_back(job);
+            }
+            Notify();
+        }
+    };
+
+    void Notify()
+    {
+        uint64_t value = 1;
+
+        if (::write(m_eventFd, &value, sizeof(value)) < 0)
+            std::cerr << "Failed to signal eventfd: " << std::strerror(errno) << std::endl;
+    };
+
+    /*
+     * The descriptors of the block devices with the attached filter are kept
+     * open between the collections. The other devices are remembered as
+     * untracked and are checked again only when the list of the block
+     * devices changes, when the filter is attached by the daemon, or every
+     * untrackedCheckInterval seconds, since the filter can be attached by
+     * another process.
+     */
+    void UpdateTrackers()
+    {
+        std::set<std::string> names;
+        DIR* dir = ::opendir("/sys/class/block");
+
+        if (!dir)
+            return;
+        while (struct dirent* entry = ::readdir(dir))
+            if (entry->d_name[0] != '.')
+                names.insert(entry->d_name);
+        ::closedir(dir);
+
+        const auto now = std::chrono::steady_clock::now();
+        if (m_isFilterAttached.exchange(false) || (names != m_blockDevices) || (now >= m_untrackedCheckTime))
+        {
+            m_untracked.clear();
+            m_blockDevices = names;
+            m_untrackedCheckTime = now + std::chrono::seconds(untrackedCheckInterval);
+        }
+
+        for (auto it = m_trackers.begin(); it != m_trackers.end();)
+        {
+            if (names.count(it->first))
+                ++it;
+            else
+                it = m_trackers.erase(it);
+        }
+
+        for (const std::string& name : names)
+        {
+            if (m_trackers.count(name) || m_untracked.count(name))
+                continue;
+
+            try
+            {
+                auto ptrTracker = std::make_shared<blksnap::CTracker>("/dev/" + name);
+                struct blksnap_cbtinfo info;
+
+                ptrTracker->CbtInfo(info);
+                m_trackers[name] = ptrTracker;
+            }
+            catch (std::exception&)
+            {
+                // The filter is not attached to the device.
+                m_untracked.insert(name);
+            }
+        }
+    };
+
+    void WriteMetrics()
+    {
+        std::ostringstream ss;
+
+        UpdateTrackers();
+
+        std::ostringstream blockSize;
+        blockSize << "# HELP blksnap_cbt_block_size_bytes The size of the change tracking block.\n"
+                  << "# TYPE blksnap_cbt_block_size_bytes gauge\n";
+        std::ostringstream blockCount;
+        blockCount << "# HELP blksnap_cbt_block_count The number of the change tracking blocks.\n"
+                   << "# TYPE blksnap_cbt_block_count gauge\n";
+        std::ostringstream changed;
+        changed << "# HELP blksnap_cbt_changed_blocks The number of blocks changed between the two last snapshots.\n"
+                << "# TYPE blksnap_cbt_changed_blocks gauge\n";
+        std::ostringstream changesNumber;
+        changesNumber << "# HELP blksnap_cbt_changes_number The number of the last snapshot.\n"
+                      << "# TYPE blksnap_cbt_changes_number gauge\n";
+        std::ostringstream errors;
+        errors << "# HELP blksnap_snapshot_error_code The error code of the snapshot of the device.\n"
+               << "# TYPE blksnap_snapshot_error_code gauge\n";
+
+        std::vector<uint8_t> map;
+        for (auto it = m_trackers.begin(); it != m_trackers.end();)
+        {
+            const std::string label = "{device=\"/dev/" + it->first + "\"} ";
+            struct blksnap_cbtinfo info;
+            struct blksnap_snapshotinfo snapshotInfo;
+            size_t changedCount = 0;
+
+            try
+            {
+                it->second->CbtInfo(info);
+                it->second->SnapshotInfo(snapshotInfo);
+
+                /*
+                 * The map contains the state at the moment of the last
+                 * snapshot, so the blocks changed before it are counted.
+                 */
+                if (info.changes_number)
+                {
+                    map.resize(std::min(cbtWindow, static_cast<size_t>(info.block_count)));
+                    for (unsigned int offset = 0; offset < info.block_count; offset += map.size())
+                    {
+                        unsigned int length =
+                            std::min(static_cast<unsigned int>(map.size()), info.block_count - offset);
+
+                        it->second->ReadCbtMap(offset, length, map.data());
+                        changedCount += blksnap::CbtChangedCount(map.data(), length, info.changes_number - 1);
+                    }
+                }
+            }
+            catch (std::exception&)
+            {
+                // The filter was detached from the device.
+                it = m_trackers.erase(it);
+                continue;
+            }
+
+            blockSize << "blksnap_cbt_block_size_bytes" << label << info.block_size << "\n";
+            blockCount << "blksnap_cbt_block_count" << label << info.block_count << "\n";
+            changed << "blksnap_cbt_changed_blocks" << label << changedCount << "\n";
+            changesNumber << "blksnap_cbt_changes_number" << label << static_cast<int>(info.changes_number) << "\n";
+            errors << "blksnap_snapshot_error_code" << label << snapshotInfo.error_code << "\n";
+            ++it;
+        }
+        ss << blockSize.str() << blockCount.str() << changed.str() << changesNumber.str() << errors.str();
+
+        size_t snapshotCount = 0;
+        try
+        {
+            std::vector<blksnap::CSnapshotId> ids;
+
+            blksnap::CService().Collect(ids);
+            snapshotCount = ids.size();
+        }
+        catch (std::exception&)
+        {
+            // The module is not loaded.
+        }
+        ss << "# HELP blksnap_snapshots The number of snapshots.\n"
+           << "# TYPE blksnap_snapshots gauge\n"
+           << "blksnap_snapshots " << snapshotCount << "\n"
+           << "# HELP blksnap_corrupted_events_total The number of the corrupted events received by the daemon.\n"
+           << "# TYPE blksnap_corrupted_events_total counter\n"
+           << "blksnap_corrupted_events_total " << m_corruptedEvents << "\n";
+
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+
+            ss << std::setprecision(9);
+            ss << "# HELP blksnap_take_seconds The time of taking the snapshots.\n"
+               << "# TYPE blksnap_take_seconds summary\n"
+               << "blksnap_take_seconds_sum " << m_takeLatency.sum << "\n"
+               << "blksnap_take_seconds_count " << m_takeLatency.count << "\n"
+               << "# HELP blksnap_destroy_seconds The time of destroying the snapshots.\n"
+               << "# TYPE blksnap_destroy_seconds summary\n"
+               << "blksnap_destroy_seconds_sum " << m_destroyLatency.sum << "\n"
+               << "blksnap_destroy_seconds_count " << m_destroyLatency.count << "\n"
+               << "# HELP blksnap_snapshot_take_seconds The time of taking the snapshot that is being held.\n"
+               << "# TYPE blksnap_snapshot_take_seconds gauge\n";
+            for (const auto& it : m_sessionTakeLatency)
+                ss << "blksnap_snapshot_take_seconds{snapshot=\"" << it.first << "\"} " << it.second << "\n";
+        }
+
+        /*
+         * The collector should never read the incomplete file.
+         */
+        const std::string tmpFile = m_metricsFile + ".tmp";
+        {
+            std::ofstream output(tmpFile, std::ofstream::trunc);
+
+            output << ss.str();
+            output.flush();
+            if (output.fail())
+                throw std::runtime_error("Failed to write file [" + tmpFile + "].");
+        }
+        if (::rename(tmpFile.c_str(), m_metricsFile.c_str()))
+            throw std::system_error(errno, std::generic_category(),
+                                    "Failed to rename file [" + tmpFile + "] to [" + m_metricsFile + "].");
+    };
+
+    void MetricsWriter()
+    {
+        const auto interval = std::chrono::seconds(m_metricsInterval);
+        auto next = std::chrono::steady_clock::now();
+
+        while (!isTerminate)
+        {
+            if (std::chrono::steady_clock::now() < next)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(watchIntervalMs));
+                continue;
+            }
+            next += interval;
+
+            try
+            {
+                WriteMetrics();
+            }
+            catch (std::exception& ex)
+            {
+                std::cerr << ex.what() << std::endl;
+            }
+        }
+    };
+
+    void DeliverEvents()
+    {
+        uint64_t value;
+        std::list<std::pair<std::string, std::string>> events;
+        std::list<std::shared_ptr<SJob>> jobs;
+
+        if (::read(m_eventFd, &value, sizeof(value)) < 0)
+            return;
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            events.swap(m_events);
+            jobs.swap(m_completedJobs);
+        }
+
+        std::set<int> fds;
+        for (const auto& job : jobs)
+        {
+            const auto it = m_clients.find(job->fd);
+
+            // The client has disconnected, the rest of the job is dropped.
+            if ((it == m_clients.end()) || (it->second.id != job->clientId))
+                continue;
+
+            SClient& client = it->second;
+            client.output += job->output;
+            job->isQueued = false;
+            if (job->isDone)
+            {
+                if (!job->isFailed && job->complete)
+                    job->complete(client);
+                client.job.reset();
+                client.output += client.events;
+                client.events.clear();
+                ProcessInput(job->fd);
+            }
+            fds.insert(job->fd);
+        }
+
+        for (auto& it : m_clients)
+        {
+            std::string& output = it.second.job ? it.second.events : it.second.output;
+
+            for (const auto& ev : events)
+                if (it.second.subscriptions.count(ev.first))
+                    output += ev.second;
+            if (!it.second.output.empty())
+                fds.insert(it.first);
+        }
+        for (int fd : fds)
+            Send(fd);
+    };
+
+private:
+    std::string m_socketPath;
+    std::string m_metricsFile;
+    unsigned int m_metricsInterval;
+    int m_listenFd;
+    int m_epollFd;
+    int m_eventFd;
+    std::map<int, SClient> m_clients;
+    unsigned long long m_nextClientId;
+
+    std::mutex m_lock;
+    std::map<std::string, std::shared_ptr<blksnap::CSnapshot>> m_snapshots;
+    std::set<std::string> m_foreignSnapshots;
+    std::list<std::pair<std::string, std::string>> m_events;
+    std::list<std::shared_ptr<SJob>> m_jobs;
+    std::list<std::shared_ptr<SJob>> m_completedJobs;
+    std::condition_variable m_jobCond;
+    SLatency m_takeLatency;
+    SLatency m_destroyLatency;
+    std::map<std::string, double> m_sessionTakeLatency;
+
+    std::atomic<unsigned long long> m_corruptedEvents;
+    std::map<std::string, std::shared_ptr<blksnap::CTracker>> m_trackers;
+    std::set<std::string> m_untracked;
+    std::set<std::string> m_blockDevices;
+    std::chrono::steady_clock::time_point m_untrackedCheckTime;
+    std::atomic<bool> m_isFilterAttached;
+};
+
+int main(int argc, char* argv[])
+{
+    int ret = 0;
+    po::options_description desc("Local control daemon for the blksnap kernel module.");
+
+    desc.add_options()
+        ("help,h", "Print usage.")
+        ("socket,s", po::value<std::string>()->default_value(defaultSocketPath), "The Unix domain socket path.")
+        ("metrics-file,m", po::value<std::string>(), "The file for the metrics in the Prometheus text format, for example, for the textfile collector of the node_exporter.")
+        ("metrics-interval", po::value<unsigned int>()->default_value(defaultMetricsInterval), "The interval between the metrics updates in seconds.");
+
+    try
+    {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help"))
+        {
+            std::cout << desc << std::endl;
+            return 0;
+        }
+
+        struct sigaction sa = {};
+        sa.sa_handler = signalHandler;
+        ::sigaction(SIGINT, &sa, nullptr);
+        ::sigaction(SIGTERM, &sa, nullptr);
+
+        if (!vm["metrics-interval"].as<unsigned int>())
+            throw std::invalid_argument("Argument 'metrics-interval' cannot be zero.");
+
+        CDaemon daemon(vm["socket"].as<std::string>(),
+                       vm.count("metrics-file") ? vm["metrics-file"].as<std::string>() : std::string(),
+                       vm["metrics-interval"].as<unsigned int>());
+        daemon.Run();
+    }
+    catch (std::exception& ex)
+    {
+        std::cerr << ex.what() << std::endl;
+        ret = 1;
+    }
+
+    return ret;
+}